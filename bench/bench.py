@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""
+Runs the ij programs in bench/ through the JIT and, compiled to IJVM, through
+a reference interpreter. For each it measures the compile time, the run time,
+the peak RSS and the size of the emitted code. It checks that both runs give
+the same output and exit code, and writes the numbers as JSON.
+
+    bench/bench.py [-i ./ij] [-o bench.json] [--baseline old.json] [names...]
+
+The reference interpreter defaults to ij's own interp engine. Any command
+that takes the .ijvm file as its last argument works, e.g. --ijvm "ijvm".
+"""
+import argparse
+import json
+import os
+import shlex
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def rc4_input():
+    """A MiB of pseudo random bytes, without the nul ending the input."""
+    data, x = bytearray(), 1
+    for _ in range(1 << 20):
+        x = (x * 1103515245 + 12345) & 0x7FFFFFFF
+        data.append(x % 255 + 1)
+    return bytes(data)
+
+
+# whatever a benchmark reads from stdin, the others get nothing
+INPUTS = {"rc4": rc4_input}
+
+
+def run(cmd, stdin=b""):
+    """Runs cmd, returns its exit code, stdout, wall time and peak RSS in KiB."""
+    with tempfile.TemporaryFile() as inp, tempfile.TemporaryFile() as out:
+        inp.write(stdin)
+        inp.seek(0)
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd, stdin=inp, stdout=out,
+                                stderr=subprocess.DEVNULL)
+        _, status, usage = os.wait4(proc.pid, 0)
+        elapsed = time.perf_counter() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        out.seek(0)
+        return proc.returncode, out.read(), elapsed, usage.ru_maxrss
+
+
+def best(cmd, repeat, stdin=b""):
+    """The fastest of repeat runs, with the peak RSS of any of them."""
+    runs = [run(cmd, stdin) for _ in range(repeat)]
+    code, output, _, _ = runs[0]
+    return code, output, min(r[2] for r in runs), max(r[3] for r in runs)
+
+
+def compile_to(ij, src, fmt, path, repeat):
+    code, _, elapsed, rss = best(
+        [ij, "compile", "--no-cache", "-f", fmt, "-o", path, src], repeat)
+    if code != 0:
+        raise RuntimeError(f"{src} doesn't compile to {fmt}")
+    return {"compile_s": elapsed, "compile_rss_kib": rss,
+            "code_bytes": os.path.getsize(path)}
+
+
+def bench(name, args, tmp):
+    src = os.path.join(BENCH_DIR, name + ".ij")
+    stdin = INPUTS[name]() if name in INPUTS else b""
+    ijvm = os.path.join(tmp, name + ".ijvm")
+    x64 = os.path.join(tmp, name + ".x64")
+
+    result = {
+        "ijvm": compile_to(args.ij, src, "ijvm", ijvm, args.repeat),
+        "x64": compile_to(args.ij, src, "x64", x64, args.repeat),
+    }
+
+    jit_code, jit_out, jit_s, jit_rss = best(
+        [args.ij, "run", "--no-cache", src], args.repeat, stdin)
+    result["jit"] = {"run_s": jit_s, "rss_kib": jit_rss, "exit": jit_code}
+
+    ref_code, ref_out, ref_s, ref_rss = best(
+        shlex.split(args.ijvm) + [ijvm], args.repeat, stdin)
+    result["interpreter"] = {"run_s": ref_s, "rss_kib": ref_rss,
+                             "exit": ref_code}
+
+    result["output_matches"] = jit_out == ref_out and jit_code == ref_code
+    return result
+
+
+def compare(results, baseline):
+    """Prints the ratio of every timing to the baseline, > 1 is slower."""
+    print(f"\n{'':12}{'ijvm c':>10}{'x64 c':>10}{'jit':>10}{'interp':>10}",
+          file=sys.stderr)
+    for name, r in results.items():
+        b = baseline.get(name)
+        if not b:
+            continue
+        ratios = [r["ijvm"]["compile_s"] / b["ijvm"]["compile_s"],
+                  r["x64"]["compile_s"] / b["x64"]["compile_s"],
+                  r["jit"]["run_s"] / b["jit"]["run_s"],
+                  r["interpreter"]["run_s"] / b["interpreter"]["run_s"]]
+        print(f"{name:12}" + "".join(f"{x:10.2f}" for x in ratios),
+              file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("-i", "--ij", default="./ij", help="the ij binary")
+    parser.add_argument("--ijvm", help="the reference IJVM interpreter, "
+                        "default: ij run --engine interp")
+    parser.add_argument("-o", "--output", help="JSON file, default stdout")
+    parser.add_argument("--baseline", help="JSON of an earlier run")
+    parser.add_argument("-r", "--repeat", type=int, default=3,
+                        help="runs per measurement, the fastest counts")
+    parser.add_argument("names", nargs="*", help="default: all of bench/")
+    args = parser.parse_args()
+
+    args.ij = os.path.abspath(args.ij)
+    if not args.ijvm:
+        args.ijvm = f"{shlex.quote(args.ij)} run --no-cache --engine interp"
+    names = args.names or sorted(
+        f[:-3] for f in os.listdir(BENCH_DIR) if f.endswith(".ij"))
+
+    results = {}
+    with tempfile.TemporaryDirectory() as tmp:
+        for name in names:
+            print(f"bench: {name}", file=sys.stderr)
+            results[name] = bench(name, args, tmp)
+
+    text = json.dumps({"ij": args.ij, "benchmarks": results}, indent=2)
+    if args.output:
+        with open(args.output, "w") as out:
+            out.write(text + "\n")
+    else:
+        print(text)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            compare(results, json.load(f)["benchmarks"])
+
+    mismatches = [n for n, r in results.items() if not r["output_matches"]]
+    if mismatches:
+        print("bench: output differs for " + ", ".join(mismatches),
+              file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
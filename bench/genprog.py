@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+"""
+Generates ij, JAS or IJVM programs of a given size and shape, to see how the
+compiler copes with programs far larger than anything in test/.
+
+    bench/genprog.py [-f ij|jas|ijvm] [-o out] [--functions N] [--depth N]
+                     [--constants N] [--locals N] [--statements N]
+
+Every function f<i>(x) sets its locals from x, opens depth nested ifs and
+loops that run once, does its statements in the innermost of them and
+returns what its callees f<2i+1> and f<2i+2> return plus two of its locals.
+Statements are v<a> = v<b> + (v<c> & k<m>), round robin over the locals and
+constants. The three formats describe the same program: whatever the shape,
+they all print the same letter, which makes a quick check of the backends.
+"""
+import argparse
+import struct
+import sys
+
+MASK = 0x7FFF
+
+
+def constant(m):
+    return m * 7919 & MASK
+
+
+def pick(i, s, shape):
+    """The locals and constant used by statement s of function i."""
+    n = shape.locals
+    return ((i + s) % n, (i + 3 * s + 1) % n, (i + 7 * s + 2) % n,
+            (i * shape.statements + s) % shape.constants
+            if shape.constants else None)
+
+
+def indent(level):
+    """Capped, or the source would grow with the square of the depth."""
+    return "  " * min(level + 1, 8)
+
+
+def children(i, shape):
+    return [c for c in (2 * i + 1, 2 * i + 2) if c < shape.functions]
+
+
+def ij(shape):
+    out = [f"constant k{m} = {constant(m)};" for m in range(shape.constants)]
+
+    for i in range(shape.functions):
+        out.append(f"function f{i}(x) {{")
+        for j in range(shape.locals):
+            out.append(f"  var v{j} = x + {j & 0x7F};")
+
+        for level in range(shape.depth):
+            if level % 2:
+                out.append(f"{indent(level)}for (var d{level} = 0; "
+                           f"d{level} < 1; d{level} += 1) {{")
+            else:
+                out.append(f"{indent(level)}if (v{level % shape.locals} "
+                           ">= 0) {")
+
+        for s in range(shape.statements):
+            a, b, c, m = pick(i, s, shape)
+            mask = f"k{m}" if m is not None else "63"
+            out.append(f"{indent(shape.depth)}v{a} = v{b} + (v{c} & {mask});")
+
+        for level in reversed(range(shape.depth)):
+            out.append(indent(level) + "}")
+
+        calls = "".join(f" + f{c}(x{' + 1' if c % 2 else ''})"
+                        for c in children(i, shape))
+        out.append(f"  return (v0 + v{shape.locals - 1}{calls}) & {MASK};")
+        out.append("}")
+
+    out += ["function __main__() {",
+            "  $putc('a' + (f0(1) & 15));",
+            "  $putc('\\n');",
+            "  return 0;",
+            "}"]
+    return "\n".join(out) + "\n"
+
+
+def methods(shape):
+    """The program as (name, args, vars, instructions), main first."""
+    main = [("LDC_W", "objref"), ("BIPUSH", 1), ("INVOKEVIRTUAL", "f0"),
+            ("BIPUSH", 15), ("IAND",), ("BIPUSH", ord("a")), ("IADD",),
+            ("OUT",), ("BIPUSH", 10), ("OUT",), ("HALT",)]
+    result = [("main", [], [], main)]
+
+    for i in range(shape.functions):
+        code = []
+        for j in range(shape.locals):
+            code += [("ILOAD", "x"), ("BIPUSH", j & 0x7F), ("IADD",),
+                     ("ISTORE", f"v{j}")]
+
+        for level in range(shape.depth):
+            code += [("label", f"top{level}"),
+                     ("ILOAD", f"v{level % shape.locals}"),
+                     ("IFLT", f"end{level}")]
+
+        for s in range(shape.statements):
+            a, b, c, m = pick(i, s, shape)
+            code += [("ILOAD", f"v{b}"), ("ILOAD", f"v{c}"),
+                     ("LDC_W", f"k{m}") if m is not None else ("BIPUSH", 63),
+                     ("IAND",), ("IADD",), ("ISTORE", f"v{a}")]
+
+        # the loops jump back when x < 0, which it never is
+        for level in reversed(range(shape.depth)):
+            if level % 2:
+                code += [("ILOAD", "x"), ("IFLT", f"top{level}")]
+            code += [("label", f"end{level}")]
+
+        code += [("ILOAD", "v0"), ("ILOAD", f"v{shape.locals - 1}"),
+                 ("IADD",)]
+        for c in children(i, shape):
+            code += [("LDC_W", "objref"), ("ILOAD", "x")]
+            if c % 2:
+                code += [("BIPUSH", 1), ("IADD",)]
+            code += [("INVOKEVIRTUAL", f"f{c}"), ("IADD",)]
+        code += [("LDC_W", "mask"), ("IAND",), ("IRETURN",)]
+
+        result.append((f"f{i}", ["x"],
+                       [f"v{j}" for j in range(shape.locals)], code))
+    return result
+
+
+def constants(shape):
+    return ([(f"k{m}", constant(m)) for m in range(shape.constants)] +
+            [("objref", 0xD00D00), ("mask", MASK)])
+
+
+def jas(shape):
+    out = [".constant"]
+    out += [f"    {name} {value}" for name, value in constants(shape)]
+    out.append(".end-constant")
+
+    for name, args, variables, code in methods(shape):
+        if name == "main":
+            out.append("\n.main")
+        else:
+            out.append(f"\n.method {name}({', '.join(args)})")
+        if variables:
+            out += [".var"] + [f"    {v}" for v in variables] + [".end-var"]
+        for ins in code:
+            if ins[0] == "label":
+                out.append(f"{ins[1]}:")
+            else:
+                out.append("    " + " ".join(str(x) for x in ins))
+        out.append(".end-main" if name == "main" else ".end-method")
+    return "\n".join(out) + "\n"
+
+
+OPCODES = {"BIPUSH": 0x10, "GOTO": 0xA7, "HALT": 0xFF, "IADD": 0x60,
+           "IAND": 0x7E, "IFLT": 0x9B, "ILOAD": 0x15, "INVOKEVIRTUAL": 0xB6,
+           "IRETURN": 0xAC, "ISTORE": 0x36, "LDC_W": 0x13, "OUT": 0xFD,
+           "WIDE": 0xC4}
+
+
+def ijvm(shape):
+    """Assembles methods() the way IJVMAssembler would."""
+    pool = constants(shape)
+    index = {name: i for i, (name, _) in enumerate(pool)}
+    text = bytearray()
+    invokes = []  # (offset, function)
+
+    for name, args, variables, code in methods(shape):
+        if name != "main":
+            index[name] = len(pool)
+            pool.append((name, len(text)))
+            text += struct.pack(">HH", len(args) + 1, len(variables))
+            slots = ["objref"] + args + variables
+        else:
+            slots = variables
+        slot = {v: i for i, v in enumerate(slots)}
+
+        labels, jumps = {}, []
+        for ins in code:
+            op, arg = ins[0], ins[1] if len(ins) > 1 else None
+            if op == "label":
+                labels[arg] = len(text)
+            elif op in ("ILOAD", "ISTORE"):
+                if slot[arg] > 255:
+                    text += bytes([OPCODES["WIDE"], OPCODES[op]])
+                    text += struct.pack(">H", slot[arg])
+                else:
+                    text += bytes([OPCODES[op], slot[arg]])
+            elif op == "BIPUSH":
+                text += bytes([OPCODES[op]]) + struct.pack(">b", arg)
+            elif op == "LDC_W":
+                text += bytes([OPCODES[op]]) + struct.pack(">H", index[arg])
+            elif op in ("GOTO", "IFLT"):
+                jumps.append((len(text), arg))
+                text += bytes([OPCODES[op], 0, 0])
+            elif op == "INVOKEVIRTUAL":
+                invokes.append((len(text), arg))
+                text += bytes([OPCODES[op], 0, 0])
+            else:
+                text += bytes([OPCODES[op]])
+
+        for at, label in jumps:
+            text[at + 1:at + 3] = struct.pack(">h", labels[label] - at)
+
+    for at, function in invokes:
+        text[at + 1:at + 3] = struct.pack(">H", index[function])
+
+    out = struct.pack(">III", 0x1DEADFAD, 0xD000D000, 4 * len(pool))
+    out += b"".join(struct.pack(">i", value) for _, value in pool)
+    out += struct.pack(">II", 0, len(text)) + bytes(text)
+    return out
+
+
+FORMATS = {"ij": ij, "jas": jas, "ijvm": ijvm}
+
+
+def shape_arguments(parser):
+    parser.add_argument("--functions", type=int, default=16)
+    parser.add_argument("--depth", type=int, default=2,
+                        help="nested ifs and loops around the statements")
+    parser.add_argument("--constants", type=int, default=16)
+    parser.add_argument("--locals", type=int, default=8,
+                        help="more than 255 need WIDE")
+    parser.add_argument("--statements", type=int, default=16,
+                        help="per function")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("-f", "--format", choices=FORMATS, default="ij")
+    parser.add_argument("-o", "--output", help="default stdout")
+    shape_arguments(parser)
+    shape = parser.parse_args()
+    if shape.functions < 1 or shape.locals < 1:
+        parser.error("need at least one function and one local")
+
+    program = FORMATS[shape.format](shape)
+    if isinstance(program, str):
+        program = program.encode()
+    if shape.output:
+        with open(shape.output, "wb") as out:
+            out.write(program)
+    else:
+        sys.stdout.buffer.write(program)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,312 @@
+/*
+ * Microbenchmarks of the compiler's own hot paths, make microbench. Each
+ * benchmark prepares its input, then times only the part it is named after,
+ * a number of times over. Reported are the spread of those repetitions and
+ * the throughput at the median.
+ *
+ *     bench/microbench [-r repetitions] [name...]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <unistd.h>
+#include <frontends/ij/compile.hpp>
+#include <backends/ijvm_assembler.hpp>
+#include <backends/x64_assembler.hpp>
+#include <util/logger.hpp>
+
+using clock_type = std::chrono::steady_clock;
+
+/* times the parts of a repetition between start and stop */
+class Stopwatch {
+  public:
+    Stopwatch() : _elapsed{0} {}
+
+    void start() { _start = clock_type::now(); }
+    void stop() { _elapsed += clock_type::now() - _start; }
+    double seconds() const {
+        return std::chrono::duration<double>(_elapsed).count();
+    }
+
+  private:
+    clock_type::time_point _start;
+    clock_type::duration _elapsed;
+};
+
+struct benchmark {
+    const char *name;
+    const char *unit; /* what the items are */
+    std::function<u64(Stopwatch &)> run; /* returns the number of items */
+};
+
+/* a source file that lives as long as the benchmarks do */
+class TempSource {
+  public:
+    TempSource(const string &contents) {
+        char path[] = "/tmp/ij-microbench-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0)
+            log.panic("microbench: can't create a temporary file, %s",
+                      strerror(errno));
+        close(fd);
+
+        _path = path;
+        std::ofstream{_path} << contents;
+    }
+    ~TempSource() { unlink(_path.c_str()); }
+
+    const string &path() const { return _path; }
+
+  private:
+    string _path;
+};
+
+/* the lexer as parse_program sets it up */
+static void add_ij_source(Lexer &l, const string &path) {
+    setup_lexer(l);
+    l.add_source(path);
+}
+
+static string n(size_t i) { return std::to_string(i); }
+
+/* the same expression over and over, each of them 17 nodes */
+static string expressions(size_t count) {
+    string s;
+    for (size_t i = 0; i < count; i++)
+        s += "a + (b & 0x1f) - f(c, d * 4) | e[i + " + n(i) + "] - 'x';\n";
+    return s;
+}
+
+/*
+ * A binary tree of calls below entry, which comes first and so takes the
+ * place of main for prune, next to as many functions nothing calls. Every
+ * function uses one of the constants.
+ */
+static string call_graph(size_t functions) {
+    string s;
+    for (size_t i = 0; i < 64; i++)
+        s += "constant c" + n(i) + " = " + n(i) + ";\n";
+
+    s += "function entry() {\n  return f0(1);\n}\n";
+    for (size_t i = 0; i < functions; i++) {
+        s += "function f" + n(i) + "(x) {\n";
+        if (2 * i + 2 < functions)
+            s += "  return f" + n(2 * i + 1) + "(x) + f" + n(2 * i + 2) +
+                 "(x + c" + n(i % 64) + ");\n";
+        else
+            s += "  return x + c" + n(i % 64) + ";\n";
+        s += "}\n";
+        s += "function dead" + n(i) + "(x) {\n  return f" + n(i) +
+             "(x) + dead" + n((i + 1) % functions) + "(x);\n}\n";
+    }
+    return s;
+}
+
+/*
+ * Functions made of loops, each iteration does some arithmetic, an array
+ * load, a call and two jumps. Returns the number of instructions.
+ */
+static u64 emit_program(Assembler &a, size_t functions, size_t loops) {
+    u64 ops = 0;
+    a.constant("__OBJREF__", 0x00d00d00);
+
+    a.function("main", {}, {});
+    a.LDC_W("__OBJREF__");
+    a.BIPUSH(1);
+    a.BIPUSH(2);
+    a.INVOKEVIRTUAL("f0");
+    a.HALT();
+    ops += 5;
+
+    a.function("leaf", {"x"}, {});
+    a.ILOAD("x");
+    a.IRETURN();
+    ops += 2;
+
+    for (size_t i = 0; i < functions; i++) {
+        a.function("f" + n(i), {"a", "b"}, {"x", "y"});
+        for (size_t j = 0; j < loops; j++) {
+            string loop = "loop" + n(j), end = "end" + n(j);
+            a.label(loop);
+            a.ILOAD("a");
+            a.ILOAD("b");
+            a.IADD();
+            a.ISTORE("x");
+            a.ILOAD("x");
+            a.BIPUSH(3);
+            a.ISUB();
+            a.IFLT(end);
+            a.LDC_W("__OBJREF__");
+            a.ILOAD("x");
+            a.INVOKEVIRTUAL("leaf");
+            a.ISTORE("y");
+            a.ILOAD("y");
+            a.ILOAD("a");
+            a.IALOAD();
+            a.ISTORE("b");
+            a.IINC("x", 1);
+            a.GOTO(loop);
+            a.label(end);
+            ops += 18;
+        }
+        a.ILOAD("x");
+        a.IRETURN();
+        ops += 2;
+    }
+    return ops;
+}
+
+static std::vector<benchmark> benchmarks() {
+    static TempSource tokens{call_graph(2000)};
+    static TempSource exprs{expressions(20000)};
+    static TempSource graph{call_graph(5000)};
+
+    return {
+        {"lexer", "tokens",
+         [](Stopwatch &watch) {
+             Lexer l;
+             add_ij_source(l, tokens.path());
+
+             u64 count = 0;
+             watch.start();
+             while (l.has_token()) {
+                 l.peek();
+                 l.get();
+                 count++;
+             }
+             watch.stop();
+             return count;
+         }},
+
+        {"parse_expr", "nodes",
+         [](Stopwatch &watch) {
+             Lexer l;
+             add_ij_source(l, exprs.path());
+
+             u64 nodes = 0;
+             std::vector<const Expr *> all;
+             watch.start();
+             while (l.has_token()) {
+                 std::unique_ptr<Expr> e{parse_expr(l)};
+                 l.expect(TokenType::SemiColon, true);
+                 e->expressions(all);
+                 nodes += all.size();
+                 all.clear();
+             }
+             watch.stop();
+             return nodes;
+         }},
+
+        {"prune", "functions",
+         [](Stopwatch &watch) {
+             Lexer l;
+             add_ij_source(l, graph.path());
+             std::unique_ptr<Program> p{parse_program(l)};
+             u64 functions = p->funcs.size();
+
+             watch.start();
+             prune(*p, false);
+             watch.stop();
+             return functions;
+         }},
+
+        {"ijvm_link", "fixups",
+         [](Stopwatch &watch) {
+             IJVMAssembler a;
+             emit_program(a, 500, 40);
+
+             // function indices as compile would hand them out
+             std::unordered_map<string, u32> findexes{{"main", 1},
+                                                      {"leaf", 2}};
+             for (size_t i = 0; i < 500; i++)
+                 findexes["f" + n(i)] = i + 3;
+
+             watch.start();
+             a.link(findexes);
+             watch.stop();
+             return u64{1 + 500 * 40 * 3};
+         }},
+
+        {"x64_emit", "ops",
+         [](Stopwatch &watch) {
+             X64Assembler a;
+             u64 ops = emit_program(a, 200, 40);
+             std::ostream null{nullptr};
+
+             watch.start();
+             a.compile(null);
+             watch.stop();
+             return ops;
+         }},
+    };
+}
+
+static void report(const benchmark &b, std::vector<double> seconds, u64 items) {
+    std::sort(seconds.begin(), seconds.end());
+    size_t reps = seconds.size();
+    double median = reps % 2 ? seconds[reps / 2]
+                             : (seconds[reps / 2 - 1] + seconds[reps / 2]) / 2;
+
+    double mean = 0, variance = 0;
+    for (double s : seconds)
+        mean += s / reps;
+    for (double s : seconds)
+        variance += (s - mean) * (s - mean) / reps;
+
+    string unit = string(b.unit) + "/s";
+    printf("%-12s %5zu %10.3f %10.3f %10.3f %7.1f%% %12.0f %-10s %8.1f\n",
+           b.name, reps, seconds[0] * 1e3, median * 1e3, mean * 1e3,
+           100 * __builtin_sqrt(variance) / mean, items / median, unit.c_str(),
+           1e9 * median / items);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: microbench [-r repetitions] [name...]\n");
+    for (const benchmark &b : benchmarks())
+        fprintf(stderr, "    %s\n", b.name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    size_t reps = 10;
+    std::vector<string> only;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            reps = strtoul(argv[++i], nullptr, 10);
+        else if (argv[i][0] == '-')
+            usage();
+        else
+            only.push_back(argv[i]);
+    }
+    if (reps == 0)
+        usage();
+
+    printf("%-12s %5s %10s %10s %10s %8s %12s %-10s %8s\n", "benchmark",
+           "reps", "min ms", "median ms", "mean ms", "stddev", "throughput",
+           "", "ns/item");
+    for (const benchmark &b : benchmarks()) {
+        if (!only.empty() &&
+            std::find(only.begin(), only.end(), b.name) == only.end())
+            continue;
+
+        // one run to warm up the caches and the allocator
+        Stopwatch warmup;
+        u64 items = b.run(warmup);
+
+        std::vector<double> seconds;
+        for (size_t i = 0; i < reps; i++) {
+            Stopwatch watch;
+            b.run(watch);
+            seconds.push_back(watch.seconds());
+        }
+        report(b, seconds, items);
+        fflush(stdout);
+    }
+    return 0;
+}
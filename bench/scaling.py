@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+"""
+Grows generated programs (bench/genprog.py) along one axis at a time and
+compiles each size, recording the compile time and peak RSS and, from the
+--trace, the time of every compiler phase. Fits how each of those grows with
+the size and flags whatever grows faster than linearly.
+
+    bench/scaling.py [-i ./ij] [-o scaling.json] [--steps 4] [axes...]
+
+The smallest size of every axis is also run through the JIT and the
+interpreter, from every source format, which must all print the same.
+Exits 1 when something is super-linear or a run disagrees.
+"""
+import argparse
+import json
+import math
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, BENCH_DIR)
+import genprog  # noqa: E402
+
+BASE = {"functions": 16, "depth": 2, "constants": 16, "locals": 8,
+        "statements": 16}
+
+# axis -> (first size, the rest of the shape as a function of the size)
+AXES = {
+    "functions": (1000, lambda n: {"functions": n}),
+    # nothing around the statements, jumps over them wouldn't reach
+    "statements": (2000, lambda n: {"functions": 4, "depth": 0,
+                                    "statements": n}),
+    "depth": (100, lambda n: {"functions": 4, "depth": n}),
+    # as many uses as there are constants, unused ones never reach codegen
+    "constants": (1000, lambda n: {"functions": 16, "constants": n,
+                                   "statements": n // 16}),
+    "locals": (128, lambda n: {"functions": 16, "locals": n}),
+}
+
+# source format -> the formats it is compiled to
+COMPILES = {"ij": ["ijvm", "x64"], "jas": ["ijvm", "x64"], "ijvm": ["x64"]}
+
+
+def shape(axis, size):
+    s = dict(BASE)
+    s.update(AXES[axis][1](size))
+    return argparse.Namespace(**s)
+
+
+def generate(axis, size, fmt, tmp):
+    path = os.path.join(tmp, f"{axis}-{size}.{fmt}")
+    program = genprog.FORMATS[fmt](shape(axis, size))
+    with open(path, "wb") as out:
+        out.write(program.encode() if isinstance(program, str) else program)
+    return path
+
+
+def phases(trace):
+    """Milliseconds per phase of the whole program, summed by name."""
+    with open(trace) as f:
+        events = json.load(f)["traceEvents"]
+    result = {}
+    for e in events:
+        if e.get("cat") == "phase":
+            result[e["name"]] = result.get(e["name"], 0) + e["dur"] / 1e3
+    return result
+
+
+def compile_one(ij, src, fmt, tmp):
+    trace = os.path.join(tmp, "trace.json")
+    cmd = [ij, "compile", "--no-cache", "--trace", trace, "-f", fmt,
+           "-o", os.devnull, src]
+    start = time.perf_counter()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE)
+    _, status, usage = os.wait4(proc.pid, 0)
+    elapsed = time.perf_counter() - start
+    if os.waitstatus_to_exitcode(status) != 0:
+        raise RuntimeError(f"{' '.join(cmd)} failed:\n" +
+                           proc.stderr.read().decode(errors="replace"))
+    result = {"total": elapsed * 1e3, "rss_kib": usage.ru_maxrss}
+    result.update(phases(trace))
+    return result
+
+
+def exponent(sizes, values):
+    """Least squares slope of log(value) over log(size)."""
+    points = [(math.log(s), math.log(v))
+              for s, v in zip(sizes, values) if v > 0]
+    if len(points) < 2:
+        return 0.0
+    mx = sum(x for x, _ in points) / len(points)
+    my = sum(y for _, y in points) / len(points)
+    sxx = sum((x - mx) ** 2 for x, _ in points)
+    return sum((x - mx) * (y - my) for x, y in points) / sxx
+
+
+def check_outputs(ij, axis, size, tmp):
+    """The letter printed by every format and engine, which should agree."""
+    outputs = {}
+    for fmt in COMPILES:
+        src = generate(axis, size, fmt, tmp)
+        for engine in ("jit", "interp"):
+            proc = subprocess.run([ij, "run", "--no-cache", "-e", engine, src],
+                                  stdin=subprocess.DEVNULL,
+                                  capture_output=True, timeout=60)
+            outputs[f"{fmt} {engine}"] = (proc.returncode, proc.stdout)
+    return outputs
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("-i", "--ij", default="./ij", help="the ij binary")
+    parser.add_argument("-o", "--output", help="JSON file, default stdout")
+    parser.add_argument("--steps", type=int, default=4,
+                        help="sizes per axis, each double the last")
+    parser.add_argument("--threshold", type=float, default=1.3,
+                        help="exponents above this are super-linear")
+    parser.add_argument("--min-ms", type=float, default=20,
+                        help="phases faster than this at the largest size "
+                        "are noise, not flagged")
+    parser.add_argument("axes", nargs="*", help="default: " + ", ".join(AXES))
+    args = parser.parse_args()
+    args.ij = os.path.abspath(args.ij)
+
+    results, flagged, disagree = {}, [], []
+    with tempfile.TemporaryDirectory() as tmp:
+        for axis in args.axes or AXES:
+            first = AXES[axis][0]
+            sizes = [first << i for i in range(args.steps)]
+
+            outputs = check_outputs(args.ij, axis, first, tmp)
+            if len(set(outputs.values())) != 1:
+                disagree.append(axis)
+                print(f"scaling: {axis} {first} prints differently: "
+                      f"{outputs}", file=sys.stderr)
+
+            results[axis] = {}
+            for src_fmt, targets in COMPILES.items():
+                for fmt in targets:
+                    key = f"{src_fmt} -> {fmt}"
+                    runs = []
+                    for size in sizes:
+                        print(f"scaling: {axis} {size} {key}",
+                              file=sys.stderr)
+                        src = generate(axis, size, src_fmt, tmp)
+                        runs.append(compile_one(args.ij, src, fmt, tmp))
+
+                    exponents = {}
+                    for what in runs[-1]:
+                        values = [r.get(what, 0) for r in runs]
+                        exponents[what] = e = exponent(sizes, values)
+                        if (e > args.threshold and what != "rss_kib" and
+                                values[-1] >= args.min_ms):
+                            flagged.append(f"{axis} {key} {what}")
+                    results[axis][key] = {"sizes": sizes, "runs": runs,
+                                          "exponents": exponents}
+
+    text = json.dumps({"ij": args.ij, "axes": results}, indent=2)
+    if args.output:
+        with open(args.output, "w") as out:
+            out.write(text + "\n")
+    else:
+        print(text)
+
+    print(f"\n{'axis':12}{'compile':16}{'phase':12}{'ms at max':>12}"
+          f"{'exponent':>10}", file=sys.stderr)
+    for axis, compiles in results.items():
+        for key, r in compiles.items():
+            for what, e in sorted(r["exponents"].items()):
+                if what == "rss_kib":
+                    continue
+                mark = "  <-" if f"{axis} {key} {what}" in flagged else ""
+                print(f"{axis:12}{key:16}{what:12}{r['runs'][-1][what]:12.1f}"
+                      f"{e:10.2f}{mark}", file=sys.stderr)
+
+    if flagged:
+        print("scaling: super-linear: " + ", ".join(flagged),
+              file=sys.stderr)
+    return 1 if flagged or disagree else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -7,15 +7,17 @@ bool Assembler::is_constant(string name) {
 }
 
 void Assembler::constant(string name, i32 value) {
-    if (!is_constant(name))
+    if (!is_constant(name)) {
+        constant_index[name] = constant_order.size();
         constant_order.push_back(name);
+    }
 
     constant_map[name] = value;
 }
 
 void Assembler::PUSH_VAL(int32_t value) {
     if (value >= -128 && value <= 127) {
-        // log.info("PUSH_VAL chose a bipush for value %d", value);
+        // log_info("PUSH_VAL chose a bipush for value %d", value);
         BIPUSH(value);
         return;
     }
@@ -24,7 +26,7 @@ void Assembler::PUSH_VAL(int32_t value) {
     if (!is_constant(cn))
         constant(cn, value);
 
-    // log.info("PUSH_VAL chose an LDC_W for value %d (const %s)", value,
+    // log_info("PUSH_VAL chose an LDC_W for value %d (const %s)", value,
     //  cn.c_str());
     LDC_W(cn);
 }
@@ -44,7 +46,7 @@ void Assembler::INC_VAR(string var, int32_t value) {
 
 void Assembler::IMUL(i32 value) {
     i32 bits = 0;
-    log.info("IMUL %d", value);
+    log_info("IMUL %d", value);
 
     if (!value) {
         this->POP();
@@ -70,7 +72,7 @@ void Assembler::IMUL(i32 value) {
         this->IADD();
     }
 
-    log.info("    %d had %d bits set", value, bits);
+    log_info("    %d had %d bits set", value, bits);
     for (; bits > 0; bits--)
         this->IADD();
 
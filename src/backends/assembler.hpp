@@ -34,6 +34,12 @@ class Assembler {
     is_var(string name) = 0; /* returns whether there is a variable in the
                                 current context (local and args) */
 
+    /* libraries keep every function, programs only what main reaches */
+    virtual bool is_library() { return false; }
+
+    /* source position of the instructions that follow, if tracked */
+    virtual void line(const string &, size_t) {}
+
     /* pseudo instructions for commonly used shortcuts */
     virtual void PUSH_VAL(i32 value);
     virtual void SET_VAR(string var, i32 value);
@@ -101,6 +107,7 @@ class Assembler {
   protected:
     std::unordered_map<string, i32> constant_map;
     std::vector<string> constant_order;
+    std::unordered_map<string, u32> constant_index; /* into constant_order */
 };
 
 #endif
@@ -0,0 +1,264 @@
+#include <cstddef>
+#include <cstring>
+#include <elf.h>
+#include <sys/mman.h>
+#include "elf_assembler.hpp"
+#include "x64_runtime.hpp"
+#include <util/logger.hpp>
+
+#define rt_field(field) offsetof(x64_runtime, field)
+
+const int sys_read = 0;
+const int sys_write = 1;
+const int sys_mmap = 9;
+const int sys_exit_group = 231;
+
+/*
+ * The runtime helpers of x64_runtime.cpp, as syscalls. They follow the C ABI
+ * the generated code expects: arguments in rdi and rsi, result in rax, all
+ * caller saved registers are fair game.
+ */
+static void emit_runtime(Xbyak::CodeGenerator &g, Xbyak::Label &program) {
+    Xbyak::Label flush, fill, out, halt, err, newarray, debug, mmap, message;
+    Xbyak::Label oom, oom_message, die;
+
+    // _start, the runtime is zeroed bss, fill it in
+    g.mov(g.rdi, x64_elf_runtime);
+
+    g.lea(g.rax, g.ptr[g.rip + fill]);
+    g.mov(g.ptr[g.rdi + rt_field(in)], g.rax);
+    g.lea(g.rax, g.ptr[g.rip + out]);
+    g.mov(g.ptr[g.rdi + rt_field(out)], g.rax);
+    g.lea(g.rax, g.ptr[g.rip + halt]);
+    g.mov(g.ptr[g.rdi + rt_field(halt)], g.rax);
+    g.lea(g.rax, g.ptr[g.rip + err]);
+    g.mov(g.ptr[g.rdi + rt_field(err)], g.rax);
+    g.lea(g.rax, g.ptr[g.rip + newarray]);
+    g.mov(g.ptr[g.rdi + rt_field(newarray)], g.rax);
+    g.lea(g.rax, g.ptr[g.rip + debug]);
+    g.mov(g.ptr[g.rdi + rt_field(debug)], g.rax);
+
+    g.lea(g.rax, g.ptr[g.rdi + rt_field(in_buf)]);
+    g.mov(g.ptr[g.rdi + rt_field(in_cur)], g.rax);
+    g.mov(g.ptr[g.rdi + rt_field(in_end)], g.rax);
+    g.lea(g.rax, g.ptr[g.rdi + rt_field(out_buf)]);
+    g.mov(g.ptr[g.rdi + rt_field(out_cur)], g.rax);
+    g.lea(g.rax, g.ptr[g.rdi + rt_field(out_buf) + x64_io_buffer]);
+    g.mov(g.ptr[g.rdi + rt_field(out_end)], g.rax);
+
+    // main ends in HALT or ERR, it doesn't return
+    g.call(program);
+    g.jmp(halt);
+
+    // flush(rt), keeps rdi
+    g.L(flush);
+    {
+        Xbyak::Label loop, done, fail;
+        g.mov(g.r8, g.rdi);
+        g.lea(g.rsi, g.ptr[g.r8 + rt_field(out_buf)]);
+        g.L(loop);
+        g.mov(g.rdx, g.ptr[g.r8 + rt_field(out_cur)]);
+        g.sub(g.rdx, g.rsi);
+        g.jle(done);
+        g.mov(g.edi, 1);
+        g.mov(g.eax, sys_write);
+        g.syscall();
+        g.test(g.rax, g.rax);
+        g.jle(fail);
+        g.add(g.rsi, g.rax);
+        g.jmp(loop);
+        g.L(done);
+        g.lea(g.rax, g.ptr[g.r8 + rt_field(out_buf)]);
+        g.mov(g.ptr[g.r8 + rt_field(out_cur)], g.rax);
+        g.mov(g.rdi, g.r8);
+        g.ret();
+        g.L(fail);
+        g.mov(g.edi, 1);
+        g.mov(g.eax, sys_exit_group);
+        g.syscall();
+    }
+
+    // in(rt), refills the input buffer, 0 on EOF
+    g.L(fill);
+    {
+        Xbyak::Label eof;
+        g.call(flush);
+        g.mov(g.r8, g.rdi);
+        g.lea(g.rsi, g.ptr[g.r8 + rt_field(in_buf)]);
+        g.mov(g.edx, x64_io_buffer);
+        g.xor_(g.edi, g.edi);
+        g.mov(g.eax, sys_read);
+        g.syscall();
+        g.test(g.rax, g.rax);
+        g.jle(eof);
+        g.lea(g.rsi, g.ptr[g.r8 + rt_field(in_buf)]);
+        g.lea(g.rcx, g.ptr[g.rsi + 1]);
+        g.mov(g.ptr[g.r8 + rt_field(in_cur)], g.rcx);
+        g.add(g.rax, g.rsi);
+        g.mov(g.ptr[g.r8 + rt_field(in_end)], g.rax);
+        g.movzx(g.eax, g.byte[g.rsi]);
+        g.ret();
+        g.L(eof);
+        g.xor_(g.eax, g.eax);
+        g.ret();
+    }
+
+    // out(char, rt), flushes the full output buffer
+    g.L(out);
+    g.push(g.rdi);
+    g.mov(g.rdi, g.rsi);
+    g.call(flush);
+    g.pop(g.rax);
+    g.mov(g.rcx, g.ptr[g.rdi + rt_field(out_cur)]);
+    g.mov(g.byte[g.rcx], g.al);
+    g.inc(g.rcx);
+    g.mov(g.ptr[g.rdi + rt_field(out_cur)], g.rcx);
+    g.ret();
+
+    // halt(rt)
+    g.L(halt);
+    g.call(flush);
+    g.xor_(g.edi, g.edi);
+    g.mov(g.eax, sys_exit_group);
+    g.syscall();
+
+    // err(rt)
+    g.L(err);
+    g.call(flush);
+    g.lea(g.rsi, g.ptr[g.rip + message]);
+    g.mov(g.edx, strlen("ERROR Encountered\n"));
+
+    // writes rdx bytes at rsi to stderr and exits with 1
+    g.L(die);
+    g.mov(g.edi, 2);
+    g.mov(g.eax, sys_write);
+    g.syscall();
+    g.mov(g.edi, 1);
+    g.mov(g.eax, sys_exit_group);
+    g.syscall();
+
+    // newarray(size, rt), mapped memory comes zeroed
+    g.L(newarray);
+    {
+        Xbyak::Label large, negative;
+        g.push(g.rsi);
+        g.push(g.rdi);
+        g.cmp(g.rdi, x64_heap_bump_max);
+        g.ja(large);
+
+        // a fresh chunk, the array is carved out of it
+        g.mov(g.esi, x64_heap_chunk * sizeof(i64));
+        g.call(mmap);
+        g.pop(g.rcx);
+        g.pop(g.rdx);
+        g.mov(g.rdi, g.rdx);
+        g.cmp(g.rax, -4095);
+        g.jae(oom);
+        g.lea(g.r8, g.ptr[g.rax + x64_heap_chunk * sizeof(i64)]);
+        g.mov(g.ptr[g.rdx + rt_field(heap_end)], g.r8);
+        g.lea(g.r8, g.ptr[g.rax + g.rcx * 8]);
+        g.mov(g.ptr[g.rdx + rt_field(heap_cur)], g.r8);
+        g.ret();
+
+        g.L(large);
+        g.pop(g.rsi);
+        g.pop(g.rdx);
+        g.test(g.rsi, g.rsi);
+        g.js(negative);
+        g.shl(g.rsi, 3);
+        g.push(g.rdx);
+        g.call(mmap);
+        g.pop(g.rdi);
+        g.cmp(g.rax, -4095);
+        g.jae(oom);
+        g.ret();
+        g.L(negative);
+        g.xor_(g.eax, g.eax);
+        g.ret();
+
+        // mmap returned -errno, like the JIT runtime this is fatal
+        g.L(oom);
+        g.call(flush);
+        g.lea(g.rsi, g.ptr[g.rip + oom_message]);
+        g.mov(g.edx, strlen("newarray: out of memory\n"));
+        g.jmp(die);
+    }
+
+    // mmap(rsi bytes), anonymous and private
+    g.L(mmap);
+    g.xor_(g.edi, g.edi);
+    g.mov(g.edx, PROT_READ | PROT_WRITE);
+    g.mov(g.r10d, MAP_PRIVATE | MAP_ANONYMOUS);
+    g.mov(g.r8, -1);
+    g.xor_(g.r9d, g.r9d);
+    g.mov(g.eax, sys_mmap);
+    g.syscall();
+    g.ret();
+
+    // instructions are only traced in the JIT
+    g.L(debug);
+    g.ret();
+
+    g.L(message);
+    for (const char *c = "ERROR Encountered\n"; *c; c++)
+        g.db(*c);
+    g.L(oom_message);
+    for (const char *c = "newarray: out of memory\n"; *c; c++)
+        g.db(*c);
+}
+
+void ElfAssembler::compile(ostream &o) {
+    size_t size;
+    const u8 *code = generated(size);
+
+    Xbyak::CodeGenerator g{size + 4096};
+    Xbyak::Label program;
+    emit_runtime(g, program);
+
+    g.L(program);
+    for (size_t i = 0; i < size; i++)
+        g.db(code[i]);
+
+    Elf64_Ehdr ehdr{};
+    Elf64_Phdr phdr[3]{};
+    size_t headers = sizeof(ehdr) + sizeof(phdr);
+
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_EXEC;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_entry = x64_elf_base + headers; /* _start comes first */
+    ehdr.e_phoff = sizeof(ehdr);
+    ehdr.e_ehsize = sizeof(ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = 3;
+
+    // headers and code, read only
+    phdr[0].p_type = PT_LOAD;
+    phdr[0].p_flags = PF_R | PF_X;
+    phdr[0].p_offset = 0;
+    phdr[0].p_vaddr = phdr[0].p_paddr = x64_elf_base;
+    phdr[0].p_filesz = phdr[0].p_memsz = headers + g.getSize();
+    phdr[0].p_align = 0x1000;
+
+    // the runtime, not in the file
+    phdr[1].p_type = PT_LOAD;
+    phdr[1].p_flags = PF_R | PF_W;
+    phdr[1].p_vaddr = phdr[1].p_paddr = x64_elf_runtime;
+    phdr[1].p_memsz = sizeof(x64_runtime);
+    phdr[1].p_align = 0x1000;
+
+    phdr[2].p_type = PT_GNU_STACK;
+    phdr[2].p_flags = PF_R | PF_W;
+
+    log_info("elf: %d bytes of code, %d of runtime", (int)size,
+             (int)(g.getSize() - size));
+
+    o.write((const char *)&ehdr, sizeof(ehdr));
+    o.write((const char *)phdr, sizeof(phdr));
+    o.write(g.getCode<const char *>(), g.getSize());
+}
@@ -0,0 +1,31 @@
+#ifndef BACKENDS_ELF_ASSEMBLER_HPP
+#define BACKENDS_ELF_ASSEMBLER_HPP
+#include "x64_assembler.hpp"
+
+/*
+ * Packages the x64 code as a static ELF64 executable. The generated code
+ * reaches its runtime through r14 like it does in the JIT, here the runtime
+ * lives in the bss and its helpers are syscall based machine code, so the
+ * binary needs neither libc nor a loader.
+ *
+ *        +--------------+ 0x400000
+ *        | ELF headers  |
+ *        +--------------+
+ *        |    _start    |  fills in the runtime, calls the program
+ *        |   helpers    |  in, out, halt, err, newarray
+ *        |   program    |  X64Assembler output
+ *        +--------------+
+ *
+ *        +--------------+ x64_elf_runtime
+ *        | x64_runtime  |  bss
+ *        +--------------+
+ */
+class ElfAssembler : public X64Assembler {
+  public:
+    virtual void compile(ostream &o); /* writes the executable to ostream */
+};
+
+const u64 x64_elf_base = 0x400000;
+const u64 x64_elf_runtime = 0x10000000;
+
+#endif
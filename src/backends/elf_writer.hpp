@@ -0,0 +1,49 @@
+#ifndef BACKENDS_ELF_WRITER_HPP
+#define BACKENDS_ELF_WRITER_HPP
+#include <cstring>
+#include <string>
+#include <elf.h>
+#include <util/types.h>
+
+/* small helpers for building ELF files in a string */
+
+/* appends to a string table, returns the offset */
+static inline u32 add_string(std::string &table, const std::string &s) {
+    u32 offset = table.size();
+    table += s;
+    table += '\0';
+    return offset;
+}
+
+static inline void align(std::string &file, size_t alignment) {
+    file.resize((file.size() + alignment - 1) / alignment * alignment, '\0');
+}
+
+/* returns the offset the data ended up at */
+template <typename T>
+static inline size_t append(std::string &file, const T *data, size_t count) {
+    size_t offset = file.size();
+    file.append((const char *)data, sizeof(T) * count);
+    return offset;
+}
+
+/* a relocatable x86-64 header, sections are filled in by the caller */
+static inline Elf64_Ehdr elf_rel_header(size_t shoff, size_t shnum) {
+    Elf64_Ehdr ehdr{};
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_shoff = shoff;
+    ehdr.e_ehsize = sizeof(ehdr);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = shnum;
+    ehdr.e_shstrndx = shnum - 1; /* .shstrtab comes last */
+    return ehdr;
+}
+
+#endif
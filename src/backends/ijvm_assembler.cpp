@@ -1,11 +1,23 @@
 #include "ijvm_assembler.hpp"
 #include <util/logger.hpp>
 #include <util/util.hpp>
+#include <util/stats.hpp>
 
 IJVMAssembler::IJVMAssembler() : current_func{"main"} {}
 
 IJVMAssembler::~IJVMAssembler() {}
 
+/* symbols by offset then name, the hash maps' order isn't reproducible */
+static vector<std::pair<string, u32>>
+sorted(const std::unordered_map<string, u32> &symbols) {
+    vector<std::pair<string, u32>> v{symbols.begin(), symbols.end()};
+    std::sort(v.begin(), v.end(), [](const std::pair<string, u32> &a,
+                                     const std::pair<string, u32> &b) {
+        return a.second != b.second ? a.second < b.second : a.first < b.first;
+    });
+    return v;
+}
+
 void IJVMAssembler::compile(ostream &o) {
     Endian e = Endian::Big;
 
@@ -16,12 +28,19 @@ void IJVMAssembler::compile(ostream &o) {
     for (string &s : constant_order)
         consts.push_back(constant_map[s]);
 
-    for (std::pair<string, u32> p : faddrs) {
+    vector<std::pair<string, u32>> functions = sorted(faddrs);
+    for (std::pair<string, u32> p : functions) {
         findexes[p.first] = consts.size();
         consts.push_back(p.second);
     }
 
-    link(findexes);
+    {
+        Phase phase{"link"};
+        link(findexes);
+    }
+    stats.count("labels", laddrs.size());
+    stats.count("fixups", jmpaddrs.size() + invokes.size());
+    stats.count("ijvm bytes", code.size());
 
     Buffer output;
 
@@ -41,7 +60,7 @@ void IJVMAssembler::compile(ostream &o) {
 
     /* write function addresses (symbol tables) */
     Buffer symbol;
-    for (std::pair<string, u32> p : faddrs) {
+    for (std::pair<string, u32> p : functions) {
         symbol.append<u32>(p.second, e);
         symbol.append<const char *>(p.first.c_str(), e);
         symbol.append<u8>(0);
@@ -54,7 +73,7 @@ void IJVMAssembler::compile(ostream &o) {
 
     symbol.clear(); /* clear symbols */
 
-    for (std::pair<string, u32> p : laddrs) {
+    for (std::pair<string, u32> p : sorted(laddrs)) {
         symbol.append<u32>(p.second, e);
         symbol.append<const char *>(p.first.c_str(), e);
         symbol.append<u8>(0);
@@ -65,11 +84,25 @@ void IJVMAssembler::compile(ostream &o) {
     output.append<u32>(symbol.size(), e);
     output.append<const Buffer &>(symbol);
 
+    symbol.clear();
+
+    for (ijvm_line &l : lines) {
+        symbol.append<u32>(l.offset, e);
+        symbol.append<u32>(l.line, e);
+        symbol.append<const char *>(l.file.c_str(), e);
+        symbol.append<u8>(0);
+    }
+
+    /* write source lines */
+    output.append<u32>(0xDDddDDdd, e);
+    output.append<u32>(symbol.size(), e);
+    output.append<const Buffer &>(symbol);
+
     o << output;
 }
 
 void IJVMAssembler::label(string name) {
-    // log.info("%s <- %u", sprint("%s#%s", current_func, name).c_str(),
+    // log_info("%s <- %u", sprint("%s#%s", current_func, name).c_str(),
     // code.size());
     laddrs[sprint("%s#%s", current_func, name)] = code.size();
 }
@@ -89,15 +122,35 @@ void IJVMAssembler::function(string name, vector<string> args,
 
     this->vars.clear();
 
+    // a name declared twice keeps its first index
+    u16 index = 0;
     if (name != "main")
-        this->vars.push_back("OBJREF");
+        this->vars.emplace("OBJREF", index++);
 
-    this->vars.insert(this->vars.end(), args.begin(), args.end());
-    this->vars.insert(this->vars.end(), vars.begin(), vars.end());
+    for (string &arg : args)
+        this->vars.emplace(arg, index++);
+    for (string &var : vars)
+        this->vars.emplace(var, index++);
 }
 
 bool IJVMAssembler::is_var(string name) { return contains(vars, name); }
 
+int IJVMAssembler::var_index(const string &var) const {
+    auto it = vars.find(var);
+    return it == vars.end() ? -1 : it->second;
+}
+
+void IJVMAssembler::line(const string &file, size_t line) {
+    // no code since the last one, it never got an instruction
+    if (!lines.empty() && lines.back().offset == code.size())
+        lines.pop_back();
+
+    if (!lines.empty() && lines.back().file == file && lines.back().line == line)
+        return;
+
+    lines.push_back({code.size(), file, (u32)line});
+}
+
 void IJVMAssembler::BIPUSH(int8_t value) {
     code.append<u8>(op_bipush);
     code.append<i8>(value);
@@ -119,33 +172,33 @@ void IJVMAssembler::SWAP() { code.append<u8>(op_swap); }
 
 void IJVMAssembler::LDC_W(string constant) {
     if (!is_constant(constant)) {
-        log.info("LDC_W couldn't find constant %s", constant.c_str());
+        log_info("LDC_W couldn't find constant %s", constant.c_str());
         throw std::runtime_error{"Tried calling LDC_W on none-existing const"};
     }
     code.append<u8>(op_ldc_w);
-    code.append<u16>(indexOf(constant_order, constant), Endian::Big);
+    code.append<u16>(constant_index[constant], Endian::Big);
 }
 
 void IJVMAssembler::ILOAD(string var) {
-    int index = indexOf(vars, var);
+    int index = var_index(var);
     if (index < 0)
         throw std::runtime_error{"Tried calling ILOAD on none-existing var"};
 
     if (index > 255)
         WIDE();
 
-    // log.info("ILOAD %s, index=%d", var.c_str(), index);
+    // log_info("ILOAD %s, index=%d", var.c_str(), index);
 
     code.append<u8>(op_iload);
 
     if (index > 255)
-        code.append<u16>(static_cast<u16>(index));
+        code.append<u16>(static_cast<u16>(index), Endian::Big);
     else
         code.append<u8>(static_cast<u8>(index));
 }
 
 void IJVMAssembler::IINC(string var, int8_t value) {
-    int index = indexOf(vars, var);
+    int index = var_index(var);
     if (index < 0)
         throw std::runtime_error{"Tried calling IINC on none-existing var"};
 
@@ -155,7 +208,7 @@ void IJVMAssembler::IINC(string var, int8_t value) {
     code.append<u8>(op_iinc);
 
     if (index > 255)
-        code.append<u16>(static_cast<u16>(index));
+        code.append<u16>(static_cast<u16>(index), Endian::Big);
     else
         code.append<u8>(static_cast<u8>(index));
 
@@ -163,7 +216,7 @@ void IJVMAssembler::IINC(string var, int8_t value) {
 }
 
 void IJVMAssembler::ISTORE(string var) {
-    int index = indexOf(vars, var);
+    int index = var_index(var);
     if (index < 0)
         throw std::runtime_error{sprint("Tried calling ISTORE on none-existing var %s", var.c_str())};
 
@@ -173,7 +226,7 @@ void IJVMAssembler::ISTORE(string var) {
     code.append<u8>(op_istore);
 
     if (index > 255)
-        code.append<u16>(static_cast<u16>(index));
+        code.append<u16>(static_cast<u16>(index), Endian::Big);
     else
         code.append<u8>(static_cast<u8>(index));
 }
@@ -253,23 +306,26 @@ void IJVMAssembler::link(std::unordered_map<string, u32> findexes) {
     /* first compile the jump instructions */
     for (std::pair<u32, string> p : jmpaddrs) {
         if (laddrs.count(p.second) != 1) {
-            log.info("All addresses");
+            log_info("All addresses");
             for (std::pair<string, u32> p : laddrs)
-                log.info("    - %s", p.first.c_str());
+                log_info("    - %s", p.first.c_str());
 
             log.panic("No mapping %s to address", p.second.c_str());
         }
 
-        u32 address = laddrs[p.second];
-        code.write(static_cast<i16>(address - p.first), p.first + 1,
-                   Endian::Big);
+        i64 offset = (i64)laddrs[p.second] - p.first;
+        if (offset < INT16_MIN || offset > INT16_MAX)
+            log.panic("Jump to %s is %ld bytes, more than IJVM can reach",
+                      p.second.c_str(), (long)offset);
+
+        code.write(static_cast<i16>(offset), p.first + 1, Endian::Big);
     }
 
     for (std::pair<u32, string> p : invokes) {
         if (findexes.count(p.second) == 0) {
-            log.info("All function names");
+            log_info("All function names");
             for (std::pair<string, u32> p : findexes)
-                log.info("    - %s", p.first.c_str());
+                log_info("    - %s", p.first.c_str());
 
             log.panic("INVOKEVIRTUAL call to unfound function '%s'",
                       p.second.c_str());
@@ -2,6 +2,13 @@
 #include <util/buffer.hpp>
 #include <util/opcodes.hpp>
 
+/* the first instruction at offset came from line */
+struct ijvm_line {
+    u32 offset;
+    string file;
+    u32 line;
+};
+
 class IJVMAssembler : public Assembler {
   public:
     IJVMAssembler(); /* creates buffer for assembler to pile up stuff into */
@@ -16,6 +23,7 @@ class IJVMAssembler : public Assembler {
                           vector<string> vars);
     virtual bool is_var(string name); /* returns whether there is a variable in
                                          the current context (local and args) */
+    virtual void line(const string &file, size_t line);
 
     /* Note, WIDE is done automatically for vars */
     virtual void BIPUSH(int8_t value);
@@ -87,7 +95,11 @@ class IJVMAssembler : public Assembler {
     std::unordered_map<string, u32>
         faddrs; /* fname -> offset, required when linking functions */
     std::unordered_map<u32, string> invokes; /* invokevirtual name */
+    vector<ijvm_line> lines;                 /* in order of offset */
+
+    /* index of var in the current function, -1 if there is none */
+    int var_index(const string &var) const;
 
     string current_func; /* keep track of function */
-    vector<string> vars;
+    std::unordered_map<string, u16> vars; /* name -> local variable index */
 };
\ No newline at end of file
@@ -0,0 +1,715 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include "interp_assembler.hpp"
+#include "x64_runtime.hpp"
+#include <util/logger.hpp>
+#include <util/util.hpp>
+
+/*
+ * The interpreter keeps a single stack of 64 bit words like the IJVM does:
+ * the caller pushes __obj_ref__ and the arguments, which become the first
+ * locals of the callee, followed by its vars and then its operand stack.
+ * Values behave the same as in the x64 backend, so both engines agree.
+ */
+const size_t interp_stack_slots = 1 << 20; /* 8MiB */
+const size_t interp_stack_slack = 1 << 12; /* operand stack room per call */
+
+/* when tiered, a function is compiled after this many calls or loop trips */
+const u32 interp_hot_calls = 1000;
+const u32 interp_hot_loops = 10000;
+
+static const char *interp_op_names[] = {
+    "BIPUSH", "DUP", "IADD", "IAND", "IOR", "ISUB", "POP", "SWAP", "LDC_W",
+    "ILOAD", "ISTORE", "IINC", "HALT", "ERR", "IN", "OUT", "GOTO", "ICMPEQ",
+    "IFLT", "IFEQ", "INVOKEVIRTUAL", "IRETURN", "NEWARRAY", "IALOAD",
+    "IASTORE", "SHL", "SHR", "IMUL", "IDIV",
+
+    "ILOAD_ILOAD",
+    "ILOAD_ILOAD_IADD",
+    "ILOAD_ILOAD_ISUB",
+    "ILOAD_ILOAD_IALOAD",
+    "BIPUSH_ISTORE",
+    "ISUB_IFLT",
+
+    "LOOP",
+};
+static_assert(sizeof(interp_op_names) / sizeof(*interp_op_names) ==
+                  (size_t)interp_op::COUNT,
+              "every interp_op needs a name");
+
+/* sequences replaced by a single superinstruction, longest first */
+struct interp_fusion {
+    vector<interp_op> sequence;
+    interp_op fused;
+};
+
+static const vector<interp_fusion> fusions = {
+    {{interp_op::ILOAD, interp_op::ILOAD, interp_op::IADD},
+     interp_op::ILOAD_ILOAD_IADD},
+    {{interp_op::ILOAD, interp_op::ILOAD, interp_op::ISUB},
+     interp_op::ILOAD_ILOAD_ISUB},
+    {{interp_op::ILOAD, interp_op::ILOAD, interp_op::IALOAD},
+     interp_op::ILOAD_ILOAD_IALOAD},
+    {{interp_op::ILOAD, interp_op::ILOAD}, interp_op::ILOAD_ILOAD},
+    {{interp_op::BIPUSH, interp_op::ISTORE}, interp_op::BIPUSH_ISTORE},
+    {{interp_op::ISUB, interp_op::IFLT}, interp_op::ISUB_IFLT},
+};
+
+InterpAssembler::InterpAssembler(bool tiered)
+    : _tiered{tiered}, _linked{false} {}
+
+InterpAssembler::~InterpAssembler() {}
+
+void InterpAssembler::record(opcode op, string arg, i64 value) {
+    if (_program.empty())
+        throw std::runtime_error{"interp: instruction outside of a function"};
+    if (_linked)
+        throw std::runtime_error{"interp: program was already linked"};
+
+    _program.back().body.push_back({op, arg, value});
+}
+
+void InterpAssembler::label(string name) { record(opcode::INVALID, name); }
+
+void InterpAssembler::function(string name, vector<string> args,
+                               vector<string> vars) {
+    _program.push_back({name, args, vars, {}, {}});
+    _locals = {args.begin(), args.end()};
+    _locals.insert(vars.begin(), vars.end());
+}
+
+bool InterpAssembler::is_var(string name) {
+    if (_program.empty())
+        return false;
+
+    return name == "__obj_ref__" || contains(_locals, name);
+}
+
+void InterpAssembler::line(const string &file, size_t line) {
+    if (!_program.empty())
+        add_line(_program.back(), file, line);
+}
+
+static bool is_loop_condition(const string &label) {
+    return startswith(label, "for") && endswith(label, "_condition");
+}
+
+/* lowers a recorded function, resolving local slots and constants */
+void InterpAssembler::lower(const x64_function &f,
+                            vector<interp_record> &out) {
+    // main is entered directly, every other function gets __obj_ref__
+    vector<string> slots;
+    if (f.name != "main")
+        slots.push_back("__obj_ref__");
+    slots.insert(slots.end(), f.args.begin(), f.args.end());
+    slots.insert(slots.end(), f.vars.begin(), f.vars.end());
+
+    // a name declared twice keeps its first slot
+    std::unordered_map<string, int> indices;
+    for (size_t i = 0; i < slots.size(); i++)
+        indices.emplace(slots[i], i);
+
+    auto slot = [&](const string &var) {
+        auto it = indices.find(var);
+        if (it == indices.end())
+            throw std::runtime_error{
+                sprint("interp: none-existing var %s in %s", var, f.name)};
+        return it->second;
+    };
+
+    _functions[f.name] = _fns.size();
+    _fns.push_back({(u32)out.size(), (u32)(slots.size() - f.vars.size()),
+                    (u32)f.vars.size(), 0, false, nullptr});
+
+    for (const x64_instruction &ins : f.body) {
+        string target = sprint("%s#%s", f.name, ins.arg);
+
+        switch (ins.op) {
+        case opcode::INVALID:
+            _labels[target] = out.size();
+            break;
+        case opcode::BIPUSH:
+            out.push_back({interp_op::BIPUSH, ins.value, 0, ""});
+            break;
+        case opcode::LDC_W:
+            out.push_back({interp_op::LDC_W, constant_map[ins.arg], 0, ""});
+            break;
+        case opcode::ILOAD:
+            out.push_back({interp_op::ILOAD, slot(ins.arg), 0, ""});
+            break;
+        case opcode::ISTORE:
+            out.push_back({interp_op::ISTORE, slot(ins.arg), 0, ""});
+            break;
+        case opcode::IINC:
+            out.push_back({interp_op::IINC, slot(ins.arg), ins.value, ""});
+            break;
+        case opcode::GOTO:
+            // going back to a loop condition is where loops get hot
+            if (_tiered && is_loop_condition(ins.arg) && _labels.count(target)) {
+                out.push_back({interp_op::LOOP, 0, (i64)_loops.size(), target});
+                _loops.push_back({(u32)_functions[f.name], ins.arg, 0, nullptr});
+            } else
+                out.push_back({interp_op::GOTO, 0, 0, target});
+            break;
+        case opcode::ICMPEQ:
+            out.push_back({interp_op::ICMPEQ, 0, 0, target});
+            break;
+        case opcode::IFLT:
+            out.push_back({interp_op::IFLT, 0, 0, target});
+            break;
+        case opcode::IFEQ:
+            out.push_back({interp_op::IFEQ, 0, 0, target});
+            break;
+        case opcode::INVOKEVIRTUAL:
+            out.push_back({interp_op::INVOKEVIRTUAL, 0, 0, ins.arg});
+            break;
+        case opcode::WIDE:
+        case opcode::NOP:
+            break;
+
+        // clang-format off
+        case opcode::DUP:      out.push_back({interp_op::DUP, 0, 0, ""});      break;
+        case opcode::IADD:     out.push_back({interp_op::IADD, 0, 0, ""});     break;
+        case opcode::IAND:     out.push_back({interp_op::IAND, 0, 0, ""});     break;
+        case opcode::IOR:      out.push_back({interp_op::IOR, 0, 0, ""});      break;
+        case opcode::ISUB:     out.push_back({interp_op::ISUB, 0, 0, ""});     break;
+        case opcode::POP:      out.push_back({interp_op::POP, 0, 0, ""});      break;
+        case opcode::SWAP:     out.push_back({interp_op::SWAP, 0, 0, ""});     break;
+        case opcode::HALT:     out.push_back({interp_op::HALT, 0, 0, ""});     break;
+        case opcode::ERR:      out.push_back({interp_op::ERR, 0, 0, ""});      break;
+        case opcode::IN:       out.push_back({interp_op::IN, 0, 0, ""});       break;
+        case opcode::OUT:      out.push_back({interp_op::OUT, 0, 0, ""});      break;
+        case opcode::IRETURN:  out.push_back({interp_op::IRETURN, 0, 0, ""});  break;
+        case opcode::NEWARRAY: out.push_back({interp_op::NEWARRAY, 0, 0, ""}); break;
+        case opcode::IALOAD:   out.push_back({interp_op::IALOAD, 0, 0, ""});   break;
+        case opcode::IASTORE:  out.push_back({interp_op::IASTORE, 0, 0, ""});  break;
+        case opcode::SHL:      out.push_back({interp_op::SHL, 0, 0, ""});      break;
+        case opcode::SHR:      out.push_back({interp_op::SHR, 0, 0, ""});      break;
+        case opcode::IMUL:     out.push_back({interp_op::IMUL, 0, 0, ""});     break;
+        case opcode::IDIV:     out.push_back({interp_op::IDIV, 0, 0, ""});     break;
+        // clang-format on
+        default:
+            throw std::runtime_error{
+                sprint("interp: can't lower opcode %x", (int)ins.op)};
+        }
+    }
+}
+
+/*
+ * Lowers the recorded program, fuses superinstructions and resolves jump
+ * and call targets. Nothing can be fused over a label, as a jump to it would
+ * land in the middle of the superinstruction.
+ */
+void InterpAssembler::link() {
+    if (_linked)
+        return;
+    _linked = true;
+
+    vector<interp_record> records;
+    for (const x64_function &f : _program)
+        lower(f, records);
+
+    if (!_functions.count("main"))
+        throw std::runtime_error{"interp: program has no main"};
+
+    std::set<size_t> targets;
+    for (auto &entry : _labels)
+        targets.insert(entry.second);
+    for (interp_function &f : _fns)
+        targets.insert(f.entry);
+
+    vector<interp_record> out;
+    vector<size_t> remap(records.size() + 1);
+    size_t fused = 0;
+
+    for (size_t i = 0; i < records.size();) {
+        const interp_fusion *match = nullptr;
+
+        for (const interp_fusion &f : fusions) {
+            size_t n = f.sequence.size();
+            if (i + n > records.size())
+                continue;
+
+            bool ok = true;
+            for (size_t k = 0; k < n && ok; k++)
+                ok = records[i + k].op == f.sequence[k] &&
+                     (k == 0 || !targets.count(i + k));
+
+            if (ok) {
+                match = &f;
+                break;
+            }
+        }
+
+        if (!match) {
+            remap[i] = out.size();
+            out.push_back(records[i++]);
+            continue;
+        }
+
+        const interp_record &first = records[i];
+        const interp_record &second = records[i + 1];
+        interp_record r{match->fused, first.a, second.a, ""};
+
+        if (match->fused == interp_op::BIPUSH_ISTORE)
+            r = {match->fused, second.a, first.a, ""};
+        else if (match->fused == interp_op::ISUB_IFLT)
+            r = {match->fused, 0, 0, second.target};
+
+        for (size_t k = 0; k < match->sequence.size(); k++)
+            remap[i + k] = out.size();
+
+        out.push_back(r);
+        i += match->sequence.size();
+        fused++;
+    }
+    remap[records.size()] = out.size();
+
+    // running off the end of the program is an error, not undefined
+    out.push_back({interp_op::ERR, 0, 0, ""});
+
+    for (interp_function &f : _fns)
+        f.entry = remap[f.entry];
+
+    for (const interp_record &r : out) {
+        interp_ins ins{nullptr, r.op, (i32)r.a, r.b};
+
+        if (r.op == interp_op::INVOKEVIRTUAL) {
+            if (!_functions.count(r.target))
+                throw std::runtime_error{
+                    "interp: call to unknown function " + r.target};
+            ins.a = _functions[r.target];
+        } else if (!r.target.empty()) {
+            if (!_labels.count(r.target))
+                throw std::runtime_error{"interp: no label " + r.target};
+            ins.a = remap[_labels[r.target]];
+        }
+
+        _code.push_back(ins);
+    }
+
+    log_info("interp: %d instructions, %d superinstructions",
+             (int)_code.size(), (int)fused);
+}
+
+/*
+ * All hot functions share one lazily generating X64Assembler, which knows
+ * the whole program: a hot function is generated right away, whatever it
+ * calls on the first call, and code that is there already is reused. Entries
+ * go in at the start of every function and at each loop condition. Functions
+ * the x64 backend can't enter (those reading __obj_ref__) stay interpreted.
+ */
+void InterpAssembler::tier_up(u32 fn, x64_runtime &rt) {
+    const x64_function &hot = _program[fn];
+    _fns[fn].compiled = true;
+
+    try {
+        // kept only once it is ready, a failed start is tried again
+        if (!_jit) {
+            auto x64 = std::make_unique<X64Assembler>();
+            for (const string &name : constant_order)
+                x64->constant(name, constant_map[name]);
+            for (const x64_function &f : _program) {
+                x64->function(f);
+                x64->add_entry(f.name);
+            }
+            for (interp_loop &l : _loops)
+                x64->add_entry(_program[l.fn].name, l.label);
+            x64->ready_lazily(rt);
+            _jit = std::move(x64);
+        }
+        _jit->ready_lazily(rt);
+
+        _fns[fn].jitted = _jit->entry(hot.name);
+        for (interp_loop &l : _loops)
+            if (l.fn == fn)
+                l.jitted = _jit->entry(hot.name, l.label);
+    } catch (std::exception &e) {
+        // Xbyak::Error isn't a runtime_error
+        log.warn("tiered: %s stays interpreted, %s", hot.name.c_str(),
+                 e.what());
+        return;
+    }
+
+    log_info("tiered: compiled %s%s", hot.name.c_str(),
+             _fns[fn].jitted ? "" : ", no entry");
+}
+
+void InterpAssembler::compile(ostream &o) {
+    link();
+
+    std::map<u32, string> entries;
+    for (size_t i = 0; i < _fns.size(); i++)
+        entries[_fns[i].entry] += _program[i].name + ":\n";
+
+    for (size_t i = 0; i < _code.size(); i++) {
+        if (entries.count(i))
+            o << entries[i];
+
+        const interp_ins &ins = _code[i];
+        o << sprint("    %5d  %s", (int)i, interp_op_names[(int)ins.op]);
+
+        switch (ins.op) {
+        case interp_op::BIPUSH:
+        case interp_op::LDC_W:
+        case interp_op::ILOAD:
+        case interp_op::ISTORE:
+        case interp_op::GOTO:
+        case interp_op::ICMPEQ:
+        case interp_op::IFLT:
+        case interp_op::IFEQ:
+        case interp_op::ISUB_IFLT:
+        case interp_op::LOOP:
+            o << " " << ins.a;
+            break;
+        case interp_op::INVOKEVIRTUAL:
+            o << " " << _program[ins.a].name;
+            break;
+        case interp_op::IINC:
+        case interp_op::ILOAD_ILOAD:
+        case interp_op::ILOAD_ILOAD_IADD:
+        case interp_op::ILOAD_ILOAD_ISUB:
+        case interp_op::ILOAD_ILOAD_IALOAD:
+        case interp_op::BIPUSH_ISTORE:
+            o << " " << ins.a << " " << ins.b;
+            break;
+        default:
+            break;
+        }
+
+        o << "\n";
+    }
+}
+
+void InterpAssembler::run() {
+    link();
+    execute();
+    log.panic("Shouldn't have run this oh doodoo");
+}
+
+static inline i64 add32(i64 a, i64 b) { return (i32)((u32)a + (u32)b); }
+static inline i64 sub32(i64 a, i64 b) { return (i32)((u32)a - (u32)b); }
+
+struct interp_frame {
+    const interp_ins *ret;
+    i64 *lv;
+};
+
+/*
+ * Direct threaded dispatch: every instruction holds the address of its
+ * handler, which jumps straight to the handler of the next one. Labels as
+ * values are a GNU extension, hence the pragma.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+void InterpAssembler::execute() {
+    static const void *const handlers[] = {
+        &&do_BIPUSH, &&do_DUP, &&do_IADD, &&do_IAND, &&do_IOR, &&do_ISUB,
+        &&do_POP, &&do_SWAP, &&do_LDC_W, &&do_ILOAD, &&do_ISTORE, &&do_IINC,
+        &&do_HALT, &&do_ERR, &&do_IN, &&do_OUT, &&do_GOTO, &&do_ICMPEQ,
+        &&do_IFLT, &&do_IFEQ, &&do_INVOKEVIRTUAL, &&do_IRETURN,
+        &&do_NEWARRAY, &&do_IALOAD, &&do_IASTORE, &&do_SHL, &&do_SHR,
+        &&do_IMUL, &&do_IDIV,
+
+        &&do_ILOAD_ILOAD,
+        &&do_ILOAD_ILOAD_IADD,
+        &&do_ILOAD_ILOAD_ISUB,
+        &&do_ILOAD_ILOAD_IALOAD,
+        &&do_BIPUSH_ISTORE,
+        &&do_ISUB_IFLT,
+
+        &&do_LOOP,
+    };
+    static_assert(sizeof(handlers) / sizeof(*handlers) ==
+                      (size_t)interp_op::COUNT,
+                  "every interp_op needs a handler");
+
+    // tiered, calls count towards compiling the callee
+    for (interp_ins &ins : _code)
+        ins.handler = _tiered && ins.op == interp_op::INVOKEVIRTUAL
+                          ? &&do_INVOKE_TIERED
+                          : handlers[(int)ins.op];
+
+    // IN and OUT share their buffers with jitted code
+    x64_runtime rt;
+    vector<i64> stack(interp_stack_slots, 0);
+    vector<interp_frame> frames;
+    frames.reserve(1024);
+    interp_function *fns = _fns.data();
+    interp_loop *loops = _loops.data();
+    const interp_ins *code = _code.data();
+
+    // main has no caller, its vars sit at the bottom of the stack
+    const interp_function &main = _fns[_functions["main"]];
+    i64 *lv = stack.data();
+    i64 *sp = lv + main.vars - 1; /* points at the top of stack */
+    i64 *limit = stack.data() + stack.size() - interp_stack_slack;
+    const interp_ins *pc = code + main.entry;
+    i64 result;
+
+#define DISPATCH() goto *pc->handler
+#define NEXT()                                                                 \
+    do {                                                                       \
+        pc++;                                                                  \
+        DISPATCH();                                                            \
+    } while (0)
+#define JUMP(target)                                                           \
+    do {                                                                       \
+        pc = code + (target);                                                  \
+        DISPATCH();                                                            \
+    } while (0)
+
+    DISPATCH();
+
+do_BIPUSH:
+do_LDC_W:
+    *++sp = pc->a;
+    NEXT();
+do_DUP:
+    sp[1] = sp[0];
+    sp++;
+    NEXT();
+do_IADD:
+    sp[-1] = add32(sp[-1], sp[0]);
+    sp--;
+    NEXT();
+do_IAND:
+    sp[-1] &= sp[0];
+    sp--;
+    NEXT();
+do_IOR:
+    sp[-1] |= sp[0];
+    sp--;
+    NEXT();
+do_ISUB:
+    sp[-1] = sub32(sp[-1], sp[0]);
+    sp--;
+    NEXT();
+do_POP:
+    sp--;
+    NEXT();
+do_SWAP:
+    std::swap(sp[0], sp[-1]);
+    NEXT();
+do_ILOAD:
+    *++sp = lv[pc->a];
+    NEXT();
+do_ISTORE:
+    lv[pc->a] = *sp--;
+    NEXT();
+do_IINC:
+    lv[pc->a] += pc->b;
+    NEXT();
+do_HALT:
+    x64_flush(&rt);
+    exit(0);
+do_ERR:
+    x64_flush(&rt);
+    fprintf(stderr, "ERROR Encountered\n");
+    exit(1);
+do_IN:
+    *++sp = rt.in_cur < rt.in_end ? *rt.in_cur++ : x64_fill(&rt);
+    NEXT();
+do_OUT:
+    if (rt.out_cur == rt.out_end)
+        x64_flush(&rt);
+    *rt.out_cur++ = *sp--;
+    NEXT();
+do_GOTO:
+    JUMP(pc->a);
+do_ICMPEQ:
+    sp -= 2;
+    if (sp[1] == sp[2])
+        JUMP(pc->a);
+    NEXT();
+do_IFLT:
+    if (*sp-- < 0)
+        JUMP(pc->a);
+    NEXT();
+do_IFEQ:
+    if (*sp-- == 0)
+        JUMP(pc->a);
+    NEXT();
+do_INVOKEVIRTUAL: {
+    const interp_function &f = fns[pc->a];
+    frames.push_back({pc + 1, lv});
+
+    // __obj_ref__ and the arguments are already in place
+    lv = sp - f.slots + 1;
+    sp = lv + f.slots + f.vars - 1;
+    if (sp >= limit)
+        log.panic("interp: stack overflow");
+
+    std::fill(lv + f.slots, sp + 1, 0);
+    JUMP(f.entry);
+}
+do_IRETURN:
+    result = *sp;
+leave:
+    // the result takes the place of __obj_ref__
+    sp = lv;
+    *sp = result;
+
+    pc = frames.back().ret;
+    lv = frames.back().lv;
+    frames.pop_back();
+    DISPATCH();
+do_NEWARRAY:
+    *sp = (i64)calloc(*sp, sizeof(i64));
+    NEXT();
+do_IALOAD:
+    sp[-1] = ((i64 *)sp[0])[sp[-1]];
+    sp--;
+    NEXT();
+do_IASTORE:
+    ((i64 *)sp[0])[sp[-1]] = sp[-2];
+    sp -= 3;
+    NEXT();
+do_SHL:
+    *sp = (u64)*sp << 1;
+    NEXT();
+do_SHR:
+    *sp = (u64)*sp >> 1;
+    NEXT();
+do_IMUL:
+    sp[-1] = (u64)sp[-1] * (u64)sp[0];
+    sp--;
+    NEXT();
+do_IDIV:
+    if (sp[0] == 0)
+        log.panic("interp: division by zero");
+    sp[-1] /= sp[0];
+    sp--;
+    NEXT();
+
+do_ILOAD_ILOAD:
+    sp[1] = lv[pc->a];
+    sp[2] = lv[pc->b];
+    sp += 2;
+    NEXT();
+do_ILOAD_ILOAD_IADD:
+    *++sp = add32(lv[pc->a], lv[pc->b]);
+    NEXT();
+do_ILOAD_ILOAD_ISUB:
+    *++sp = sub32(lv[pc->a], lv[pc->b]);
+    NEXT();
+do_ILOAD_ILOAD_IALOAD:
+    *++sp = ((i64 *)lv[pc->b])[lv[pc->a]];
+    NEXT();
+do_BIPUSH_ISTORE:
+    lv[pc->a] = pc->b;
+    NEXT();
+do_ISUB_IFLT: {
+    i64 r = sub32(sp[-1], sp[0]);
+    sp -= 2;
+    if (r < 0)
+        JUMP(pc->a);
+    NEXT();
+}
+
+do_INVOKE_TIERED: {
+    interp_function &f = fns[pc->a];
+    if (!f.compiled && ++f.calls >= interp_hot_calls)
+        tier_up(pc->a, rt);
+    if (!f.jitted)
+        goto do_INVOKEVIRTUAL;
+
+    // the arguments are on top, the result replaces __obj_ref__
+    size_t argc = f.slots - 1;
+    *(sp - argc) = f.jitted(&rt, sp - argc + 1);
+    sp -= argc;
+    NEXT();
+}
+do_LOOP: {
+    interp_loop &l = loops[pc->b];
+    if (!l.jitted) {
+        if (++l.iterations < interp_hot_loops || fns[l.fn].compiled)
+            JUMP(pc->a);
+        tier_up(l.fn, rt);
+        if (!l.jitted)
+            JUMP(pc->a);
+    }
+
+    // on-stack replacement, the compiled loop runs until the function returns
+    const interp_function &f = fns[l.fn];
+    if (sp != lv + f.slots + f.vars - 1)
+        JUMP(pc->a);
+
+    result = l.jitted(&rt, lv + 1);
+    goto leave;
+}
+
+#undef JUMP
+#undef NEXT
+#undef DISPATCH
+}
+#pragma GCC diagnostic pop
+
+void InterpAssembler::BIPUSH(int8_t value) {
+    record(opcode::BIPUSH, "", value);
+}
+void InterpAssembler::DUP() { record(opcode::DUP); }
+void InterpAssembler::IADD() { record(opcode::IADD); }
+void InterpAssembler::IAND() { record(opcode::IAND); }
+void InterpAssembler::IOR() { record(opcode::IOR); }
+void InterpAssembler::ISUB() { record(opcode::ISUB); }
+void InterpAssembler::POP() { record(opcode::POP); }
+void InterpAssembler::SWAP() { record(opcode::SWAP); }
+
+void InterpAssembler::LDC_W(string constant) {
+    if (!is_constant(constant)) {
+        log_info("LDC_W couldn't find constant %s", constant.c_str());
+        throw std::runtime_error{"Tried calling LDC_W on none-existing const"};
+    }
+    record(opcode::LDC_W, constant);
+}
+
+void InterpAssembler::ILOAD(string var) { record(opcode::ILOAD, var); }
+void InterpAssembler::IINC(string var, int8_t value) {
+    record(opcode::IINC, var, value);
+}
+void InterpAssembler::ISTORE(string var) { record(opcode::ISTORE, var); }
+void InterpAssembler::WIDE() { record(opcode::WIDE); }
+
+void InterpAssembler::HALT() { record(opcode::HALT); }
+void InterpAssembler::ERR() { record(opcode::ERR); }
+void InterpAssembler::IN() { record(opcode::IN); }
+void InterpAssembler::OUT() { record(opcode::OUT); }
+void InterpAssembler::NOP() { record(opcode::NOP); }
+
+void InterpAssembler::GOTO(string label) { record(opcode::GOTO, label); }
+void InterpAssembler::ICMPEQ(string label) { record(opcode::ICMPEQ, label); }
+void InterpAssembler::IFLT(string label) { record(opcode::IFLT, label); }
+void InterpAssembler::IFEQ(string label) { record(opcode::IFEQ, label); }
+
+void InterpAssembler::INVOKEVIRTUAL(string func_name) {
+    record(opcode::INVOKEVIRTUAL, func_name);
+}
+void InterpAssembler::IRETURN() { record(opcode::IRETURN); }
+
+void InterpAssembler::NEWARRAY() { record(opcode::NEWARRAY); }
+void InterpAssembler::IALOAD() { record(opcode::IALOAD); }
+void InterpAssembler::IASTORE() { record(opcode::IASTORE); }
+void InterpAssembler::GC() { throw std::runtime_error{"Not implemented: GC"}; }
+
+void InterpAssembler::NETBIND() {
+    throw std::runtime_error{"Not implemented: NETBIND"};
+}
+void InterpAssembler::NETCONNECT() {
+    throw std::runtime_error{"Not implemented: NETCONNECT"};
+}
+void InterpAssembler::NETIN() {
+    throw std::runtime_error{"Not implemented: NETIN"};
+}
+void InterpAssembler::NETOUT() {
+    throw std::runtime_error{"Not implemented: NETOUT"};
+}
+void InterpAssembler::NETCLOSE() {
+    throw std::runtime_error{"Not implemented: NETCLOSE"};
+}
+
+void InterpAssembler::SHL() { record(opcode::SHL); }
+void InterpAssembler::SHR() { record(opcode::SHR); }
+void InterpAssembler::IMUL() { record(opcode::IMUL); }
+void InterpAssembler::IDIV() { record(opcode::IDIV); }
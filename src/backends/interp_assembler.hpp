@@ -0,0 +1,157 @@
+#ifndef BACKENDS_INTERP_ASSEMBLER_HPP
+#define BACKENDS_INTERP_ASSEMBLER_HPP
+#include <memory>
+#include "assembler.hpp"
+#include "x64_assembler.hpp"
+
+/*
+ * Instructions of the interpreter, the IJVM ones plus superinstructions
+ * fusing common sequences (named after the sequence they replace)
+ */
+enum class interp_op : u8 {
+    BIPUSH, DUP, IADD, IAND, IOR, ISUB, POP, SWAP, LDC_W, ILOAD, ISTORE, IINC,
+    HALT, ERR, IN, OUT, GOTO, ICMPEQ, IFLT, IFEQ, INVOKEVIRTUAL, IRETURN,
+    NEWARRAY, IALOAD, IASTORE, SHL, SHR, IMUL, IDIV,
+
+    ILOAD_ILOAD,
+    ILOAD_ILOAD_IADD,
+    ILOAD_ILOAD_ISUB,
+    ILOAD_ILOAD_IALOAD,
+    BIPUSH_ISTORE,
+    ISUB_IFLT,
+
+    LOOP, /* counted GOTO back to a for loop condition, tiered only */
+
+    COUNT
+};
+
+/* a lowered instruction, jumps and calls still refer to names */
+struct interp_record {
+    interp_op op;
+    i64 a;
+    i64 b;
+    string target; /* label or function name */
+};
+
+/* a pre-decoded instruction, as executed */
+struct interp_ins {
+    const void *handler; /* address of the dispatch label, set by run() */
+    interp_op op;
+    i32 a; /* immediate, local slot, jump target or function index */
+    i64 b; /* second immediate, local slot or loop index */
+};
+
+struct interp_function {
+    u32 entry; /* index of the first instruction */
+    u32 slots; /* __obj_ref__ and the arguments, passed by the caller */
+    u32 vars;  /* locals, zeroed by the call */
+
+    /* tiered execution */
+    u32 calls;
+    bool compiled;     /* tried to compile it, jitted is null if impossible */
+    x64_entry jitted;
+};
+
+/* a loop that can be entered in compiled code (on-stack replacement) */
+struct interp_loop {
+    u32 fn;
+    string label;
+    u32 iterations;
+    x64_entry jitted;
+};
+
+class InterpAssembler : public Assembler {
+  public:
+    InterpAssembler(bool tiered = false); /* tiered: JITs hot code */
+    virtual ~InterpAssembler();
+
+    /* high level API */
+    virtual void compile(ostream &o); /* writes the pre-decoded listing */
+    virtual void label(string name);  /* adds label before next instruction */
+    void run();                       /* interprets the code, does not return */
+
+    /* ends previous function and adds new function */
+    virtual void function(string name, vector<string> args,
+                          vector<string> vars);
+    virtual bool is_var(string name); /* returns whether there is a variable in
+                                         the current context (local and args) */
+    virtual void line(const string &file, size_t line); /* kept for tiers */
+
+    /* Note, WIDE is done automatically for vars */
+    virtual void BIPUSH(int8_t value);
+    virtual void DUP();
+    virtual void IADD();
+    virtual void IAND();
+    virtual void IOR();
+    virtual void ISUB();
+    virtual void POP();
+    virtual void SWAP();
+
+    /* constants */
+    virtual void LDC_W(string constant);
+
+    /* local vars, WIDE is done automatically */
+    virtual void ILOAD(string var);
+    virtual void IINC(string var, int8_t value);
+    virtual void ISTORE(string var);
+    virtual void WIDE();
+
+    /* external interfacing */
+    virtual void HALT();
+    virtual void ERR();
+    virtual void IN();
+    virtual void OUT();
+    virtual void NOP();
+
+    /* control flow OPS */
+    virtual void GOTO(string label);
+    virtual void ICMPEQ(string label);
+    virtual void IFLT(string label);
+    virtual void IFEQ(string label);
+
+    /* functions */
+    virtual void INVOKEVIRTUAL(string func_name);
+    virtual void IRETURN();
+
+    /* bonus extensions */
+    virtual void NEWARRAY();
+    virtual void IALOAD();
+    virtual void IASTORE();
+    virtual void GC();
+
+    virtual void NETBIND();
+    virtual void NETCONNECT();
+    virtual void NETIN();
+    virtual void NETOUT();
+    virtual void NETCLOSE();
+
+    /* arithmetic */
+    virtual void SHL();
+    virtual void SHR();
+    virtual void IMUL();
+    virtual void IDIV();
+
+  private:
+    void record(opcode op, string arg = "", i64 value = 0);
+
+    void link();                 /* lowers, fuses, resolves jumps and calls */
+    void lower(const x64_function &f, vector<interp_record> &out);
+    void execute();              /* the dispatch loop */
+    void tier_up(u32 fn, x64_runtime &rt); /* compiles a hot function */
+
+    vector<x64_function> _program; /* recorded program */
+    std::set<string> _locals; /* args and vars of the last function */
+    bool _tiered;
+
+    std::unordered_map<string, size_t> _labels;    /* fn#label -> record */
+    std::unordered_map<string, size_t> _functions; /* name -> _fns index */
+    vector<interp_function> _fns;
+    vector<interp_loop> _loops;
+
+    vector<interp_ins> _code; /* pre-decoded program, filled by link() */
+    bool _linked;
+
+    std::unique_ptr<X64Assembler> _jit; /* shared by all tier ups */
+};
+
+#endif
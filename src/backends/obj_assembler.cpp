@@ -0,0 +1,272 @@
+#include <cstddef>
+#include <cstring>
+#include <elf.h>
+#include "obj_assembler.hpp"
+#include "elf_writer.hpp"
+#include "x64_runtime.hpp"
+#include <util/logger.hpp>
+#include <util/util.hpp>
+
+#define rt_field(field) offsetof(x64_runtime, field)
+
+/* helpers the program reaches through the runtime, the host defines them */
+static const vector<std::pair<string, size_t>> imports = {
+    {"ij_in", rt_field(in)},           {"ij_out", rt_field(out)},
+    {"ij_halt", rt_field(halt)},       {"ij_err", rt_field(err)},
+    {"ij_newarray", rt_field(newarray)}};
+
+static const vector<int> c_saved = {
+    Xbyak::Operand::RBP, Xbyak::Operand::RBX, Xbyak::Operand::R12,
+    Xbyak::Operand::R13, Xbyak::Operand::R14, Xbyak::Operand::R15};
+
+/* the C ABI passes six arguments in registers, ij's convention four */
+static const vector<int> c_args = {
+    Xbyak::Operand::RDI, Xbyak::Operand::RSI, Xbyak::Operand::RDX,
+    Xbyak::Operand::RCX, Xbyak::Operand::R8,  Xbyak::Operand::R9};
+
+struct obj_reloc {
+    size_t offset; /* of the 32 bit field in .text */
+    u32 type;
+    string symbol;
+};
+
+struct obj_writer {
+    Xbyak::CodeGenerator &g;
+    vector<obj_reloc> relocs;
+
+    /* rip relative operand, the displacement is the instruction's last field */
+    void reloc(u32 type, const string &symbol) {
+        relocs.push_back({g.getSize() - 4, type, symbol});
+    }
+
+    void load_runtime() {
+        g.lea(g.r14, g.ptr[g.rip]);
+        reloc(R_X86_64_PC32, "ij.runtime");
+    }
+
+    void load_import(const string &symbol) {
+        g.mov(g.rax, g.ptr[g.rip]);
+        reloc(R_X86_64_GOTPCREL, symbol);
+    }
+};
+
+/*
+ * C ABI in, ij convention out: the C arguments are spilled next to the saved
+ * registers, from there the last four go to registers, the rest is pushed.
+ */
+static void emit_wrapper(obj_writer &w, const x64_symbol &s,
+                         Xbyak::Label &init) {
+    Xbyak::CodeGenerator &g = w.g;
+    Xbyak::Label ready, flushed;
+
+    for (int reg : c_saved)
+        g.push(Xbyak::Reg64{reg});
+    g.mov(g.rbp, g.rsp);
+    for (size_t i = c_args.size(); i-- > 0;)
+        g.push(Xbyak::Reg64{c_args[i]});
+    g.mov(g.rbx, g.rsp);
+
+    w.load_runtime();
+    g.cmp(g.qword[g.r14 + rt_field(in)], 0);
+    g.jne(ready);
+    g.call(init);
+    g.L(ready);
+
+    auto c_arg = [&](size_t i) {
+        if (i < c_args.size())
+            return g.qword[g.rbx + 8 * i];
+        return g.qword[g.rbp + 8 * (c_saved.size() + 1 + i - c_args.size())];
+    };
+
+    size_t in_regs = std::min<size_t>(s.argc, 4);
+    size_t on_stack = s.argc - in_regs;
+    for (size_t i = 0; i < on_stack; i++)
+        g.push(c_arg(i));
+    for (size_t i = on_stack; i < s.argc; i++)
+        g.mov(Xbyak::Reg64{c_args[i - on_stack]}, c_arg(i));
+
+    // the program sits at the start of .text
+    g.db(0xE8);
+    g.dd(s.offset - (g.getSize() + 4));
+    g.mov(g.rsp, g.rbp);
+
+    // nothing stays behind in the buffer once control is back in C
+    g.mov(g.rcx, g.ptr[g.r14 + rt_field(out_cur)]);
+    g.lea(g.rdx, g.ptr[g.r14 + rt_field(out_buf)]);
+    g.cmp(g.rcx, g.rdx);
+    g.je(flushed);
+    g.push(g.rax);
+    g.mov(g.rdi, g.r14);
+    w.load_import("ij_flush");
+    g.call(g.rax);
+    g.pop(g.rax);
+    g.L(flushed);
+
+    for (size_t i = c_saved.size(); i-- > 0;)
+        g.pop(Xbyak::Reg64{c_saved[i]});
+    g.ret();
+}
+
+/* fills in the runtime r14 points to, only clobbers rax */
+static void emit_init(obj_writer &w, Xbyak::Label &init) {
+    Xbyak::CodeGenerator &g = w.g;
+    Xbyak::Label debug;
+
+    g.L(init);
+    for (auto &import : imports) {
+        w.load_import(import.first);
+        g.mov(g.ptr[g.r14 + import.second], g.rax);
+    }
+    g.lea(g.rax, g.ptr[g.rip + debug]);
+    g.mov(g.ptr[g.r14 + rt_field(debug)], g.rax);
+
+    g.lea(g.rax, g.ptr[g.r14 + rt_field(in_buf)]);
+    g.mov(g.ptr[g.r14 + rt_field(in_cur)], g.rax);
+    g.mov(g.ptr[g.r14 + rt_field(in_end)], g.rax);
+    g.lea(g.rax, g.ptr[g.r14 + rt_field(out_buf)]);
+    g.mov(g.ptr[g.r14 + rt_field(out_cur)], g.rax);
+    g.lea(g.rax, g.ptr[g.r14 + rt_field(out_buf) + x64_io_buffer]);
+    g.mov(g.ptr[g.r14 + rt_field(out_end)], g.rax);
+    g.ret();
+
+    // instructions are only traced in the JIT
+    g.L(debug);
+    g.ret();
+}
+
+void ObjAssembler::compile(ostream &o) {
+    size_t size;
+    const u8 *code = generated(size);
+
+    Xbyak::CodeGenerator g{size + 256 * symbols().size() + 4096};
+    obj_writer w{g, {}};
+    Xbyak::Label init;
+
+    for (size_t i = 0; i < size; i++)
+        g.db(code[i]);
+
+    vector<std::pair<x64_symbol, size_t>> wrappers; /* and their offset */
+    for (const x64_symbol &s : symbols()) {
+        if (!s.fast)
+            continue;
+
+        size_t start = g.getSize();
+        emit_wrapper(w, s, init);
+        wrappers.push_back({s, start});
+        log_info("obj: %s wrapped at 0x%lx, body at 0x%lx", s.name.c_str(),
+                 start, s.offset);
+    }
+
+    size_t init_start = g.getSize();
+    emit_init(w, init);
+
+    /* symbols, the locals have to come first */
+    string strtab{'\0'};
+    vector<Elf64_Sym> syms(1);
+    std::unordered_map<string, size_t> index;
+
+    auto add_symbol = [&](const string &name, u8 bind, u8 type, u16 shndx,
+                          u64 value, u64 size) {
+        index[name] = syms.size();
+        Elf64_Sym sym{};
+        sym.st_name = add_string(strtab, name);
+        sym.st_info = ELF64_ST_INFO(bind, type);
+        sym.st_shndx = shndx;
+        sym.st_value = value;
+        sym.st_size = size;
+        syms.push_back(sym);
+    };
+
+    add_symbol("ij.runtime", STB_LOCAL, STT_OBJECT, 2, 0, sizeof(x64_runtime));
+    add_symbol("ij.init", STB_LOCAL, STT_FUNC, 1, init_start,
+               g.getSize() - init_start);
+    for (const x64_symbol &s : symbols())
+        add_symbol(concat("ij.", s.name), STB_LOCAL, STT_FUNC, 1, s.offset,
+                   s.size);
+
+    size_t first_global = syms.size();
+    for (size_t i = 0; i < wrappers.size(); i++) {
+        size_t end = i + 1 < wrappers.size() ? wrappers[i + 1].second
+                                             : init_start;
+        add_symbol(wrappers[i].first.name, STB_GLOBAL, STT_FUNC, 1,
+                   wrappers[i].second, end - wrappers[i].second);
+    }
+    for (auto &import : imports)
+        add_symbol(import.first, STB_GLOBAL, STT_NOTYPE, SHN_UNDEF, 0, 0);
+    add_symbol("ij_flush", STB_GLOBAL, STT_NOTYPE, SHN_UNDEF, 0, 0);
+
+    vector<Elf64_Rela> relas;
+    for (const obj_reloc &r : w.relocs) {
+        Elf64_Rela rela{};
+        rela.r_offset = r.offset;
+        rela.r_info = ELF64_R_INFO(index.at(r.symbol), r.type);
+        rela.r_addend = -4;
+        relas.push_back(rela);
+    }
+
+    /* sections */
+    string shstrtab{'\0'};
+    Elf64_Shdr shdr[8]{};
+    string file(sizeof(Elf64_Ehdr), '\0');
+
+    align(file, 16);
+    shdr[1].sh_name = add_string(shstrtab, ".text");
+    shdr[1].sh_type = SHT_PROGBITS;
+    shdr[1].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    shdr[1].sh_offset = append(file, g.getCode<const u8 *>(), g.getSize());
+    shdr[1].sh_size = g.getSize();
+    shdr[1].sh_addralign = 16;
+
+    shdr[2].sh_name = add_string(shstrtab, ".bss");
+    shdr[2].sh_type = SHT_NOBITS;
+    shdr[2].sh_flags = SHF_ALLOC | SHF_WRITE;
+    shdr[2].sh_offset = file.size();
+    shdr[2].sh_size = sizeof(x64_runtime);
+    shdr[2].sh_addralign = 16;
+
+    align(file, 8);
+    shdr[3].sh_name = add_string(shstrtab, ".rela.text");
+    shdr[3].sh_type = SHT_RELA;
+    shdr[3].sh_flags = SHF_INFO_LINK;
+    shdr[3].sh_offset = append(file, relas.data(), relas.size());
+    shdr[3].sh_size = sizeof(Elf64_Rela) * relas.size();
+    shdr[3].sh_link = 4;
+    shdr[3].sh_info = 1;
+    shdr[3].sh_addralign = 8;
+    shdr[3].sh_entsize = sizeof(Elf64_Rela);
+
+    shdr[4].sh_name = add_string(shstrtab, ".symtab");
+    shdr[4].sh_type = SHT_SYMTAB;
+    shdr[4].sh_offset = append(file, syms.data(), syms.size());
+    shdr[4].sh_size = sizeof(Elf64_Sym) * syms.size();
+    shdr[4].sh_link = 5;
+    shdr[4].sh_info = first_global;
+    shdr[4].sh_addralign = 8;
+    shdr[4].sh_entsize = sizeof(Elf64_Sym);
+
+    shdr[5].sh_name = add_string(shstrtab, ".strtab");
+    shdr[5].sh_type = SHT_STRTAB;
+    shdr[5].sh_offset = append(file, strtab.data(), strtab.size());
+    shdr[5].sh_size = strtab.size();
+    shdr[5].sh_addralign = 1;
+
+    // no executable stack needed
+    shdr[6].sh_name = add_string(shstrtab, ".note.GNU-stack");
+    shdr[6].sh_type = SHT_PROGBITS;
+    shdr[6].sh_offset = file.size();
+    shdr[6].sh_addralign = 1;
+
+    shdr[7].sh_name = add_string(shstrtab, ".shstrtab");
+    shdr[7].sh_type = SHT_STRTAB;
+    shdr[7].sh_offset = append(file, shstrtab.data(), shstrtab.size());
+    shdr[7].sh_size = shstrtab.size();
+    shdr[7].sh_addralign = 1;
+
+    align(file, 8);
+    Elf64_Ehdr ehdr = elf_rel_header(append(file, shdr, 8), 8);
+    memcpy(&file[0], &ehdr, sizeof(ehdr));
+
+    log_info("obj: %d functions exported, %d relocations", (int)wrappers.size(),
+             (int)relas.size());
+    o.write(file.data(), file.size());
+}
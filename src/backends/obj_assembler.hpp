@@ -0,0 +1,30 @@
+#ifndef BACKENDS_OBJ_ASSEMBLER_HPP
+#define BACKENDS_OBJ_ASSEMBLER_HPP
+#include "x64_assembler.hpp"
+
+/*
+ * Packages the x64 code as an ELF64 relocatable object to link into C and
+ * C++ programs. Every function using the register based convention gets a
+ * global symbol under its own name, a C ABI wrapper:
+ *
+ *     extern "C" int64_t fib(int64_t n);
+ *
+ * The runtime is private to the object (bss), its helpers are undefined
+ * symbols (ij_in, ij_out, ...) that x64_runtime.cpp provides. The first call
+ * fills it in, output is flushed before a wrapper returns.
+ *
+ *        .text  +--------------+
+ *               |   program    |  X64Assembler output
+ *               |   wrappers   |  C ABI to the ij convention
+ *               |     init     |  fills in the runtime
+ *               +--------------+
+ *        .bss   | x64_runtime  |
+ *               +--------------+
+ */
+class ObjAssembler : public X64Assembler {
+  public:
+    virtual void compile(ostream &o); /* writes the object to ostream */
+    virtual bool is_library() { return true; }
+};
+
+#endif
@@ -1,12 +1,24 @@
 #include <iostream>
+#include <cstddef>
+#include <cstring>
+#include <csetjmp>
 #include "x64_assembler.hpp"
+#include "x64_runtime.hpp"
+#include "x64_perf.hpp"
+#include "x64_gdb.hpp"
+#include "x64_profile.hpp"
+#include "x64_counters.hpp"
+#include "x64_perf_stats.hpp"
 #include "ijvm_assembler.hpp"
 #include <util/util.hpp>
+#include <util/stats.hpp>
 #include <sys/syscall.h>
 
 #ifdef DEBUG
 #define DUMP_INSTRUCTION(op)                            \
     if (log.get_log_level() == LogLevel::info) {        \
+        tos_flush();                                    \
+                                                        \
         /* store op and tos into argument registers */  \
         x64.mov(x64.rdi, op);                           \
         x64.mov(x64.rsi, x64.ptr[x64.rsp]);             \
@@ -22,20 +34,15 @@
 
 
 /*
- * We follow the System-5 AMD64 ABI so that we can call into c functions:
- *     halt() handles a HALT
- *     error() handles an ERR
- *     getchar() handles getting a character from stdin
- *     putchar() handles putting a character on stdout
- *
- * Off limits:
- *     rbx, rsp, rbp, r12, r13, r14, and r15
- *
- * This means we can use the following for scratch registers:
- *     rax, rdi, rsi, rdx, rcx, r8, r9, r10, r11
+ * We follow the System-5 AMD64 ABI so that we can call into c functions,
+ * the C side of things lives in x64_runtime.cpp.
  *
- * Function arguments are given by:
- *     rdi, rsi, rdx, rcx, r8, r9
+ * Register usage:
+ *     r14                      x64_runtime pointer
+ *     r8, r9, r10              top of stack cache
+ *     rbx, r12, r13, r15, r11  local variables
+ *     rdi, rsi, rdx, rcx       arguments of ij and C functions
+ *     rax                      scratch, return values
  *
  * IJVM functions follow the following model
  *
@@ -59,136 +66,133 @@
  * +------------+ <- rsp
  *
  */
-uint64_t __in__() {
-    int c = getchar();
-    c = (c < 0) ? 0 : c;
-
-    log.info(" -> read char 0x%02x[%c]", c, c);
-    return c;
-}
-
-void __out__(int64_t val) {
-    putchar(val);
-}
-
-void __halt__() {
-    // fprintf(stderr, "Closing the IJVM gracefully\n");
-    exit(0);
-}
-
-void __err__() {
-    fprintf(stderr, "ERROR Encountered\n");
-    exit(1);
-}
-
-uint64_t __newarray__(int64_t size) {
-    int64_t *arr = (int64_t *)calloc(size, sizeof(size));
-    log.info(" -> newarray(%ld) -> %p", size, (void *)arr);
-    return (uint64_t)arr;
-}
-
-int64_t __iaload__(int64_t *arr, int64_t index) {
-    log.info(" -> iaload(%p, %ld) -> %ld", (void *)arr, index, arr[index]);
-    return arr[index];
-}
-
-void __iastore__(int64_t *arr, int64_t index, int64_t value) {
-    log.info(" -> iastore(%p, %ld, %ld)", (void *)arr, index, value);
-    arr[index] = value;
-}
-
-#ifdef DEBUG
-void debug(i64 op, i64 tos) {
-    switch (op) {
-        case op_bipush:        log.info("bipush [tos:%llx]", tos);           break;
-        case op_dup:           log.info("dup [tos:%llx]", tos);              break;
-        case op_err:           log.info("err [tos:%llx]", tos);              break;
-        case op_goto:          log.info("goto [tos:%llx]", tos);             break;
-        case op_halt:          log.info("halt [tos:%llx]", tos);             break;
-        case op_iadd:          log.info("iadd [tos:%llx]", tos);             break;
-        case op_iand:          log.info("iand [tos:%llx]", tos);             break;
-        case op_ifeq:          log.info("ifeq [tos:%llx]", tos);             break;
-        case op_iflt:          log.info("iflt [tos:%llx]", tos);             break;
-        case op_icmpeq:        log.info("icmpeq [tos:%llx]", tos);           break;
-        case op_iinc:          log.info("iinc [tos:%llx]", tos);             break;
-        case op_iload:         log.info("iload [tos:%llx]", tos);            break;
-        case op_in:            log.info("in [tos:%llx]", tos);               break;
-        case op_invokevirtual: log.info("invokevirtual [tos:%llx]", tos);    break;
-        case op_ior:           log.info("ior [tos:%llx]", tos);              break;
-        case op_ireturn:       log.info("ireturn [tos:%llx]", tos);          break;
-        case op_istore:        log.info("istore [tos:%llx]", tos);           break;
-        case op_isub:          log.info("isub [tos:%llx]", tos);             break;
-        case op_ldc_w:         log.info("ldc_w [tos:%llx]", tos);            break;
-        case op_nop:           log.info("nop [tos:%llx]", tos);              break;
-        case op_out:           log.info("out [tos:%llx]", tos);              break;
-        case op_pop:           log.info("pop [tos:%llx]", tos);              break;
-        case op_swap:          log.info("swap [tos:%llx]", tos);             break;
-        case op_wide:          log.info("wide [tos:%llx]", tos);             break;
-        case op_newarray:      log.info("newarray [tos:%llx]", tos);         break;
-        case op_iaload:        log.info("iaload [tos:%llx]", tos);           break;
-        case op_iastore:       log.info("iastore [tos:%llx]", tos);          break;
-        case op_gc:            log.info("gc [tos:%llx]", tos);               break;
-        case op_netbind:       log.info("netbind [tos:%llx]", tos);          break;
-        case op_netconnect:    log.info("netconnect [tos:%llx]", tos);       break;
-        case op_netin:         log.info("netin [tos:%llx]", tos);            break;
-        case op_netout:        log.info("netout [tos:%llx]", tos);           break;
-        case op_netclose:      log.info("netclose [tos:%llx]", tos);         break;
-        default:
-            log.panic("incorrect op");
-    }
+/*
+ * Functions can be generated while the program runs, so the code must never
+ * move: the buffer is allocated once, up front. Programs with more code than
+ * this don't compile to x64.
+ */
+const size_t x64_code_max = 1 << 26;
+
+/* Xbyak can't grow the buffer, running out of it gets a clearer error */
+static void check_code_max(const Xbyak::Error &e) {
+    if ((int)e == Xbyak::ERR_CODE_IS_TOO_BIG)
+        throw std::runtime_error{
+            sprint("x64: program too large, more than %d MiB of code",
+                   (int)(x64_code_max >> 20))};
 }
-#endif
 
 X64Assembler::X64Assembler()
-    : x64{4096 * 16, Xbyak::AutoGrow}, r_functions{x64.r14}, r_safe{x64.r15}, _io_added{false} {
+    : x64{x64_code_max}, r_functions{x64.r14}, _generated{false},
+      _ready{false}, _lazy{false} {
 
     // if program becomes too long, the default relative jump would simply be too
     // short and compilation would fail
     x64.setDefaultJmpNEAR(true);
-
-    // The r15 register contains a lookup pointer to the essential functions.
-    // It's runtime so to speak.
-    x64.mov(r_functions, x64.rdi);
 }
 X64Assembler::~X64Assembler() {}
 
 void X64Assembler::compile(ostream &o) {
+    generate();
     o.write(x64.getCode<const char *>(), x64.getSize());
 }
 
-#define r_function_getchar ((0 * 8))
-#define r_function_putchar ((1 * 8))
-#define r_function_halt ((2 * 8))
-#define r_function_error ((3 * 8))
-#define r_function_calloc ((4 * 8))
-#define r_function_newarray ((5 * 8))
-#define r_function_iaload ((6 * 8))
-#define r_function_iastore ((7 * 8))
-#define r_function_debug ((8 * 8))
+/* the code is position independent, the runtime is reached through r14 */
+void X64Assembler::load(const string &code) {
+    if (_generated)
+        throw std::runtime_error{"x64: code was generated already"};
+    _generated = true;
 
-void X64Assembler::run() {
-    void *functions[] = {(void *)__in__,     (void *)__out__,
-                         (void *)__halt__,   (void *)__err__,
-                         (void *)calloc,     (void *)__newarray__,
-                         (void *)__iaload__, (void *)__iastore__,
-#ifdef DEBUG
-                         (void *)debug
-#endif
-    };
+    for (char c : code)
+        x64.db((u8)c);
+}
+
+const u8 *X64Assembler::generated(size_t &size) {
+    generate();
+    size = x64.getSize();
+    return x64.getCode<const u8 *>();
+}
 
+#define r_function_in offsetof(x64_runtime, in)
+#define r_function_out offsetof(x64_runtime, out)
+#define r_function_halt offsetof(x64_runtime, halt)
+#define r_function_error offsetof(x64_runtime, err)
+#define r_function_newarray offsetof(x64_runtime, newarray)
+#define r_function_debug offsetof(x64_runtime, debug)
+#define r_function_compile offsetof(x64_runtime, compile)
+#define r_jit offsetof(x64_runtime, jit)
+#define r_heap_cur offsetof(x64_runtime, heap_cur)
+#define r_heap_end offsetof(x64_runtime, heap_end)
+#define r_in_cur offsetof(x64_runtime, in_cur)
+#define r_in_end offsetof(x64_runtime, in_end)
+#define r_out_cur offsetof(x64_runtime, out_cur)
+#define r_out_end offsetof(x64_runtime, out_end)
+
+void X64Assembler::ready_lazily(x64_runtime &rt) {
+    rt.compile = (void *)compile_lazily;
+    rt.jit = this;
+    if (_ready)
+        return;
+
+    // only functions that actually get called are generated
+    _lazy = true;
+    generate();
     x64.ready();
-    auto code = x64.getCode<void (*)(void **)>();
-    code(functions);
+    _ready = true;
+}
+
+void X64Assembler::run() {
+    x64_runtime runtime;
+    ready_lazily(runtime);
+    auto code = x64.getCode<void (*)(x64_runtime *)>();
+    if (perf_stats.enabled())
+        perf_stats.start();
+    code(&runtime);
+    log.panic("Shouldn't have run this oh doodoo");
+}
+
+/*
+ * HALT and ERR longjmp back here rather than exit, the jitted code has
+ * nothing to unwind. The runtime keeps the heap and buffers of the run,
+ * x64_reset clears them for the next.
+ */
+int X64Assembler::run_once(x64_runtime &rt) {
+    ready_lazily(rt);
+    auto code = x64.getCode<void (*)(x64_runtime *)>();
+
+    jmp_buf host;
+    int status = setjmp(host);
+    if (status) {
+        rt.host = nullptr;
+        return status - 1;
+    }
+
+    rt.host = &host;
+    code(&rt);
     log.panic("Shouldn't have run this oh doodoo");
+    return 1;
 }
 
 void X64Assembler::external_c_call() {
+    // the cache registers are caller saved, arguments have been popped already
+    tos_flush();
+    external_c_call({});
+}
+
+void X64Assembler::external_c_call(const vector<int> &live) {
     /* External C calls are... delecate... aka they ignore AMD64 ABI sometimes */
 
+    // slow paths keep the cache, so they save it around the call
+    for (int reg : live)
+        x64.push(Xbyak::Reg64{reg});
+
     // originally stored this in r15, which vprintf just fucks up
     // so have to save c functions pointer on stack
     x64.push(r_functions);
 
+    // r11 is not preserved by C, and may hold a local of any ij caller up
+    // the stack even if this function doesn't use it
+    x64.push(x64.r11);
+
     // store old stack pointer in local variables and align stack
     x64.mov(x64.ptr[x64.rbp - _local_variables["__rsp__"]], x64.rsp);
     x64.and_(x64.rsp, ~0xf);
@@ -199,323 +203,1161 @@ void X64Assembler::external_c_call() {
     // restore rsp (mis)alignment
     x64.mov(x64.rsp, x64.ptr[x64.rbp - _local_variables["__rsp__"]]);
 
+    x64.pop(x64.r11);
+
     // restore func pointer
     x64.pop(r_functions);
+
+    for (size_t i = live.size(); i-- > 0;)
+        x64.pop(Xbyak::Reg64{live[i]});
 }
 
-void X64Assembler::label(string name) {
-    log.info("");
-    log.info("  %s#%s:", fname.c_str(), name.c_str());
-    x64.L(concat(fname, "#", name));
+static const char *reg_name(const Xbyak::Reg64 &r) {
+    static const char *names[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp",
+                                  "rsi", "rdi", "r8",  "r9",  "r10", "r11",
+                                  "r12", "r13", "r14", "r15"};
+    return names[r.getIdx()];
 }
 
+/*
+ * Locals that are used in registers, rbx, r12, r13 and r15 are callee saved
+ * in the AMD64 ABI. r11 isn't, so external_c_call preserves it on its own.
+ * Between ij functions all of them are callee saved.
+ */
+static const vector<int> local_regs = {
+    Xbyak::Operand::RBX, Xbyak::Operand::R12, Xbyak::Operand::R13,
+    Xbyak::Operand::R15, Xbyak::Operand::R11};
+
+/* the last (up to) four arguments of a fast call are passed in registers */
+static const vector<int> arg_regs = {Xbyak::Operand::RDI, Xbyak::Operand::RSI,
+                                     Xbyak::Operand::RDX, Xbyak::Operand::RCX};
+
+void X64Assembler::record(opcode op, string arg, i64 value) {
+    if (_functions.empty())
+        throw std::runtime_error{"x64: instruction outside of a function"};
+
+    _functions.back().body.push_back({op, arg, value});
+}
+
+void X64Assembler::label(string name) { record(opcode::INVALID, name); }
+
 void X64Assembler::function(string name, vector<string> args,
                             vector<string> vars) {
-    log.info("Building function %s:", name.c_str());
+    _functions.push_back({name, args, vars, {}, {}});
+    _locals = {args.begin(), args.end()};
+    _locals.insert(vars.begin(), vars.end());
+}
 
-    /* internal book keeping, fill metadata */
-    fname = name;
-    _local_variables.clear();
+void X64Assembler::function(const x64_function &f) {
+    _functions.push_back(f);
+    _locals = {f.args.begin(), f.args.end()};
+    _locals.insert(f.vars.begin(), f.vars.end());
+}
 
-    log.info("    stack_frame for function:");
-    int offset = 0;
+void X64Assembler::add_entry(string fn, string label) {
+    if (_generated)
+        throw std::runtime_error{"x64: entries have to be added up front"};
 
-    if (name != "main") {
-        _local_variables["__obj_ref__"] = offset;
-        log.info("    [rbp - %d] = arg __obj_ref__", offset);
-    } else
-        offset = -8;
+    _entries[{fn, label}];
+}
 
-    for (const string &s : args) {
-        _local_variables[s] = (offset += 8);
-        log.info("    [rbp - %2d] = arg %s", offset, s.c_str());
+x64_entry X64Assembler::entry(string fn, string label) {
+    if (!_ready) {
+        generate();
+        x64.ready();
+        _ready = true;
     }
 
-    _local_variables["__ret_addr__"] = (offset += 8);
-    log.info("    [rbp - %2d] = __ret_addr__", offset);
+    // functions with the IJVM like frame have no entry stubs
+    if (!_entries.count({fn, label}) || _legacy_frames.count(fn))
+        return nullptr;
 
-    _local_variables["__base_ptr__"] = (offset += 8);
-    log.info("    [rbp - %2d] = __base_ptr__", offset);
+    // generated lazily, the entries come with the function
+    if (_stubs.count(fn))
+        for (size_t i = 0; i < _functions.size(); i++)
+            if (_functions[i].name == fn)
+                generate_lazily(i);
+
+    return (x64_entry)_entries[{fn, label}].getAddress();
+}
+
+bool X64Assembler::is_var(string name) {
+    if (_functions.empty())
+        return false;
+
+    return name == "__obj_ref__" || contains(_locals, name);
+}
+
+void X64Assembler::line(const string &file, size_t line) {
+    if (!_functions.empty())
+        add_line(_functions.back(), file, line);
+}
+
+void X64Assembler::generate() {
+    if (_generated)
+        return;
+    _generated = true;
+    Phase phase{"generate"};
+
+    for (const x64_function &f : _functions) {
+        _fn_argc[f.name] = f.args.size();
+        if (f.name == "main" || inspects_frame(f))
+            _legacy_frames.insert(f.name);
+    }
+
+    // The r14 register points to the x64_runtime, passed in by run()
+    x64.mov(r_functions, x64.rdi);
+
+    try {
+        for (size_t i = 0; i < _functions.size(); i++) {
+            // execution starts in the first function, that one can't wait
+            if (_lazy && i > 0)
+                emit_stub(i);
+            else
+                generate(_functions[i]);
+        }
+    } catch (Xbyak::Error &e) {
+        check_code_max(e);
+        throw;
+    }
+}
+
+/*
+ * Until the function is compiled its stub calls compile_lazily, keeping the
+ * arguments intact. Afterwards the stub's first jmp goes to the body directly.
+ */
+void X64Assembler::emit_stub(size_t index) {
+    static const vector<int> keep = {
+        Xbyak::Operand::RDI, Xbyak::Operand::RSI, Xbyak::Operand::RDX,
+        Xbyak::Operand::RCX, Xbyak::Operand::R11, Xbyak::Operand::RBP};
+
+    const string &name = _functions[index].name;
+    Xbyak::Label compile;
+
+    log_info("%s:", name.c_str());
+    log_info("    jmp .compile              ; lazy stub");
+
+    x64.L(name);
+    _stubs[name] = x64.getSize();
+    x64.jmp(compile);
+    x64.L(compile);
+
+    for (int reg : keep)
+        x64.push(Xbyak::Reg64{reg});
+    x64.mov(x64.rbp, x64.rsp);
+    x64.and_(x64.rsp, ~0xf);
+
+    x64.mov(x64.rdi, x64.ptr[r_functions + r_jit]);
+    x64.mov(x64.rsi, index);
+    x64.mov(x64.rax, x64.ptr[r_functions + r_function_compile]);
+    x64.call(x64.rax);
+
+    x64.mov(x64.rsp, x64.rbp);
+    for (size_t i = keep.size(); i-- > 0;)
+        x64.pop(Xbyak::Reg64{keep[i]});
+    x64.jmp(x64.rax);
+
+    size_t stub = _stubs[name];
+    perf_sink.code(x64.getCode<const u8 *>() + stub, x64.getSize() - stub,
+                   concat(name, ".stub"));
+}
+
+/* called from a stub, generates the function and patches the stub */
+void *X64Assembler::compile_lazily(X64Assembler *self, i64 index) {
+    try {
+        return self->generate_lazily(index);
+    } catch (std::exception &e) {
+        // there's jitted code on the stack, exceptions can't go through it
+        log.panic("while compiling %s, %s",
+                  self->_functions[index].name.c_str(), e.what());
+    }
+    return nullptr;
+}
+
+/* once patched the stub jumps to the body, so this happens once */
+void *X64Assembler::generate_lazily(size_t index) {
+    const x64_function &f = _functions[index];
+    size_t body = x64.getSize();
+
+    try {
+        generate(f);
+    } catch (Xbyak::Error &e) {
+        check_code_max(e);
+        throw;
+    }
+
+    u8 *code = x64.getCode<u8 *>();
+    size_t stub = _stubs[f.name];
+    if (code[stub] != 0xE9)
+        log.panic("x64: stub of %s isn't a near jmp", f.name.c_str());
+
+    i32 rel = body - (stub + 5);
+    memcpy(code + stub + 1, &rel, sizeof(rel));
+    _stubs.erase(f.name);
+
+    log_info("compiled %s lazily, %d bytes", f.name.c_str(),
+             (int)(x64.getSize() - body));
+    return code + body;
+}
+
+/*
+ * A function that touches __obj_ref__ (which JAS code can) expects the IJVM
+ * like frame, with the object reference and arguments pushed by the caller
+ */
+bool X64Assembler::inspects_frame(const x64_function &f) {
+    for (const x64_instruction &ins : f.body)
+        if (ins.arg == "__obj_ref__" &&
+            in(ins.op, {opcode::ILOAD, opcode::ISTORE, opcode::IINC}))
+            return true;
+
+    return false;
+}
+
+/*
+ * Calls to functions with a fast frame ignore the object reference pushed
+ * below the arguments. If that slot is provably filled by a side effect free
+ * push that nothing else consumes, both the push and the pop can go.
+ *
+ * Tracks which instruction produced each stack slot (-1 if unknown). Slots
+ * popped anywhere else, duplicated or live across a jump are tainted.
+ */
+void X64Assembler::elide_objrefs(const x64_function &f) {
+    vector<long> stack;
+    std::set<long> tainted;
+    vector<std::pair<size_t, long>> candidates; /* call, objref push */
+
+    auto pop = [&]() {
+        long p = -1;
+        if (!stack.empty()) {
+            p = stack.back();
+            stack.pop_back();
+        }
+        tainted.insert(p);
+        return p;
+    };
+    auto taint_all = [&]() { tainted.insert(stack.begin(), stack.end()); };
+
+    for (size_t i = 0; i < f.body.size(); i++) {
+        const x64_instruction &ins = f.body[i];
+        long self = i;
+
+        switch (ins.op) {
+        case opcode::INVALID:
+            // can be reached from elsewhere, the slots are anonymous now
+            std::fill(stack.begin(), stack.end(), -1);
+            break;
+        case opcode::BIPUSH:
+        case opcode::LDC_W:
+        case opcode::ILOAD:
+        case opcode::IN:
+            stack.push_back(self);
+            break;
+        case opcode::DUP: {
+            long p = pop();
+            stack.push_back(p);
+            stack.push_back(p);
+            break;
+        }
+        case opcode::SWAP: {
+            long a = pop(), b = pop();
+            stack.push_back(a);
+            stack.push_back(b);
+            break;
+        }
+        case opcode::IADD:
+        case opcode::IAND:
+        case opcode::IOR:
+        case opcode::ISUB:
+        case opcode::IMUL:
+        case opcode::IDIV:
+        case opcode::IALOAD:
+            pop(), pop();
+            stack.push_back(self);
+            break;
+        case opcode::NEWARRAY:
+        case opcode::SHL:
+        case opcode::SHR:
+            pop();
+            stack.push_back(self);
+            break;
+        case opcode::POP:
+        case opcode::ISTORE:
+        case opcode::OUT:
+            pop();
+            break;
+        case opcode::IASTORE:
+            pop(), pop(), pop();
+            break;
+        case opcode::GOTO:
+            taint_all();
+            break;
+        case opcode::ICMPEQ:
+            pop(), pop();
+            taint_all();
+            break;
+        case opcode::IFLT:
+        case opcode::IFEQ:
+            pop();
+            taint_all();
+            break;
+        case opcode::INVOKEVIRTUAL: {
+            auto callee = _fn_argc.find(ins.arg);
+            if (callee == _fn_argc.end())
+                throw std::runtime_error{"x64: call to unknown function " +
+                                         ins.arg};
+            for (size_t n = 0; n < callee->second; n++)
+                pop();
+
+            if (_legacy_frames.count(ins.arg) || stack.empty()) {
+                pop();
+            } else {
+                long objref = stack.back();
+                stack.pop_back();
+
+                if (objref >= 0 && in(f.body[objref].op, {opcode::BIPUSH,
+                                                          opcode::LDC_W,
+                                                          opcode::ILOAD}))
+                    candidates.emplace_back(i, objref);
+                else
+                    tainted.insert(objref);
+            }
+
+            stack.push_back(self);
+            break;
+        }
+        case opcode::IRETURN:
+        case opcode::HALT:
+        case opcode::ERR:
+            stack.clear();
+            break;
+        case opcode::IINC:
+        case opcode::NOP:
+        case opcode::WIDE:
+            break;
+        default:
+            taint_all();
+            stack.clear();
+            break;
+        }
+    }
+
+    _elided.clear();
+    for (auto &c : candidates)
+        if (!tainted.count(c.second)) {
+            _elided.insert(c.first);
+            _elided.insert(c.second);
+        }
+}
+
+void X64Assembler::generate(const x64_function &f) {
+    const string &name = f.name;
+    const vector<string> &args = f.args;
+    const vector<string> &vars = f.vars;
+    bool legacy = _legacy_frames.count(name);
+    Phase phase{"generate", name};
+
+    log_info("Building function %s:", name.c_str());
+
+    /* internal book keeping, fill metadata */
+    fname = name;
+    _local_variables.clear();
+    _tos.clear();
+    _labels.clear();
+    _lines.clear();
+    _slow_paths.clear(); /* of a function that failed to generate */
+
+    _var_registers = allocate_locals(f, local_regs);
+    _saved_registers.clear();
+    if (name != "main")
+        for (int reg : local_regs)
+            for (auto &entry : _var_registers)
+                if (entry.second == reg && !contains(_saved_registers, reg))
+                    _saved_registers.push_back(reg);
+
+    elide_objrefs(f);
+
+    log_info("    stack_frame for function:");
+    int offset = 0;
+
+    // the last arguments arrive in registers, any others on the stack
+    size_t in_regs = std::min(args.size(), arg_regs.size());
+    size_t on_stack = args.size() - in_regs;
+
+    if (legacy) {
+        if (name != "main") {
+            _local_variables["__obj_ref__"] = offset;
+            log_info("    [rbp - %d] = arg __obj_ref__", offset);
+        } else
+            offset = -8;
+
+        for (const string &s : args) {
+            _local_variables[s] = (offset += 8);
+            log_info("    [rbp - %2d] = arg %s", offset, s.c_str());
+        }
+
+        _local_variables["__ret_addr__"] = (offset += 8);
+        log_info("    [rbp - %2d] = __ret_addr__", offset);
+
+        _local_variables["__base_ptr__"] = (offset += 8);
+        log_info("    [rbp - %2d] = __base_ptr__", offset);
+    } else {
+        _local_variables["__base_ptr__"] = 0;
+        _local_variables["__ret_addr__"] = -8;
+
+        for (size_t i = 0; i < on_stack; i++) {
+            _local_variables[args[i]] = -(16 + 8 * (on_stack - 1 - i));
+            log_info("    [rbp + %2d] = arg %s", -_local_variables[args[i]],
+                     args[i].c_str());
+        }
+    }
 
     // needed for rsp alignment
     _local_variables["__rsp__"] = (offset += 8);
-    log.info("    [rbp - %2d] = __rsp__", offset);
+    log_info("    [rbp - %2d] = __rsp__", offset);
+
+    if (!legacy)
+        for (size_t i = on_stack; i < args.size(); i++) {
+            _local_variables[args[i]] = (offset += 8);
+            log_info("    [rbp - %2d] = arg %s", offset, args[i].c_str());
+        }
 
     for (const string &s : vars) {
         _local_variables[s] = (offset += 8);
-        log.info("    [rbp - %2d] = lvar %s", offset, s.c_str());
+        log_info("    [rbp - %2d] = lvar %s", offset, s.c_str());
+    }
+
+    for (int reg : _saved_registers) {
+        string slot = sprint("__save_%s__", reg_name(Xbyak::Reg64{reg}));
+        _local_variables[slot] = (offset += 8);
+        log_info("    [rbp - %2d] = %s", offset, slot.c_str());
     }
 
+    for (auto &entry : _var_registers)
+        log_info("    %s = %s", reg_name(Xbyak::Reg64{entry.second}),
+                 entry.first.c_str());
+
     /* code generation */
 
-    // SETUP jmp label so we can call this site
-    x64.L(name);
+    size_t start = x64.getSize();
+
+    // SETUP jmp label so we can call this site, unless a stub took it
+    if (!_stubs.count(name))
+        x64.L(name);
 
-    log.info("; declare function");
-    log.info("%s:", name.c_str());
+    log_info("; declare function");
+    log_info("%s:", name.c_str());
     x64.push(x64.rbp);  // remember prev rbp
-    log.info("    push rbp                  ; save previous rbp");
+    log_info("    push rbp                  ; save previous rbp");
+
+    if (legacy) {
+        // Stack is now in following state
+        //
+        // for method         for main
+        // __obj_ref__           rip
+        //    arg1               rbp
+        //    arg2
+        //    rip
+        //    rbp
+
+        // we need to calculate the new rbp, which should start at the first argument
+        // it's important to note that __obj_ref__ is an implicit argument, and not in the argument list
+        // therefore
+
+        // if main, no arguments, just the rip+rbp
+        if (name == "main") {
+            log_info("    lea rbp, [rsp + %3d]      ; new rbp = rsp - size(rip+rbp)", 1 * 8);
+            x64.lea(x64.rbp, x64.ptr[x64.rsp + 1 * 8]);
+        }
+        // if method we should skip over rip+rbp+args+__obj_ref__
+        else {
+            log_info("    lea rbp, [rsp + %3d]      ; new rbp = rsp - size(rip+rbp+args)", (2+args.size()) * 8);
+            x64.lea(x64.rbp, x64.ptr[x64.rsp + (2 + args.size()) * 8]);
+        }
+    } else {
+        log_info("    mov rbp, rsp");
+        x64.mov(x64.rbp, x64.rsp);
+    }
 
-    // Stack is now in following state
-    //
-    // for method         for main
-    // __obj_ref__           rip
-    //    arg1               rbp
-    //    arg2
-    //    rip
-    //    rbp
+    // now we need to setup rsp, which means we need to reserve enough room for
+    // all the lvars, register arguments and the saved registers
+    size_t reserved = (vars.size() + _saved_registers.size() + 1) * 8;
+    if (!legacy)
+        reserved += in_regs * 8;
+    x64.sub(x64.rsp, reserved);
+    log_info("    sub rsp, %-4d             ; reserve space for lvars + __rsp__ space",
+             reserved);
+    _frame_size = reserved;
 
-    // we need to calculate the new rbp, which should start at the first argument
-    // it's important to note that __obj_ref__ is an implicit argument, and not in the argument list
-    // therefore
+    // create safety barier
+    if (legacy) {
+        x64.mov(x64.rax, 0x1337133713371337ULL);
+        x64.push(x64.rax);
+    }
 
-    // if main, no arguments, just the rip+rbp
-    if (name == "main") {
-        log.info("    lea rbp, [rsp + %3d]      ; new rbp = rsp - size(rip+rbp)", 1 * 8);
-        x64.lea(x64.rbp, x64.ptr[x64.rsp + 1 * 8]);
+    emit_saves();
+
+    // move arguments to where the allocator wants them
+    for (size_t i = 0; i < args.size(); i++) {
+        const string &s = args[i];
+
+        if (!legacy && i >= on_stack) {
+            Xbyak::Reg64 arg{arg_regs[i - on_stack]};
+            log_info("    mov %s, %s", in_register(s) ? reg_name(var_register(s)) : "[slot]", reg_name(arg));
+            if (in_register(s))
+                x64.mov(var_register(s), arg);
+            else
+                x64.mov(var_slot(s), arg);
+        } else if (in_register(s)) {
+            log_info("    mov %s, [rbp - %4d]", reg_name(var_register(s)),
+                     _local_variables[s]);
+            x64.mov(var_register(s), var_slot(s));
+        }
     }
-    // if method we should skip over rip+rbp+args+__obj_ref__
-    else {
-        log.info("    lea rbp, [rsp + %3d]      ; new rbp = rsp - size(rip+rbp+args)", (2+args.size()) * 8);
-        x64.lea(x64.rbp, x64.ptr[x64.rsp + (2 + args.size()) * 8]);
+
+    // with --counters every basic block counts its hits
+    string block = name;
+    size_t block_pc = 0;
+    u64 *counter = counters.enabled() ? emit_counter(block) : nullptr;
+
+    size_t next_line = 0;
+    for (_pc = 0; _pc < f.body.size(); _pc++) {
+        for (; next_line < f.lines.size() && f.lines[next_line].at <= _pc;
+             next_line++)
+            _lines.push_back({x64.getSize(), f.lines[next_line].file,
+                              f.lines[next_line].line});
+
+        // object reference pushes for fast calls vanish
+        const x64_instruction &ins = f.body[_pc];
+        if (ins.op != opcode::INVOKEVIRTUAL && _elided.count(_pc))
+            continue;
+
+        emit(ins);
+        if (!counter)
+            continue;
+
+        if (ins.op == opcode::INVALID) {
+            block = concat(name, "#", ins.arg), block_pc = _pc;
+            counter = emit_counter(block);
+        } else if (in(ins.op, {opcode::ICMPEQ, opcode::IFLT, opcode::IFEQ})) {
+            counters.executes(counter, ins.op);
+            counter = emit_counter(sprint("%s+%d", block, _pc + 1 - block_pc));
+        } else
+            counters.executes(counter, ins.op);
     }
 
-    // now we need to setup rsp, which means we need to reserve enough room for
-    // all the lvars
-    x64.sub(x64.rsp, (vars.size() + 1) * 8);
-    log.info("    sub rsp, %-4d             ; reserve space for lvars + __rsp__ space",
-             (vars.size() + 1) * 8);
+    // out of line slow paths, they jump back into the body when done
+    size_t cold = x64.getSize();
+    for (auto &slow_path : _slow_paths)
+        slow_path();
+    _slow_paths.clear();
+
+    for (auto &entry : _entries)
+        if (entry.first.first == name && !legacy)
+            emit_entry(f, entry.first.second, entry.second);
+
+    _symbols.push_back({name, start, x64.getSize() - start, args.size(),
+                        !legacy, cold, -_local_variables["__ret_addr__"],
+                        -_local_variables["__base_ptr__"], _labels, _lines});
+    if (perf_sink.enabled() || gdb_jit.enabled() || profiler.enabled())
+        announce(_symbols.back());
+
+    if (stats.enabled()) {
+        size_t labels = 0, fixups = 0;
+        for (const x64_instruction &ins : f.body) {
+            labels += ins.op == opcode::INVALID;
+            fixups += in(ins.op, {opcode::GOTO, opcode::ICMPEQ, opcode::IFLT,
+                                  opcode::IFEQ, opcode::INVOKEVIRTUAL});
+        }
+        stats.count("instructions", f.body.size() - labels);
+        stats.count("labels", labels);
+        stats.count("fixups", fixups);
+        stats.count("x64 bytes", x64.getSize() - start);
+    }
+}
 
-    // create safety barier
-    x64.mov(x64.rax, 0x1337133713371337ULL);
-    x64.push(x64.rax);
+/* the flags are dead at the start of a block, so inc can clobber them */
+u64 *X64Assembler::emit_counter(const string &block) {
+    u64 *counter = counters.block(fname, block);
+    log_info("    inc qword [%p]   ; %s", (void *)counter, block.c_str());
+    x64.inc(x64.qword[(size_t)counter]);
+    return counter;
+}
+
+/* the body is split up at its labels, so loops can be told apart */
+void X64Assembler::announce(const x64_symbol &s) {
+    const u8 *code = x64.getCode<const u8 *>();
+    x64_frame frame{code + s.offset, s.ret_at, s.rbp_at, s.fast};
+
+    vector<std::pair<string, size_t>> regions = {{s.name, s.offset}};
+    regions.insert(regions.end(), s.labels.begin(), s.labels.end());
+    regions.push_back({concat(s.name, ".cold"), s.cold});
+
+    for (size_t i = 0; i < regions.size(); i++) {
+        size_t at = regions[i].second;
+        size_t end = i + 1 < regions.size() ? regions[i + 1].second
+                                            : s.offset + s.size;
+        perf_sink.code(code + at, end - at, regions[i].first);
+        profiler.code(code + at, end - at, regions[i].first, frame);
+    }
+
+    gdb_jit.code(code + s.offset, s.size, s.name, s.lines, s.offset);
+}
+
+void X64Assembler::emit_saves() {
+    // the caller's locals may live in the registers we are about to use
+    for (int reg : _saved_registers) {
+        Xbyak::Reg64 r{reg};
+        string slot = sprint("__save_%s__", reg_name(r));
+        log_info("    mov [rbp - %4d], %s", _local_variables[slot], reg_name(r));
+        x64.mov(x64.ptr[x64.rbp - _local_variables[slot]], r);
+    }
+}
+
+/*
+ * Entry stubs follow the C ABI: rdi is the runtime, rsi the locals. They
+ * keep the registers C wants preserved and call the function like an ij
+ * caller would. At a label the stub builds the function's frame itself and
+ * jumps into the body, the function's IRETURN comes back to the stub.
+ */
+void X64Assembler::emit_entry(const x64_function &f, const string &label,
+                              Xbyak::Label &stub) {
+    static const vector<int> c_saved = {
+        Xbyak::Operand::RBP, Xbyak::Operand::RBX, Xbyak::Operand::R12,
+        Xbyak::Operand::R13, Xbyak::Operand::R14, Xbyak::Operand::R15};
+
+    size_t in_regs = std::min(f.args.size(), arg_regs.size());
+    size_t on_stack = f.args.size() - in_regs;
+    Xbyak::Label body;
+
+    log_info("%s entry %s:", f.name.c_str(), label.c_str());
+    x64.L(stub);
+    for (int reg : c_saved)
+        x64.push(Xbyak::Reg64{reg});
+
+    x64.mov(r_functions, x64.rdi);
+    x64.mov(x64.rax, x64.rsi);
+
+    for (size_t i = 0; i < on_stack; i++)
+        x64.push(x64.qword[x64.rax + 8 * i]);
+
+    if (label.empty()) {
+        for (size_t i = on_stack; i < f.args.size(); i++)
+            x64.mov(Xbyak::Reg64{arg_regs[i - on_stack]},
+                    x64.ptr[x64.rax + 8 * i]);
+        x64.call(f.name);
+    } else
+        x64.call(body);
+
+    if (on_stack)
+        x64.add(x64.rsp, 8 * on_stack);
+    for (size_t i = c_saved.size(); i-- > 0;)
+        x64.pop(Xbyak::Reg64{c_saved[i]});
+    x64.ret();
+
+    if (label.empty())
+        return;
+
+    // same frame as the prologue builds, with every local loaded
+    x64.L(body);
+    x64.push(x64.rbp);
+    x64.mov(x64.rbp, x64.rsp);
+    x64.sub(x64.rsp, _frame_size);
+    emit_saves();
+
+    vector<string> locals = f.args;
+    locals.insert(locals.end(), f.vars.begin(), f.vars.end());
+    for (size_t i = 0; i < locals.size(); i++) {
+        x64.mov(x64.rcx, x64.ptr[x64.rax + 8 * i]);
+        if (in_register(locals[i]))
+            x64.mov(var_register(locals[i]), x64.rcx);
+        else
+            x64.mov(var_slot(locals[i]), x64.rcx);
+    }
+
+    x64.jmp(concat(f.name, "#", label));
+}
+
+void X64Assembler::emit(const x64_instruction &ins) {
+    // clang-format off
+    switch (ins.op) {
+    case opcode::INVALID:       emit_label(ins.arg);          break;
+    case opcode::BIPUSH:        emit_BIPUSH(ins.value);       break;
+    case opcode::DUP:           emit_DUP();                   break;
+    case opcode::IADD:          emit_IADD();                  break;
+    case opcode::IAND:          emit_IAND();                  break;
+    case opcode::IOR:           emit_IOR();                   break;
+    case opcode::ISUB:          emit_ISUB();                  break;
+    case opcode::POP:           emit_POP();                   break;
+    case opcode::SWAP:          emit_SWAP();                  break;
+    case opcode::LDC_W:         emit_LDC_W(ins.arg);          break;
+    case opcode::ILOAD:         emit_ILOAD(ins.arg);          break;
+    case opcode::IINC:          emit_IINC(ins.arg, ins.value);break;
+    case opcode::ISTORE:        emit_ISTORE(ins.arg);         break;
+    case opcode::HALT:          emit_HALT();                  break;
+    case opcode::ERR:           emit_ERR();                   break;
+    case opcode::IN:            emit_IN();                    break;
+    case opcode::OUT:           emit_OUT();                   break;
+    case opcode::GOTO:          emit_GOTO(ins.arg);           break;
+    case opcode::ICMPEQ:        emit_ICMPEQ(ins.arg);         break;
+    case opcode::IFLT:          emit_IFLT(ins.arg);           break;
+    case opcode::IFEQ:          emit_IFEQ(ins.arg);           break;
+    case opcode::INVOKEVIRTUAL: emit_INVOKEVIRTUAL(ins.arg);  break;
+    case opcode::IRETURN:       emit_IRETURN();               break;
+    case opcode::NEWARRAY:      emit_NEWARRAY();              break;
+    case opcode::IALOAD:        emit_IALOAD();                break;
+    case opcode::IASTORE:       emit_IASTORE();               break;
+    case opcode::SHL:           emit_SHL();                   break;
+    case opcode::SHR:           emit_SHR();                   break;
+    case opcode::IMUL:          emit_IMUL();                  break;
+    case opcode::IDIV:          emit_IDIV();                  break;
+    case opcode::WIDE:          DUMP_INSTRUCTION(op_wide);    break;
+    case opcode::NOP:           DUMP_INSTRUCTION(op_nop);     break;
+    default:
+        throw std::runtime_error{
+            sprint("x64: can't generate opcode %x", (int)ins.op)};
+    }
+    // clang-format on
 }
 
-bool X64Assembler::is_var(string name) { return _local_variables.count(name); }
-void X64Assembler::BIPUSH(int8_t value) {
-    log.info("    push %-14d       ; BIPUSH %d", value, value);
+bool X64Assembler::in_register(const string &var) {
+    return _var_registers.count(var) != 0;
+}
+
+Xbyak::Reg64 X64Assembler::var_register(const string &var) {
+    return Xbyak::Reg64{_var_registers.at(var)};
+}
+
+Xbyak::Address X64Assembler::var_slot(const string &var) {
+    return x64.ptr[x64.rbp - _local_variables[var]];
+}
+
+void X64Assembler::emit_label(string name) {
+    log_info("");
+    // jumps to here arrive with an empty cache
+    tos_flush();
+
+    log_info("  %s#%s:", fname.c_str(), name.c_str());
+    x64.L(concat(fname, "#", name));
+    _labels.push_back({concat(fname, "#", name), x64.getSize()});
+}
+
+/*
+ * Top of stack cache
+ *
+ * The top (up to three) slots of the IJVM stack are kept in r8, r9 and r10
+ * rather than on the machine stack, _tos holds their register indices from
+ * bottom to top. Everything below them lives on the machine stack as before.
+ *
+ * The cache has to be written back (flushed) wherever code can be entered
+ * with a different cache state or leaves for code that expects the stack
+ * in memory: labels, jumps, function calls and external C calls.
+ */
+static const std::array<int, 3> tos_regs = {
+    {Xbyak::Operand::R8, Xbyak::Operand::R9, Xbyak::Operand::R10}};
+static const size_t tos_slots = tos_regs.size();
+
+Xbyak::Reg64 X64Assembler::tos_alloc() {
+    // spill the bottom slot if all registers are taken
+    if (_tos.size() == tos_slots) {
+        log_info("    push %-20s ; spill", reg_name(Xbyak::Reg64{_tos.front()}));
+        x64.push(Xbyak::Reg64{_tos.front()});
+        _tos.erase(_tos.begin());
+    }
+
+    for (int idx : tos_regs)
+        if (!contains(_tos, idx)) {
+            _tos.push_back(idx);
+            return Xbyak::Reg64{idx};
+        }
+
+    throw std::runtime_error{"top of stack cache has no free register"};
+}
+
+Xbyak::Reg64 X64Assembler::tos_pop(const Xbyak::Reg64 &fallback) {
+    if (_tos.empty()) {
+        log_info("    pop %-21s ; fill", reg_name(fallback));
+        x64.pop(fallback);
+        return fallback;
+    }
+
+    Xbyak::Reg64 top{_tos.back()};
+    _tos.pop_back();
+    return top;
+}
+
+void X64Assembler::tos_push(const Xbyak::Reg64 &reg) {
+    // a popped cache register can simply become the new top again
+    if (contains(tos_regs, reg.getIdx()) && !contains(_tos, reg.getIdx())) {
+        _tos.push_back(reg.getIdx());
+        return;
+    }
+
+    Xbyak::Reg64 slot = tos_alloc();
+    if (slot.getIdx() != reg.getIdx())
+        x64.mov(slot, reg);
+}
+
+void X64Assembler::tos_flush() {
+    for (int idx : _tos) {
+        log_info("    push %-20s ; flush", reg_name(Xbyak::Reg64{idx}));
+        x64.push(Xbyak::Reg64{idx});
+    }
+
+    _tos.clear();
+}
+
+void X64Assembler::emit_BIPUSH(i8 value) {
     DUMP_INSTRUCTION(op_bipush);
 
-    x64.push(value);
+    Xbyak::Reg64 r = tos_alloc();
+    log_info("    mov %s, %-16d ; BIPUSH %d", reg_name(r), value, value);
+    x64.mov(r, value);
 }
 
-void X64Assembler::LDC_W(string constant) {
-    log.info("    push %-14d       ; LDC_W %s", constant_map[constant],
-             constant.c_str());
+void X64Assembler::emit_LDC_W(string constant) {
     DUMP_INSTRUCTION(op_ldc_w);
 
-    x64.push(constant_map[constant]);
-
+    Xbyak::Reg64 r = tos_alloc();
+    log_info("    mov %s, %-16d ; LDC_W %s", reg_name(r), constant_map[constant],
+             constant.c_str());
+    x64.mov(r, constant_map[constant]);
 }
 
-void X64Assembler::DUP() {
-    log.info("    mov rax, [rsp]      ; DUP");
-    log.info("    push rax");
+void X64Assembler::emit_DUP() {
     DUMP_INSTRUCTION(op_dup);
+    log_info("                              ; DUP");
 
-    x64.mov(x64.rax, x64.ptr[x64.rsp]);
-    x64.push(x64.rax);
+    Xbyak::Reg64 r = tos_pop(x64.rax);
+    tos_push(r);
+    tos_push(r);
 }
 
-void X64Assembler::IAND() {
-    log.info("    pop rax             ; IAND");
-    log.info("    and [rsp], rax");
+void X64Assembler::emit_IAND() {
     DUMP_INSTRUCTION(op_iand);
 
-    x64.pop(x64.rax);
-    x64.and_(x64.ptr[x64.rsp], x64.rax);
+    Xbyak::Reg64 b = tos_pop(x64.rax);
+    Xbyak::Reg64 a = tos_pop(x64.rcx);
+    log_info("    and %s, %-16s ; IAND", reg_name(a), reg_name(b));
+    x64.and_(a, b);
+    tos_push(a);
 }
 
-void X64Assembler::IOR() {
-    log.info("    pop rax             ; IOR");
-    log.info("    or [rsp], rax");
+void X64Assembler::emit_IOR() {
     DUMP_INSTRUCTION(op_ior);
 
-    x64.pop(x64.rax);
-    x64.or_(x64.ptr[x64.rsp], x64.rax);
+    Xbyak::Reg64 b = tos_pop(x64.rax);
+    Xbyak::Reg64 a = tos_pop(x64.rcx);
+    log_info("    or %s, %-17s ; IOR", reg_name(a), reg_name(b));
+    x64.or_(a, b);
+    tos_push(a);
 }
 
-void X64Assembler::IADD() {
-    log.info("    pop rax             ; IADD");
+void X64Assembler::emit_IADD() {
     DUMP_INSTRUCTION(op_iadd);
 
-    x64.pop(x64.rax);
-    x64.pop(x64.rcx);
-    x64.add(x64.ecx, x64.eax);
-    x64.movsxd(x64.rax, x64.ecx);
-    x64.push(x64.rax);
+    // 32 bit addition, sign extended back to 64 bits
+    Xbyak::Reg64 b = tos_pop(x64.rax);
+    Xbyak::Reg64 a = tos_pop(x64.rcx);
+    log_info("    add %s, %-16s ; IADD", reg_name(a), reg_name(b));
+    x64.add(a.cvt32(), b.cvt32());
+    x64.movsxd(a, a.cvt32());
+    tos_push(a);
 }
 
-void X64Assembler::ISUB() {
-    log.info("    pop rax                   ; ISUB");
-    log.info("    sub [rsp], rax");
+void X64Assembler::emit_ISUB() {
     DUMP_INSTRUCTION(op_isub);
 
-    x64.pop(x64.rax);
-    x64.pop(x64.rcx);
-    x64.sub(x64.ecx, x64.eax);
-    x64.movsxd(x64.rax, x64.ecx);
-    x64.push(x64.rax);
+    Xbyak::Reg64 b = tos_pop(x64.rax);
+    Xbyak::Reg64 a = tos_pop(x64.rcx);
+    log_info("    sub %s, %-16s ; ISUB", reg_name(a), reg_name(b));
+    x64.sub(a.cvt32(), b.cvt32());
+    x64.movsxd(a, a.cvt32());
+    tos_push(a);
 }
 
-void X64Assembler::POP() {
-    log.info("    pop rax                   ; POP");
+void X64Assembler::emit_POP() {
     DUMP_INSTRUCTION(op_pop);
+    log_info("                              ; POP");
 
-    x64.pop(x64.rax);
+    tos_pop(x64.rax);
 }
 
-void X64Assembler::SWAP() {
-    log.info("    pop rax                   ; SWAP");
-    log.info("    pop rcx");
-    log.info("    push rax");
-    log.info("    push rcx");
+void X64Assembler::emit_SWAP() {
     DUMP_INSTRUCTION(op_swap);
+    log_info("                              ; SWAP");
 
-    x64.pop(x64.rax);
-    x64.pop(x64.rcx);
-    x64.push(x64.rax);
-    x64.push(x64.rcx);
+    Xbyak::Reg64 a = tos_pop(x64.rax);
+    Xbyak::Reg64 b = tos_pop(x64.rcx);
+    tos_push(a);
+    tos_push(b);
 }
 
-void X64Assembler::ILOAD(string var) {
-    log.info("    mov rax, [rbp - %4d]      ; ILOAD %s", _local_variables[var],
-             var.c_str());
-    log.info("    push rax");
+void X64Assembler::emit_ILOAD(string var) {
     DUMP_INSTRUCTION(op_iload);
 
-    x64.mov(x64.rax, x64.ptr[x64.rbp - _local_variables[var]]);
-    x64.push(x64.rax);
+    Xbyak::Reg64 r = tos_alloc();
+    if (in_register(var)) {
+        log_info("    mov %s, %-16s ; ILOAD %s", reg_name(r),
+                 reg_name(var_register(var)), var.c_str());
+        x64.mov(r, var_register(var));
+        return;
+    }
+
+    log_info("    mov %s, [rbp - %4d]       ; ILOAD %s", reg_name(r),
+             _local_variables[var], var.c_str());
+    x64.mov(r, var_slot(var));
 }
-void X64Assembler::ISTORE(string var) {
-    log.info("    pop rax                   ; ISTORE %s", var.c_str());
-    log.info("    mov [rbp - %4d] rax", _local_variables[var]);
+
+void X64Assembler::emit_ISTORE(string var) {
     DUMP_INSTRUCTION(op_istore);
 
-    x64.pop(x64.rax);
-    x64.mov(x64.ptr[x64.rbp - _local_variables[var]], x64.rax);
+    Xbyak::Reg64 r = tos_pop(x64.rax);
+    if (in_register(var)) {
+        log_info("    mov %s, %-16s ; ISTORE %s", reg_name(var_register(var)),
+                 reg_name(r), var.c_str());
+        x64.mov(var_register(var), r);
+        return;
+    }
+
+    log_info("    mov [rbp - %4d], %-8s ; ISTORE %s", _local_variables[var],
+             reg_name(r), var.c_str());
+    x64.mov(var_slot(var), r);
 }
 
-void X64Assembler::IINC(string var, int8_t value) {
-    log.info("    add qword [rbp - %4d], %-2d; IINC %s %d",
-             _local_variables[var], value, var.c_str(), value);
+void X64Assembler::emit_IINC(string var, i8 value) {
     DUMP_INSTRUCTION(op_iinc);
 
-    x64.add(x64.qword[x64.rbp - _local_variables[var]], value);
-}
+    if (in_register(var)) {
+        log_info("    add %s, %-16d ; IINC %s %d", reg_name(var_register(var)),
+                 value, var.c_str(), value);
+        x64.add(var_register(var), value);
+        return;
+    }
 
-void X64Assembler::WIDE() {
-    DUMP_INSTRUCTION(op_wide);
+    log_info("    add qword [rbp - %4d], %-2d; IINC %s %d",
+             _local_variables[var], value, var.c_str(), value);
+    x64.add(x64.qword[x64.rbp - _local_variables[var]], value);
 }
 
-void X64Assembler::HALT() {
-    log.info("    mov rax, halt          ; HALT");
-    log.info("    call halt");
+void X64Assembler::emit_HALT() {
+    log_info("    mov rax, halt          ; HALT");
+    log_info("    call halt");
     DUMP_INSTRUCTION(op_halt);
 
+    // the program ends here, cached slots are never needed again
+    _tos.clear();
+
+    // halt(runtime) flushes the output buffer
     x64.and_(x64.rsp, ~0xf);
+    x64.mov(x64.rdi, r_functions);
     x64.mov(x64.rax, x64.ptr[r_functions + r_function_halt]);
     external_c_call();
 }
 
-void X64Assembler::ERR() {
-    log.info("    mov rax, error         ; ERR");
-    log.info("    call error");
+void X64Assembler::emit_ERR() {
+    log_info("    mov rax, error         ; ERR");
+    log_info("    call error");
     DUMP_INSTRUCTION(op_err);
 
+    x64.mov(x64.rdi, r_functions);
     x64.mov(x64.rax, x64.ptr[r_functions + r_function_error]);
     external_c_call();
 }
 
-void X64Assembler::IN() {
-    log.info("    mov rax, getchar          ; IN");
-    log.info("    call getchar");
-    log.info("    push rax");
+void X64Assembler::emit_IN() {
     DUMP_INSTRUCTION(op_in);
 
-    x64.mov(x64.rax, x64.ptr[r_functions + r_function_getchar]);
-    external_c_call();
-    x64.push(x64.rax);
+    Xbyak::Label slow, done;
+
+    // reads come out of the runtime's input buffer, only refills call out
+    log_info("    mov rax, [r14 + in_cur]   ; IN");
+    log_info("    cmp rax, [r14 + in_end]");
+    log_info("    jae .slow");
+    log_info("    movzx eax, byte [rax]");
+    log_info("    inc qword [r14 + in_cur]");
+
+    x64.mov(x64.rax, x64.ptr[r_functions + r_in_cur]);
+    x64.cmp(x64.rax, x64.ptr[r_functions + r_in_end]);
+    x64.jae(slow);
+    x64.movzx(x64.eax, x64.byte[x64.rax]);
+    x64.inc(x64.qword[r_functions + r_in_cur]);
+    x64.L(done);
+
+    // in(runtime) refills the buffer and returns the first char, 0 on EOF
+    vector<int> live = _tos;
+    _slow_paths.push_back([this, slow, done, live]() mutable {
+        x64.L(slow);
+        x64.mov(x64.rdi, r_functions);
+        x64.mov(x64.rax, x64.ptr[r_functions + r_function_in]);
+        external_c_call(live);
+        x64.jmp(done);
+    });
+
+    tos_push(x64.rax);
 }
 
-void X64Assembler::OUT() {
-    log.info("    pop rdi                   ; OUT");
-    log.info("    mov rax, putchar");
-    log.info("    call putchar");
+void X64Assembler::emit_OUT() {
     DUMP_INSTRUCTION(op_out);
 
-    x64.pop(x64.rdi);
-    x64.mov(x64.rax, x64.ptr[r_functions + r_function_putchar]);
-    external_c_call();
+    Xbyak::Reg64 r = tos_pop(x64.rdi);
+    Xbyak::Label slow, done;
+
+    // writes go to the runtime's output buffer, only flushes call out
+    log_info("    mov rax, [r14 + out_cur]  ; OUT");
+    log_info("    cmp rax, [r14 + out_end]");
+    log_info("    jae .slow");
+    log_info("    mov [rax], %s", reg_name(r));
+    log_info("    inc rax");
+    log_info("    mov [r14 + out_cur], rax");
+
+    x64.mov(x64.rax, x64.ptr[r_functions + r_out_cur]);
+    x64.cmp(x64.rax, x64.ptr[r_functions + r_out_end]);
+    x64.jae(slow);
+    x64.mov(x64.byte[x64.rax], r.cvt8());
+    x64.inc(x64.rax);
+    x64.mov(x64.ptr[r_functions + r_out_cur], x64.rax);
+    x64.L(done);
+
+    // out(char, runtime) flushes the buffer and stores the char
+    vector<int> live = _tos;
+    _slow_paths.push_back([this, r, slow, done, live]() mutable {
+        x64.L(slow);
+        if (r.getIdx() != x64.rdi.getIdx())
+            x64.mov(x64.rdi, r);
+        x64.mov(x64.rsi, r_functions);
+        x64.mov(x64.rax, x64.ptr[r_functions + r_function_out]);
+        external_c_call(live);
+        x64.jmp(done);
+    });
 }
 
-void X64Assembler::NOP() {
-    DUMP_INSTRUCTION(op_nop);
-}
-
-void X64Assembler::GOTO(string label) {
-    log.info("    jmp .%-20s ; GOTO %s", label.c_str(), label.c_str());
+void X64Assembler::emit_GOTO(string label) {
     DUMP_INSTRUCTION(op_goto);
 
+    tos_flush();
+    log_info("    jmp .%-20s ; GOTO %s", label.c_str(), label.c_str());
     x64.jmp(concat(fname, "#", label));
 }
 
-void X64Assembler::ICMPEQ(string label) {
-    log.info("    pop rax                   ; ICMPEQ %s", label.c_str());
-    log.info("    pop rcx");
-    log.info("    cmp rax, rcx");
-    log.info("    je  .%s", label.c_str());
-
+void X64Assembler::emit_ICMPEQ(string label) {
     DUMP_INSTRUCTION(op_icmpeq);
 
-    x64.pop(x64.rax);
-    x64.pop(x64.rcx);
-    x64.cmp(x64.rax, x64.rcx);
+    Xbyak::Reg64 a = tos_pop(x64.rax);
+    Xbyak::Reg64 b = tos_pop(x64.rcx);
+    tos_flush();
+
+    log_info("    cmp %s, %-16s ; ICMPEQ %s", reg_name(a), reg_name(b),
+             label.c_str());
+    log_info("    je  .%s", label.c_str());
+    x64.cmp(a, b);
     x64.je(concat(fname, "#", label));
 }
-void X64Assembler::IFLT(string label) {
-    log.info("    pop rax                   ; IFLT %s", label.c_str());
-    log.info("    cmp rax, 0");
-    log.info("    jl .%s", label.c_str());
 
+void X64Assembler::emit_IFLT(string label) {
     DUMP_INSTRUCTION(op_iflt);
 
-    x64.pop(x64.rax);
-    x64.cmp(x64.rax, 0);
+    Xbyak::Reg64 r = tos_pop(x64.rax);
+    tos_flush();
+
+    log_info("    cmp %s, 0                ; IFLT %s", reg_name(r),
+             label.c_str());
+    log_info("    jl .%s", label.c_str());
+    x64.cmp(r, 0);
     x64.jl(concat(fname, "#", label));
 }
-void X64Assembler::IFEQ(string label) {
-    log.info("    pop rax                   ; IFEQ %s", label.c_str());
-    log.info("    test rax, rax");
-    log.info("    jz .%s", label.c_str());
 
+void X64Assembler::emit_IFEQ(string label) {
     DUMP_INSTRUCTION(op_ifeq);
 
-    x64.pop(x64.rax);
-    x64.cmp(x64.rax, 0);
+    Xbyak::Reg64 r = tos_pop(x64.rax);
+    tos_flush();
+
+    log_info("    test %s, %-15s ; IFEQ %s", reg_name(r), reg_name(r),
+             label.c_str());
+    log_info("    jz .%s", label.c_str());
+    x64.test(r, r);
     x64.je(concat(fname, "#", label));
 }
 
-void X64Assembler::INVOKEVIRTUAL(string func_name) {
-    log.info("    call %20s ; INVOKEVIRTUAL %s", func_name.c_str(),
-             func_name.c_str());
-    log.info("    push rax");
-
+void X64Assembler::emit_INVOKEVIRTUAL(string func_name) {
     DUMP_INSTRUCTION(op_invokevirtual);
+
+    if (!_fn_argc.count(func_name))
+        throw std::runtime_error{"x64: call to unknown function " + func_name};
+
+    // the callee finds __obj_ref__ and its arguments relative to its rbp
+    if (_legacy_frames.count(func_name)) {
+        tos_flush();
+
+        log_info("    call %20s ; INVOKEVIRTUAL %s", func_name.c_str(),
+                 func_name.c_str());
+        x64.call(func_name);
+        return;
+    }
+
+    size_t argc = _fn_argc.at(func_name);
+    size_t in_regs = std::min(argc, arg_regs.size());
+
+    for (size_t i = in_regs; i-- > 0;) {
+        Xbyak::Reg64 arg{arg_regs[i]};
+        Xbyak::Reg64 r = tos_pop(arg);
+        log_info("    mov %s, %-16s ; arg %d", reg_name(arg), reg_name(r),
+                 argc - in_regs + i);
+        if (r.getIdx() != arg.getIdx())
+            x64.mov(arg, r);
+    }
+
+    // leftover arguments are read from the caller's stack
+    tos_flush();
+
+    log_info("    call %20s ; INVOKEVIRTUAL %s", func_name.c_str(),
+             func_name.c_str());
     x64.call(func_name);
-}
 
-void X64Assembler::IRETURN() {
-    log.info("    pop rax                   ; IRETURN");
-    log.info("    mov rcx, [rbp - %3d]", _local_variables["__ret_addr__"]);
-    log.info("    mov rsp, rbp");
-    log.info("    mov rbp, [rbp - %3d]", _local_variables["__base_ptr__"]);
-    log.info("    jmp rcx");
+    // drop stack arguments and the object reference, if it was pushed
+    size_t drop = argc - in_regs + (_elided.count(_pc) ? 0 : 1);
+    if (drop) {
+        log_info("    add rsp, %d", drop * 8);
+        x64.add(x64.rsp, drop * 8);
+    }
 
+    tos_push(x64.rax);
+}
+
+void X64Assembler::emit_IRETURN() {
     DUMP_INSTRUCTION(op_ireturn);
 
-    // pop return value off stack
-    x64.pop(x64.rax);
+    // pop return value off stack, whatever else is cached dies with the frame
+    Xbyak::Reg64 r = tos_pop(x64.rax);
+    _tos.clear();
+
+    if (r.getIdx() != x64.rax.getIdx())
+        x64.mov(x64.rax, r);
+
+    // hand the caller its registers back
+    for (int reg : _saved_registers) {
+        Xbyak::Reg64 saved{reg};
+        string slot = sprint("__save_%s__", reg_name(saved));
+        x64.mov(saved, x64.ptr[x64.rbp - _local_variables[slot]]);
+    }
+
+    if (!_legacy_frames.count(fname)) {
+        log_info("    mov rax, %-16s ; IRETURN", reg_name(r));
+        log_info("    mov rsp, rbp");
+        log_info("    pop rbp");
+        log_info("    ret");
+
+        x64.mov(x64.rsp, x64.rbp);
+        x64.pop(x64.rbp);
+        x64.ret();
+        return;
+    }
+
+    log_info("    mov rax, %-16s ; IRETURN", reg_name(r));
+    log_info("    mov rcx, [rbp - %3d]", _local_variables["__ret_addr__"]);
+    log_info("    mov rsp, rbp");
+    log_info("    mov rbp, [rbp - %3d]", _local_variables["__base_ptr__"]);
+    log_info("    jmp rcx");
 
     // load previous rip in rcx
     x64.mov(x64.rcx, x64.ptr[x64.rbp - _local_variables["__ret_addr__"]]);
@@ -533,53 +1375,68 @@ void X64Assembler::IRETURN() {
     x64.jmp(x64.rcx);
 }
 
-void X64Assembler::NEWARRAY() {
-    log.info("    pop rdi                   ; NEWARRAY, newarray(tos())");
-    // log.info("    mov rsi, 8");
-    log.info("    mov rax, newarray");
-    log.info("    call rax");
-    log.info("    push rax");
-
+void X64Assembler::emit_NEWARRAY() {
     DUMP_INSTRUCTION(op_newarray);
 
-
-    x64.pop(x64.rdi);
-    x64.mov(x64.rax, x64.ptr[r_functions + r_function_newarray]);
-    external_c_call();
-    x64.push(x64.rax);
+    Xbyak::Reg64 size = tos_pop(x64.rdi);
+    Xbyak::Label slow, done;
+
+    // arrays are carved out of the current heap chunk, which comes zeroed.
+    // The unsigned compare sends negative sizes down the slow path too.
+    log_info("    cmp %s, %-16d ; NEWARRAY", reg_name(size), x64_heap_bump_max);
+    log_info("    ja .slow");
+    log_info("    mov rax, [r14 + heap_cur]");
+    log_info("    lea rdx, [rax + %s * 8]", reg_name(size));
+    log_info("    cmp rdx, [r14 + heap_end]");
+    log_info("    ja .slow");
+    log_info("    mov [r14 + heap_cur], rdx");
+
+    x64.cmp(size, x64_heap_bump_max);
+    x64.ja(slow);
+    x64.mov(x64.rax, x64.ptr[r_functions + r_heap_cur]);
+    x64.lea(x64.rdx, x64.ptr[x64.rax + size * 8]);
+    x64.cmp(x64.rdx, x64.ptr[r_functions + r_heap_end]);
+    x64.ja(slow);
+    x64.mov(x64.ptr[r_functions + r_heap_cur], x64.rdx);
+    x64.L(done);
+
+    // refill or large array, newarray(size, runtime)
+    vector<int> live = _tos;
+    _slow_paths.push_back([this, size, slow, done, live]() mutable {
+        x64.L(slow);
+        if (size.getIdx() != x64.rdi.getIdx())
+            x64.mov(x64.rdi, size);
+        x64.mov(x64.rsi, r_functions);
+        x64.mov(x64.rax, x64.ptr[r_functions + r_function_newarray]);
+        external_c_call(live);
+        x64.jmp(done);
+    });
+
+    tos_push(x64.rax);
 }
 
-void X64Assembler::IALOAD() {
-    log.info("    pop rdi                   ; IALOAD");
-    log.info("    pop rsi");
-    log.info("    mov rax, iaload");
-    log.info("    call rax");
-    log.info("    push rax");
-
+void X64Assembler::emit_IALOAD() {
     DUMP_INSTRUCTION(op_iaload);
 
-    x64.pop(x64.rdi);
-    x64.pop(x64.rsi);
-    x64.mov(x64.rax, x64.ptr[r_functions + r_function_iaload]);
-    external_c_call();
-    x64.push(x64.rax);
-}
+    Xbyak::Reg64 arr = tos_pop(x64.rax);
+    Xbyak::Reg64 idx = tos_pop(x64.rcx);
+    log_info("    mov %s, [%s + %s * 8]    ; IALOAD", reg_name(idx),
+             reg_name(arr), reg_name(idx));
 
-void X64Assembler::IASTORE() {
-    log.info("    pop rdi                   ; IASTORE");
-    log.info("    pop rsi");
-    log.info("    pop rdx");
-    log.info("    mov rax, iastore");
-    log.info("    call rax");
-    log.info("    push rax");
+    x64.mov(idx, x64.ptr[arr + idx * 8]);
+    tos_push(idx);
+}
 
+void X64Assembler::emit_IASTORE() {
     DUMP_INSTRUCTION(op_iastore);
 
-    x64.pop(x64.rdi);
-    x64.pop(x64.rsi);
-    x64.pop(x64.rdx);
-    x64.mov(x64.rax, x64.ptr[r_functions + r_function_iastore]);
-    external_c_call();
+    Xbyak::Reg64 arr = tos_pop(x64.rax);
+    Xbyak::Reg64 idx = tos_pop(x64.rcx);
+    Xbyak::Reg64 val = tos_pop(x64.rdx);
+    log_info("    mov [%s + %s * 8], %s    ; IASTORE", reg_name(arr),
+             reg_name(idx), reg_name(val));
+
+    x64.mov(x64.ptr[arr + idx * 8], val);
 }
 
 void X64Assembler::GC() { throw std::runtime_error{"Not implemented: GC"}; }
@@ -600,48 +1457,81 @@ void X64Assembler::NETCLOSE() {
     throw std::runtime_error{"Not implemented: NETCLOSE"};
 }
 
-void X64Assembler::SHL() {
-    log.info("    pop rdi                   ; SHL");
-    log.info("    shl rdi, 1");
-    log.info("    push rdi");
+void X64Assembler::emit_SHL() {
+    Xbyak::Reg64 r = tos_pop(x64.rax);
+    log_info("    shl %s, 1                 ; SHL", reg_name(r));
 
-    x64.pop(x64.rdi);
-    x64.shl(x64.rdi, 1);
-    x64.push(x64.rdi);
+    x64.shl(r, 1);
+    tos_push(r);
 }
 
-void X64Assembler::SHR() {
-    log.info("    pop rdi                   ; SHL");
-    log.info("    shr rdi, 1");
-    log.info("    push rdi");
+void X64Assembler::emit_SHR() {
+    Xbyak::Reg64 r = tos_pop(x64.rax);
+    log_info("    shr %s, 1                 ; SHR", reg_name(r));
 
-    x64.pop(x64.rdi);
-    x64.shr(x64.rdi, 1);
-    x64.push(x64.rdi);
+    x64.shr(r, 1);
+    tos_push(r);
 }
 
-void X64Assembler::IDIV() {
-    log.info("    pop rdi                   ; IDIV");
-    log.info("    xor rdx, rdx");
-    log.info("    pop rax");
-    log.info("    idiv rdi");
-    log.info("    push rax");
+void X64Assembler::emit_IDIV() {
+    // idiv needs the dividend in rdx:rax, neither is ever a cache register
+    Xbyak::Reg64 b = tos_pop(x64.rcx);
+    Xbyak::Reg64 a = tos_pop(x64.rax);
+    log_info("    mov rax, %-16s ; IDIV", reg_name(a));
+    log_info("    xor rdx, rdx");
+    log_info("    idiv %s", reg_name(b));
 
-    x64.pop(x64.rdi);
+    if (a.getIdx() != x64.rax.getIdx())
+        x64.mov(x64.rax, a);
     x64.xor_(x64.rdx, x64.rdx);
-    x64.pop(x64.rax);
-    x64.idiv(x64.rdi);
-    x64.push(x64.rax);
-}
-
-void X64Assembler::IMUL() {
-    log.info("    pop rdi                   ; IMUL");
-    log.info("    pop rax");
-    log.info("    imul rax, rdi");
-    log.info("    push rax");
-
-    x64.pop(x64.rdi);
-    x64.pop(x64.rax);
-    x64.imul(x64.rax, x64.rdi);
-    x64.push(x64.rax);
-}
\ No newline at end of file
+    x64.idiv(b);
+    tos_push(x64.rax);
+}
+
+void X64Assembler::emit_IMUL() {
+    Xbyak::Reg64 b = tos_pop(x64.rcx);
+    Xbyak::Reg64 a = tos_pop(x64.rax);
+    log_info("    imul %s, %-15s ; IMUL", reg_name(a), reg_name(b));
+
+    x64.imul(a, b);
+    tos_push(a);
+}
+
+/*
+ * Recording, the instructions are only generated once the program is complete
+ */
+void X64Assembler::BIPUSH(int8_t value) { record(opcode::BIPUSH, "", value); }
+void X64Assembler::DUP() { record(opcode::DUP); }
+void X64Assembler::IADD() { record(opcode::IADD); }
+void X64Assembler::IAND() { record(opcode::IAND); }
+void X64Assembler::IOR() { record(opcode::IOR); }
+void X64Assembler::ISUB() { record(opcode::ISUB); }
+void X64Assembler::POP() { record(opcode::POP); }
+void X64Assembler::SWAP() { record(opcode::SWAP); }
+void X64Assembler::LDC_W(string constant) { record(opcode::LDC_W, constant); }
+void X64Assembler::ILOAD(string var) { record(opcode::ILOAD, var); }
+void X64Assembler::IINC(string var, int8_t value) {
+    record(opcode::IINC, var, value);
+}
+void X64Assembler::ISTORE(string var) { record(opcode::ISTORE, var); }
+void X64Assembler::WIDE() { record(opcode::WIDE); }
+void X64Assembler::HALT() { record(opcode::HALT); }
+void X64Assembler::ERR() { record(opcode::ERR); }
+void X64Assembler::IN() { record(opcode::IN); }
+void X64Assembler::OUT() { record(opcode::OUT); }
+void X64Assembler::NOP() { record(opcode::NOP); }
+void X64Assembler::GOTO(string label) { record(opcode::GOTO, label); }
+void X64Assembler::ICMPEQ(string label) { record(opcode::ICMPEQ, label); }
+void X64Assembler::IFLT(string label) { record(opcode::IFLT, label); }
+void X64Assembler::IFEQ(string label) { record(opcode::IFEQ, label); }
+void X64Assembler::INVOKEVIRTUAL(string func_name) {
+    record(opcode::INVOKEVIRTUAL, func_name);
+}
+void X64Assembler::IRETURN() { record(opcode::IRETURN); }
+void X64Assembler::NEWARRAY() { record(opcode::NEWARRAY); }
+void X64Assembler::IALOAD() { record(opcode::IALOAD); }
+void X64Assembler::IASTORE() { record(opcode::IASTORE); }
+void X64Assembler::SHL() { record(opcode::SHL); }
+void X64Assembler::SHR() { record(opcode::SHR); }
+void X64Assembler::IMUL() { record(opcode::IMUL); }
+void X64Assembler::IDIV() { record(opcode::IDIV); }
@@ -1,6 +1,31 @@
+#ifndef BACKENDS_X64_ASSEMBLER_HPP
+#define BACKENDS_X64_ASSEMBLER_HPP
+#include <functional>
 #include "assembler.hpp"
+#include "x64_regalloc.hpp"
 #include <xbyak/xbyak.h>
 /*
+ * ij functions call each other with a register based convention: the last
+ * (up to) four arguments go in rdi, rsi, rdx and rcx, any others stay on the
+ * stack, the result is returned in rax, and call/ret pair up. The object
+ * reference is not pushed unless it can't be proven unused.
+ *
+ * BIPUSH 1
+ * BIPUSH 2
+ * INVOKEVIRTUAL x (2 args)
+ *
+ *        +--------------+
+ *        |   RETADDR    |
+ *        +--------------+
+ * RBP -> |   OLD_RBP    |     rdi = 1, rsi = 2
+ *        +--------------+
+ *        |   __rsp__    |
+ *        +--------------+
+ *        | args, lvars  |
+ *        +--------------+
+ *
+ * Functions that read __obj_ref__ (JAS) keep the IJVM like frame instead:
+ *
  * BIPUSH 1
  * LDC_W  __OBJ_REF
  * BIPUSH 3
@@ -23,6 +48,29 @@
  *        +--------------+
  */
 
+struct x64_runtime;
+
+/*
+ * Entry point callable from C++. At the start of a function it takes the
+ * arguments, at a label the arguments followed by the vars (the operand stack
+ * has to be empty there). Returns once the function returns.
+ */
+typedef i64 (*x64_entry)(x64_runtime *rt, const i64 *locals);
+
+/* where a function ended up in the generated code */
+struct x64_symbol {
+    string name;
+    size_t offset; /* of the body, relative to the start of the code */
+    size_t size;
+    size_t argc;
+    bool fast; /* follows the register based convention */
+    size_t cold; /* offset of the out of line code, slow paths and entries */
+    int ret_at;  /* where the frame keeps the caller's rip, relative to rbp */
+    int rbp_at;  /* and the caller's rbp */
+    vector<std::pair<string, size_t>> labels; /* fname#label -> offset */
+    vector<x64_line> lines;                   /* at is a code offset */
+};
+
 class X64Assembler : public Assembler {
   public:
     X64Assembler();
@@ -32,12 +80,21 @@ class X64Assembler : public Assembler {
     virtual void compile(ostream &o); /* writes binary to ostream */
     virtual void label(string name);  /* adds label before next instruction */
     void run();                       /* run the code, does not return */
+    int run_once(x64_runtime &rt);    /* runs to HALT (0) or ERR (1) */
+    void load(const string &code);    /* takes code compile() wrote earlier */
 
     /* ends previous function and adds new function */
     virtual void function(string name, vector<string> args,
                           vector<string> vars);
+    void function(const x64_function &f); /* adds an already recorded one */
+
+    /* entry points, requested before and looked up after generating code */
+    void add_entry(string fn, string label = "");
+    x64_entry entry(string fn, string label = ""); /* nullptr if impossible */
+    void ready_lazily(x64_runtime &rt); /* functions on their first call */
     virtual bool is_var(string name); /* returns whether there is a variable in
                                          the current context (local and args) */
+    virtual void line(const string &file, size_t line);
 
     /* Note, WIDE is done automatically for vars */
     virtual void BIPUSH(int8_t value);
@@ -92,6 +149,12 @@ class X64Assembler : public Assembler {
     virtual void SHR();
     virtual void IMUL();
     virtual void IDIV();
+
+  protected:
+    /* generates all code, for backends that package it up themselves */
+    const u8 *generated(size_t &size);
+    const vector<x64_symbol> &symbols() const { return _symbols; }
+
   private:
   #ifdef DEBUG
     void debug_call(u8 op);
@@ -99,13 +162,94 @@ class X64Assembler : public Assembler {
     #define debug_call
   #endif
     void external_c_call(); /* inserts necessary bs for C call */
+    void external_c_call(const vector<int> &live); /* keeps live registers */
+
+    /* recording, code is generated once all functions are known */
+    void record(opcode op, string arg = "", i64 value = 0);
+    void generate();                         /* generates all functions */
+    void generate(const x64_function &f);    /* generates a single function */
+    void emit(const x64_instruction &ins);   /* generates a single instruction */
+    void emit_saves(); /* stores the callee saved registers in their slots */
+    void announce(const x64_symbol &s); /* names the code for the tools */
+    u64 *emit_counter(const string &block); /* counts the block's hits */
+    void emit_stub(size_t index); /* compiles the function on its first call */
+    static void *compile_lazily(X64Assembler *self, i64 index);
+    void *generate_lazily(size_t index); /* a stub's function, patches it */
+    void emit_entry(const x64_function &f, const string &label,
+                    Xbyak::Label &stub);
+
+    /* calling convention */
+    bool inspects_frame(const x64_function &f); /* needs the IJVM frame */
+    void elide_objrefs(const x64_function &f);  /* finds unneeded objrefs */
+
+    /* locals live in a register or in their frame slot */
+    bool in_register(const string &var);
+    Xbyak::Reg64 var_register(const string &var);
+    Xbyak::Address var_slot(const string &var);
+
+    /* top of stack cache, keeps the top stack slots in registers */
+    Xbyak::Reg64 tos_alloc();                           /* new cached top */
+    Xbyak::Reg64 tos_pop(const Xbyak::Reg64 &fallback); /* pop into reg */
+    void tos_push(const Xbyak::Reg64 &reg);             /* push from reg */
+    void tos_flush(); /* writes cached slots back to the machine stack */
+
+    void emit_label(string name);
+    void emit_BIPUSH(i8 value);
+    void emit_DUP();
+    void emit_IADD();
+    void emit_IAND();
+    void emit_IOR();
+    void emit_ISUB();
+    void emit_POP();
+    void emit_SWAP();
+    void emit_LDC_W(string constant);
+    void emit_ILOAD(string var);
+    void emit_IINC(string var, i8 value);
+    void emit_ISTORE(string var);
+    void emit_HALT();
+    void emit_ERR();
+    void emit_IN();
+    void emit_OUT();
+    void emit_GOTO(string label);
+    void emit_ICMPEQ(string label);
+    void emit_IFLT(string label);
+    void emit_IFEQ(string label);
+    void emit_INVOKEVIRTUAL(string func_name);
+    void emit_IRETURN();
+    void emit_NEWARRAY();
+    void emit_IALOAD();
+    void emit_IASTORE();
+    void emit_SHL();
+    void emit_SHR();
+    void emit_IMUL();
+    void emit_IDIV();
 
     Xbyak::CodeGenerator x64;
     const Xbyak::Reg64 &r_functions;
-    const Xbyak::Reg64 &r_safe;
 
+    vector<x64_function> _functions; /* recorded program */
+    std::set<string> _locals; /* args and vars of the last function */
+    bool _generated;
+    bool _ready;
+    bool _lazy; /* functions are generated on their first call */
+    std::unordered_map<string, size_t> _stubs; /* offset of the stub's jmp */
+    std::map<std::pair<string, string>, Xbyak::Label> _entries;
+    std::unordered_map<string, size_t> _fn_argc;
+    std::set<string> _legacy_frames; /* functions using the IJVM like frame */
+    vector<x64_symbol> _symbols;     /* in order of generation */
+
+    /* state of the function being generated */
     string fname;
-    std::unordered_map<string, int> _fn_argc;
-    std::unordered_map<string, int> _local_variables;
-    bool _io_added;
-};
\ No newline at end of file
+    std::unordered_map<string, int> _local_variables; /* frame offsets */
+    std::unordered_map<string, int> _var_registers;   /* allocated locals */
+    vector<int> _saved_registers; /* callee saved registers in use */
+    size_t _frame_size;           /* bytes reserved below rbp */
+    std::set<size_t> _elided;     /* skipped objref pushes and their calls */
+    size_t _pc;                   /* index of the instruction being generated */
+    vector<std::function<void()>> _slow_paths; /* emitted after the body */
+    vector<std::pair<string, size_t>> _labels; /* offsets of the labels */
+    vector<x64_line> _lines;                   /* offsets of the lines */
+    vector<int> _tos; /* cached slots as register indices, bottom to top */
+};
+
+#endif
@@ -0,0 +1,258 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+#include <vector>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "x64_bench.hpp"
+#include "x64_assembler.hpp"
+#include "x64_runtime.hpp"
+#include <util/logger.hpp>
+
+using std::vector;
+
+/* two sided 95% quantiles of Student's t, by degrees of freedom */
+static const double t_table[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+
+/* rounds df down, which widens the interval rather than narrowing it */
+static double t95(double df) {
+    if (df < 1)
+        df = 1;
+    if (df < 31)
+        return t_table[(size_t)df - 1];
+    if (df < 40)
+        return 2.042;
+    if (df < 60)
+        return 2.021;
+    if (df < 120)
+        return 2.000;
+    return 1.980;
+}
+
+struct summary {
+    size_t n;
+    double min, median, p99, mean, variance; /* variance of the sample */
+};
+
+static summary summarize(vector<double> ms) {
+    std::sort(ms.begin(), ms.end());
+    size_t n = ms.size();
+
+    summary s;
+    s.n = n;
+    s.min = ms[0];
+    s.median = n % 2 ? ms[n / 2] : (ms[n / 2 - 1] + ms[n / 2]) / 2;
+    s.p99 = ms[(99 * n + 99) / 100 - 1]; /* nearest rank */
+
+    s.mean = 0;
+    for (double m : ms)
+        s.mean += m / n;
+
+    s.variance = 0;
+    for (double m : ms)
+        s.variance += (m - s.mean) * (m - s.mean) / (n > 1 ? n - 1 : 1);
+    return s;
+}
+
+/* the times_ms array of an earlier --json */
+static vector<double> baseline_times(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+        log.panic("bench: can't open %s, %s", path.c_str(), strerror(errno));
+
+    std::string json;
+    char buf[4096];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+        json.append(buf, n);
+    fclose(f);
+
+    size_t at = json.find("\"times_ms\"");
+    if (at != std::string::npos)
+        at = json.find('[', at);
+    if (at == std::string::npos)
+        log.panic("bench: %s has no times_ms", path.c_str());
+
+    vector<double> times;
+    const char *cur = json.c_str() + at + 1;
+    while (true) {
+        char *end;
+        double ms = strtod(cur, &end);
+        if (end == cur)
+            break;
+        times.push_back(ms);
+
+        cur = end + strspn(end, " \t\r\n");
+        if (*cur != ',')
+            break;
+        cur++;
+    }
+
+    if (times.size() < 2)
+        log.panic("bench: %s needs at least 2 times to compare against",
+                  path.c_str());
+    return times;
+}
+
+/* Welch's t-interval of the difference of the means, relative to old */
+static void compare(const summary &now, const vector<double> &baseline) {
+    summary old = summarize(baseline);
+
+    double diff = now.mean - old.mean;
+    double a = now.variance / now.n, b = old.variance / old.n;
+    double se = __builtin_sqrt(a + b);
+    double df = a + b > 0 ? (a + b) * (a + b) /
+                                (a * a / (now.n - 1) + b * b / (old.n - 1))
+                          : 1000;
+    double half = t95(df) * se;
+
+    const char *verdict = diff - half > 0   ? "slower"
+                          : diff + half < 0 ? "faster"
+                                            : "no significant difference";
+    fprintf(stderr, "    baseline  %10.3f ms mean of %zu runs\n", old.mean,
+            old.n);
+    fprintf(stderr, "    change    %+9.2f%% +- %.2f%% (95%% CI), %s\n",
+            100 * diff / old.mean, 100 * half / old.mean, verdict);
+}
+
+static void write_json(const std::string &path, const std::string &program,
+                       const bench_options &o, int cpu, const summary &s,
+                       const vector<double> &ms) {
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f)
+        log.panic("bench: can't open %s, %s", path.c_str(), strerror(errno));
+
+    fprintf(f, "{\n  \"program\": \"");
+    for (char c : program) {
+        if (c == '"' || c == '\\')
+            fputc('\\', f);
+        fputc(c, f);
+    }
+    fprintf(f, "\",\n  \"runs\": %zu,\n  \"warmup\": %zu,\n  \"cpu\": %d,\n",
+            o.runs, o.warmup, cpu);
+    fprintf(f,
+            "  \"min_ms\": %.6f,\n  \"median_ms\": %.6f,\n"
+            "  \"p99_ms\": %.6f,\n  \"mean_ms\": %.6f,\n"
+            "  \"stddev_ms\": %.6f,\n  \"times_ms\": [",
+            s.min, s.median, s.p99, s.mean, __builtin_sqrt(s.variance));
+    for (size_t i = 0; i < ms.size(); i++)
+        fprintf(f, "%s%.6f", i ? ", " : "", ms[i]);
+    fprintf(f, "]\n}\n");
+    fclose(f);
+}
+
+/* puts path, or /dev/null, in the place of fd */
+static void redirect(int fd, const std::string &path, int flags) {
+    const char *name = path.empty() ? "/dev/null" : path.c_str();
+    int f = open(name, flags, 0644);
+    if (f < 0)
+        log.panic("bench: can't open %s, %s", name, strerror(errno));
+    if (dup2(f, fd) < 0)
+        log.panic("bench: dup2 failed, %s", strerror(errno));
+    close(f);
+}
+
+/*
+ * Every run rewinds stdin. Pipes and FIFOs can't be, so their contents are
+ * read once into an in memory file, which takes their place.
+ */
+static void make_rewindable(int fd) {
+    if (lseek(fd, 0, SEEK_CUR) >= 0 || errno != ESPIPE)
+        return;
+
+    int copy = memfd_create("ij-bench-input", 0);
+    if (copy < 0)
+        log.panic("bench: can't buffer the input, %s", strerror(errno));
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || write(copy, buf, n) != n)
+            log.panic("bench: can't buffer the input, %s", strerror(errno));
+    }
+
+    if (dup2(copy, fd) < 0)
+        log.panic("bench: dup2 failed, %s", strerror(errno));
+    close(copy);
+}
+
+/* keeps the runs on one cpu, returns which or -1 if that failed */
+static int pin(int cpu) {
+    if (cpu < 0 && (cpu = sched_getcpu()) < 0) {
+        log.warn("bench: can't pin, %s", strerror(errno));
+        return -1;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        log.warn("bench: can't pin to cpu %d, %s", cpu, strerror(errno));
+        return -1;
+    }
+    return cpu;
+}
+
+int x64_bench(X64Assembler &a, const std::string &program,
+              const bench_options &o) {
+    vector<double> baseline;
+    if (!o.compare.empty())
+        baseline = baseline_times(o.compare);
+
+    redirect(STDIN_FILENO, o.input, O_RDONLY);
+    make_rewindable(STDIN_FILENO);
+    redirect(STDOUT_FILENO, o.output, O_WRONLY | O_CREAT | O_TRUNC);
+    int cpu = pin(o.cpu);
+
+    // 128KiB of buffers, kept off the stack the program recurses on
+    std::unique_ptr<x64_runtime> rt{new x64_runtime};
+    vector<double> ms;
+    int status = 0;
+
+    for (size_t i = 0; i < o.warmup + o.runs; i++) {
+        // every run sees the whole input and leaves only its own output
+        if (lseek(STDIN_FILENO, 0, SEEK_SET) < 0)
+            log.panic("bench: can't rewind the input, %s", strerror(errno));
+        if (!ftruncate(STDOUT_FILENO, 0))
+            lseek(STDOUT_FILENO, 0, SEEK_SET);
+        x64_reset(rt.get());
+
+        auto start = std::chrono::steady_clock::now();
+        status = a.run_once(*rt);
+        auto stop = std::chrono::steady_clock::now();
+
+        if (i >= o.warmup)
+            ms.push_back(
+                std::chrono::duration<double, std::milli>(stop - start)
+                    .count());
+    }
+    x64_reset(rt.get());
+
+    summary s = summarize(ms);
+    fprintf(stderr, "bench: %s, %zu runs after %zu warmup, cpu %d\n",
+            program.c_str(), o.runs, o.warmup, cpu);
+    fprintf(stderr, "    min       %10.3f ms\n", s.min);
+    fprintf(stderr, "    median    %10.3f ms\n", s.median);
+    fprintf(stderr, "    p99       %10.3f ms\n", s.p99);
+    fprintf(stderr, "    mean      %10.3f ms +- %.3f (95%% CI)\n", s.mean,
+            s.n > 1 ? t95(s.n - 1) * __builtin_sqrt(s.variance / s.n) : 0);
+    fprintf(stderr, "    stddev    %10.3f ms\n", __builtin_sqrt(s.variance));
+
+    if (!baseline.empty())
+        compare(s, baseline);
+
+    if (!o.json.empty())
+        write_json(o.json, program, o, cpu, s, ms);
+
+    return status;
+}
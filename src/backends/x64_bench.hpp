@@ -0,0 +1,29 @@
+#ifndef BACKENDS_X64_BENCH_HPP
+#define BACKENDS_X64_BENCH_HPP
+#include <string>
+#include <util/types.h>
+
+class X64Assembler;
+
+/*
+ * Runs a program over and over in the same process, ij bench. The code is
+ * compiled once, every run starts from an empty heap and a rewound input,
+ * the warmup runs also compile whatever the program calls. The timings go
+ * to stderr, and to json if given. With compare, another bench's json, the
+ * difference of the means is reported with its 95% confidence interval.
+ */
+struct bench_options {
+    size_t runs = 10;
+    size_t warmup = 2;
+    int cpu = -1;        /* to pin to, the current one if negative */
+    std::string input;   /* replaces stdin, /dev/null if empty */
+    std::string output;  /* replaces stdout, /dev/null if empty */
+    std::string json;    /* where the timings go, if anywhere */
+    std::string compare; /* json of an earlier bench */
+};
+
+/* returns the exit code of the last run, 0 at HALT and 1 at ERR */
+int x64_bench(X64Assembler &a, const std::string &program,
+              const bench_options &o);
+
+#endif
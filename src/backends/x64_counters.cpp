@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <sys/mman.h>
+#include "x64_counters.hpp"
+#include <util/logger.hpp>
+
+Counters counters;
+
+const size_t counters_max = 1 << 20;
+
+Counters::Counters() : _base{nullptr} {}
+
+Counters::~Counters() {
+    if (!enabled())
+        return;
+
+    report();
+    munmap(_base, counters_max * sizeof(u64));
+}
+
+void Counters::open(const std::string &path) {
+    // pages are only backed once a counter on them gets hit
+    void *base = mmap(nullptr, counters_max * sizeof(u64),
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT | MAP_NORESERVE,
+                      -1, 0);
+    if (base == MAP_FAILED)
+        log.panic("counters: couldn't map them, %s", strerror(errno));
+
+    _base = (u64 *)base;
+    _path = path;
+}
+
+u64 *Counters::block(const std::string &fn, const std::string &name) {
+    if (_blocks.size() == counters_max)
+        log.panic("counters: more than %d blocks", (int)counters_max);
+
+    _blocks.push_back({fn, name, {}});
+    return _base + _blocks.size() - 1;
+}
+
+void Counters::executes(u64 *counter, opcode op) {
+    _blocks[counter - _base].ops[op]++;
+}
+
+template <typename T>
+static std::vector<std::pair<u64, T>> by_count(const std::map<T, u64> &counts) {
+    std::vector<std::pair<u64, T>> sorted;
+    for (auto &entry : counts)
+        if (entry.second)
+            sorted.push_back({entry.second, entry.first});
+
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const std::pair<u64, T> &a, const std::pair<u64, T> &b) {
+                         return a.first > b.first;
+                     });
+    return sorted;
+}
+
+void Counters::report() {
+    std::map<std::string, u64> calls, blocks;
+    std::map<opcode, u64> ops;
+    u64 total = 0;
+
+    for (size_t i = 0; i < _blocks.size(); i++) {
+        const block_info &b = _blocks[i];
+        if (b.name == b.fn)
+            calls[b.fn] += _base[i];
+        blocks[b.name] += _base[i];
+
+        for (auto &op : b.ops) {
+            ops[op.first] += op.second * _base[i];
+            total += op.second * _base[i];
+        }
+    }
+
+    FILE *out = _path.empty() ? stderr : fopen(_path.c_str(), "w");
+    if (!out) {
+        log.warn("counters: couldn't open %s, %s", _path.c_str(),
+                 strerror(errno));
+        return;
+    }
+
+    fprintf(out, "calls:\n");
+    for (auto &entry : by_count(calls))
+        fprintf(out, "%14lu  %s\n", (unsigned long)entry.first,
+                entry.second.c_str());
+
+    fprintf(out, "\nblocks:\n");
+    for (auto &entry : by_count(blocks))
+        fprintf(out, "%14lu  %s\n", (unsigned long)entry.first,
+                entry.second.c_str());
+
+    fprintf(out, "\nopcodes: %lu executed\n", (unsigned long)total);
+    for (auto &entry : by_count(ops))
+        fprintf(out, "%14lu %5.1f%%  %s\n", (unsigned long)entry.first,
+                100.0 * entry.first / total, opcode_name(entry.second));
+
+    if (out != stderr)
+        fclose(out);
+}
@@ -0,0 +1,46 @@
+#ifndef BACKENDS_X64_COUNTERS_HPP
+#define BACKENDS_X64_COUNTERS_HPP
+#include <map>
+#include <string>
+#include <vector>
+#include <util/types.h>
+#include <util/opcodes.hpp>
+
+/*
+ * Execution counters for ij run --counters. Every basic block of the jitted
+ * code gets a counter that it increments with a single inc qword [abs32],
+ * the counters live below 2GiB so no register is needed for that. A
+ * function's first block counts its calls, and multiplying the hits of a
+ * block by the opcodes in it gives the dynamic opcode mix.
+ */
+class Counters {
+  public:
+    Counters();
+    ~Counters(); /* writes the report */
+
+    void open(const std::string &path); /* stderr if path is empty */
+    bool enabled() const { return _base != nullptr; }
+
+    /* a fresh counter for the block of fn starting here */
+    u64 *block(const std::string &fn, const std::string &name);
+
+    /* each time counter goes up, op executes once more */
+    void executes(u64 *counter, opcode op);
+
+  private:
+    void report();
+
+    struct block_info {
+        std::string fn;
+        std::string name;
+        std::map<opcode, u64> ops; /* in the block, statically */
+    };
+
+    std::string _path;
+    u64 *_base; /* all the counters, indexed like _blocks */
+    std::vector<block_info> _blocks;
+};
+
+extern Counters counters;
+
+#endif
@@ -0,0 +1,283 @@
+#include <list>
+#include <map>
+#include "x64_gdb.hpp"
+#include "elf_writer.hpp"
+#include <util/logger.hpp>
+
+GdbJit gdb_jit;
+
+/* see "JIT Compilation Interface" in the gdb manual, gdb looks these up */
+extern "C" {
+enum { JIT_NOACTION = 0, JIT_REGISTER_FN, JIT_UNREGISTER_FN };
+
+struct jit_code_entry {
+    jit_code_entry *next_entry;
+    jit_code_entry *prev_entry;
+    const char *symfile_addr;
+    u64 symfile_size;
+};
+
+struct jit_descriptor {
+    u32 version;
+    u32 action_flag;
+    jit_code_entry *relevant_entry;
+    jit_code_entry *first_entry;
+};
+
+/* gdb puts a breakpoint in here */
+void __attribute__((noinline)) __jit_debug_register_code() {
+    asm volatile("");
+}
+
+jit_descriptor __jit_debug_descriptor = {1, JIT_NOACTION, nullptr, nullptr};
+}
+
+/* the symfiles have to stay around for as long as gdb may read them */
+struct gdb_object {
+    std::string symfile;
+    jit_code_entry entry;
+};
+
+static std::list<gdb_object> objects;
+
+static void uleb(std::string &out, u64 value) {
+    do {
+        u8 byte = value & 0x7f;
+        value >>= 7;
+        out += (char)(value ? byte | 0x80 : byte);
+    } while (value);
+}
+
+static void sleb(std::string &out, i64 value) {
+    bool more = true;
+    while (more) {
+        u8 byte = value & 0x7f;
+        value >>= 7;
+        more = !((value == 0 && !(byte & 0x40)) ||
+                 (value == -1 && (byte & 0x40)));
+        out += (char)(more ? byte | 0x80 : byte);
+    }
+}
+
+template <typename T> static void put(std::string &out, T value) {
+    append(out, &value, 1);
+}
+
+static void put_string(std::string &out, const std::string &s) {
+    out += s;
+    out += '\0';
+}
+
+/* DWARF 2, about the oldest thing gdb and readelf will happily take */
+enum {
+    DW_TAG_compile_unit = 0x11,
+    DW_TAG_subprogram = 0x2e,
+    DW_AT_name = 0x03,
+    DW_AT_stmt_list = 0x10,
+    DW_AT_low_pc = 0x11,
+    DW_AT_high_pc = 0x12,
+    DW_AT_external = 0x3f,
+    DW_FORM_addr = 0x01,
+    DW_FORM_data4 = 0x06,
+    DW_FORM_string = 0x08,
+    DW_FORM_flag = 0x0c,
+    DW_LNS_copy = 1,
+    DW_LNS_advance_pc = 2,
+    DW_LNS_advance_line = 3,
+    DW_LNS_set_file = 4,
+    DW_LNE_end_sequence = 1,
+    DW_LNE_set_address = 2,
+};
+
+static std::string debug_abbrev() {
+    std::string out;
+
+    uleb(out, 1);
+    uleb(out, DW_TAG_compile_unit);
+    out += (char)1; /* has children */
+    for (int attr : {DW_AT_name, DW_FORM_string, DW_AT_stmt_list, DW_FORM_data4,
+                     DW_AT_low_pc, DW_FORM_addr, DW_AT_high_pc, DW_FORM_addr})
+        uleb(out, attr);
+    uleb(out, 0), uleb(out, 0);
+
+    uleb(out, 2);
+    uleb(out, DW_TAG_subprogram);
+    out += (char)0;
+    for (int attr : {DW_AT_name, DW_FORM_string, DW_AT_external, DW_FORM_flag,
+                     DW_AT_low_pc, DW_FORM_addr, DW_AT_high_pc, DW_FORM_addr})
+        uleb(out, attr);
+    uleb(out, 0), uleb(out, 0);
+
+    uleb(out, 0);
+    return out;
+}
+
+static std::string debug_info(const std::string &unit, const std::string &name,
+                              u64 low, u64 high) {
+    std::string out;
+    put<u32>(out, 0); /* length, patched below */
+    put<u16>(out, 2);
+    put<u32>(out, 0); /* abbrevs */
+    put<u8>(out, 8);
+
+    uleb(out, 1);
+    put_string(out, unit);
+    put<u32>(out, 0); /* the only line program */
+    put<u64>(out, low);
+    put<u64>(out, high);
+
+    uleb(out, 2);
+    put_string(out, name);
+    put<u8>(out, 1);
+    put<u64>(out, low);
+    put<u64>(out, high);
+
+    uleb(out, 0); /* end of the unit's children */
+
+    u32 length = out.size() - 4;
+    memcpy(&out[0], &length, 4);
+    return out;
+}
+
+static std::string debug_line(const std::vector<x64_line> &lines, u64 start,
+                              size_t size, size_t base) {
+    std::map<std::string, size_t> files;
+    std::string names;
+    for (auto &l : lines) {
+        if (files.count(l.file))
+            continue;
+        size_t index = files.size() + 1;
+        files[l.file] = index;
+        put_string(names, l.file);
+        uleb(names, 0), uleb(names, 0), uleb(names, 0); /* dir, time, size */
+    }
+
+    std::string header;
+    put<u8>(header, 1);   /* minimum instruction length */
+    put<u8>(header, 1);   /* default is_stmt */
+    put<i8>(header, -5);  /* line base */
+    put<u8>(header, 14);  /* line range */
+    put<u8>(header, 13);  /* opcode base */
+    for (u8 n : {0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1})
+        put<u8>(header, n);
+    put<u8>(header, 0); /* no include directories */
+    header += names;
+    put<u8>(header, 0);
+
+    std::string program;
+    put<u8>(program, 0);
+    uleb(program, 9);
+    put<u8>(program, DW_LNE_set_address);
+    put<u64>(program, start);
+
+    size_t file = 1, line = 1, at = 0;
+    for (auto &l : lines) {
+        if (files[l.file] != file) {
+            file = files[l.file];
+            put<u8>(program, DW_LNS_set_file);
+            uleb(program, file);
+        }
+        put<u8>(program, DW_LNS_advance_line);
+        sleb(program, (i64)l.line - (i64)line);
+        put<u8>(program, DW_LNS_advance_pc);
+        uleb(program, l.at - base - at);
+        put<u8>(program, DW_LNS_copy);
+        line = l.line;
+        at = l.at - base;
+    }
+
+    put<u8>(program, DW_LNS_advance_pc);
+    uleb(program, size - at);
+    put<u8>(program, 0);
+    uleb(program, 1);
+    put<u8>(program, DW_LNE_end_sequence);
+
+    std::string out;
+    put<u32>(out, 2 + 4 + header.size() + program.size());
+    put<u16>(out, 2);
+    put<u32>(out, header.size());
+    return out + header + program;
+}
+
+GdbJit::GdbJit() : _enabled{false} {}
+
+void GdbJit::code(const u8 *start, size_t size, const std::string &name,
+                  const std::vector<x64_line> &lines, size_t base) {
+    if (!enabled() || size == 0)
+        return;
+
+    std::string unit = lines.empty() ? name : lines[0].file;
+    std::string strtab{'\0'}, shstrtab{'\0'};
+    std::vector<std::string> sections = {
+        "", // .text, gdb only needs to know where it is
+        "", // .symtab, below
+        "", // .strtab
+        debug_info(unit, name, (u64)start, (u64)start + size),
+        debug_abbrev(),
+        debug_line(lines, (u64)start, size, base),
+    };
+
+    Elf64_Sym symtab[3] = {};
+    symtab[1].st_name = add_string(strtab, unit);
+    symtab[1].st_info = ELF64_ST_INFO(STB_LOCAL, STT_FILE);
+    symtab[1].st_shndx = SHN_ABS;
+    symtab[2].st_name = add_string(strtab, name);
+    symtab[2].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+    symtab[2].st_shndx = 1;
+    symtab[2].st_size = size;
+    sections[1].assign((const char *)symtab, sizeof(symtab));
+    sections[2] = strtab;
+
+    const char *names[] = {".text",        ".symtab",      ".strtab",
+                           ".debug_info",  ".debug_abbrev", ".debug_line"};
+    std::string file(sizeof(Elf64_Ehdr), '\0');
+    Elf64_Shdr shdr[8] = {};
+
+    for (size_t i = 0; i < sections.size(); i++) {
+        Elf64_Shdr &s = shdr[i + 1];
+        align(file, 8);
+        s.sh_name = add_string(shstrtab, names[i]);
+        s.sh_type = SHT_PROGBITS;
+        s.sh_offset = append(file, sections[i].data(), sections[i].size());
+        s.sh_size = sections[i].size();
+        s.sh_addralign = 1;
+    }
+
+    shdr[1].sh_type = SHT_NOBITS;
+    shdr[1].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    shdr[1].sh_addr = (u64)start;
+    shdr[1].sh_size = size;
+    shdr[1].sh_addralign = 16;
+    shdr[2].sh_type = SHT_SYMTAB;
+    shdr[2].sh_link = 3;
+    shdr[2].sh_info = 2; /* first global */
+    shdr[2].sh_entsize = sizeof(Elf64_Sym);
+    shdr[2].sh_addralign = 8;
+    shdr[3].sh_type = SHT_STRTAB;
+
+    shdr[7].sh_name = add_string(shstrtab, ".shstrtab");
+    shdr[7].sh_type = SHT_STRTAB;
+    shdr[7].sh_offset = append(file, shstrtab.data(), shstrtab.size());
+    shdr[7].sh_size = shstrtab.size();
+    shdr[7].sh_addralign = 1;
+
+    align(file, 8);
+    Elf64_Ehdr ehdr = elf_rel_header(append(file, shdr, 8), 8);
+    memcpy(&file[0], &ehdr, sizeof(ehdr));
+
+    objects.push_back({file, {}});
+    gdb_object &o = objects.back();
+    o.entry.symfile_addr = o.symfile.data();
+    o.entry.symfile_size = o.symfile.size();
+
+    // link it in front and let gdb know
+    o.entry.next_entry = __jit_debug_descriptor.first_entry;
+    if (o.entry.next_entry)
+        o.entry.next_entry->prev_entry = &o.entry;
+    __jit_debug_descriptor.first_entry = &o.entry;
+    __jit_debug_descriptor.relevant_entry = &o.entry;
+    __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+    __jit_debug_register_code();
+
+    log_info("gdb: registered %s, %d lines", name.c_str(), (int)lines.size());
+}
@@ -0,0 +1,29 @@
+#ifndef BACKENDS_X64_GDB_HPP
+#define BACKENDS_X64_GDB_HPP
+#include <string>
+#include <vector>
+#include "x64_regalloc.hpp"
+
+/*
+ * Registers jitted functions with gdb through its JIT interface: each one
+ * becomes an in memory ELF object with a symbol and DWARF line table, so
+ * gdb can break on ij functions and lines and show where execution is.
+ */
+class GdbJit {
+  public:
+    GdbJit();
+
+    void open() { _enabled = true; }
+    bool enabled() const { return _enabled; }
+
+    /* lines are relative to base, the code starts at base as well */
+    void code(const u8 *start, size_t size, const std::string &name,
+              const std::vector<x64_line> &lines, size_t base);
+
+  private:
+    bool _enabled;
+};
+
+extern GdbJit gdb_jit;
+
+#endif
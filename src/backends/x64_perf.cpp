@@ -0,0 +1,117 @@
+#include <cstring>
+#include <ctime>
+#include <elf.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "x64_perf.hpp"
+#include <util/logger.hpp>
+#include <util/util.hpp>
+
+PerfSink perf_sink;
+
+/* see tools/perf/Documentation/jitdump-specification.txt */
+struct jitdump_header {
+    u32 magic;
+    u32 version;
+    u32 total_size;
+    u32 elf_mach;
+    u32 pad1;
+    u32 pid;
+    u64 timestamp;
+    u64 flags;
+};
+
+struct jitdump_code_load {
+    u32 id;
+    u32 total_size;
+    u64 timestamp;
+    u32 pid;
+    u32 tid;
+    u64 vma;
+    u64 code_addr;
+    u64 code_size;
+    u64 code_index;
+    /* followed by the name, nul terminated, and the code */
+};
+
+const u32 jitdump_magic = 0x4A695444;
+const u32 jitdump_code_load_id = 0;
+
+/* perf record -k 1 samples with the monotonic clock, so that's what we use */
+static u64 timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+PerfSink::PerfSink()
+    : _format{PerfFormat::none}, _out{nullptr}, _marker{nullptr}, _index{0} {}
+
+PerfSink::~PerfSink() {
+    if (_marker)
+        munmap(_marker, sysconf(_SC_PAGESIZE));
+    if (_out)
+        fclose(_out);
+}
+
+void PerfSink::open(PerfFormat format) {
+    if (format == PerfFormat::none)
+        return;
+
+    std::string path = format == PerfFormat::map
+                           ? sprint("/tmp/perf-%d.map", (int)getpid())
+                           : sprint("/tmp/jit-%d.dump", (int)getpid());
+
+    _out = fopen(path.c_str(), format == PerfFormat::map ? "w" : "w+");
+    if (!_out)
+        log.panic("perf: couldn't open %s, %s", path.c_str(), strerror(errno));
+    _format = format;
+    log_info("perf: writing symbols to %s", path.c_str());
+
+    if (format == PerfFormat::map)
+        return;
+
+    jitdump_header h{};
+    h.magic = jitdump_magic;
+    h.version = 1;
+    h.total_size = sizeof(h);
+    h.elf_mach = EM_X86_64;
+    h.pid = getpid();
+    h.timestamp = timestamp();
+    fwrite(&h, sizeof(h), 1, _out);
+    fflush(_out);
+
+    // perf inject finds the dump through this (executable) mapping
+    _marker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+                   MAP_PRIVATE, fileno(_out), 0);
+    if (_marker == MAP_FAILED)
+        log.panic("perf: couldn't map %s, %s", path.c_str(), strerror(errno));
+}
+
+void PerfSink::code(const u8 *start, size_t size, const std::string &name) {
+    if (!enabled() || size == 0)
+        return;
+
+    if (_format == PerfFormat::map) {
+        fprintf(_out, "%lx %lx %s\n", (unsigned long)start,
+                (unsigned long)size, name.c_str());
+        fflush(_out);
+        return;
+    }
+
+    jitdump_code_load r{};
+    r.id = jitdump_code_load_id;
+    r.total_size = sizeof(r) + name.size() + 1 + size;
+    r.timestamp = timestamp();
+    r.pid = getpid();
+    r.tid = syscall(SYS_gettid);
+    r.vma = r.code_addr = (u64)start;
+    r.code_size = size;
+    r.code_index = _index++;
+
+    fwrite(&r, sizeof(r), 1, _out);
+    fwrite(name.c_str(), name.size() + 1, 1, _out);
+    fwrite(start, size, 1, _out);
+    fflush(_out);
+}
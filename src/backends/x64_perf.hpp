@@ -0,0 +1,36 @@
+#ifndef BACKENDS_X64_PERF_HPP
+#define BACKENDS_X64_PERF_HPP
+#include <cstdio>
+#include <string>
+#include <util/types.h>
+
+/*
+ * Tells perf(1) what the jitted code is, so samples in it get names:
+ *
+ *  - map:     /tmp/perf-<pid>.map, read by perf report as is
+ *  - jitdump: /tmp/jit-<pid>.dump with a copy of the code, for
+ *             perf record -k 1 followed by perf inject --jit
+ */
+enum class PerfFormat { none, map, jitdump };
+
+class PerfSink {
+  public:
+    PerfSink();
+    ~PerfSink();
+
+    void open(PerfFormat format);
+    bool enabled() const { return _format != PerfFormat::none; }
+
+    /* announces code once it is in place and won't change anymore */
+    void code(const u8 *start, size_t size, const std::string &name);
+
+  private:
+    PerfFormat _format;
+    FILE *_out;
+    void *_marker; /* the mmap perf record notices the dump by */
+    u64 _index;    /* jitdump code index */
+};
+
+extern PerfSink perf_sink;
+
+#endif
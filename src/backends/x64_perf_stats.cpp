@@ -0,0 +1,143 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <x86intrin.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "x64_perf_stats.hpp"
+#include <util/logger.hpp>
+
+PerfStats perf_stats;
+
+struct perf_event {
+    const char *name;
+    u32 type;
+    u64 config;
+};
+
+static u64 cache_event(u64 cache, u64 result) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+}
+
+// clang-format off
+static const perf_event events[] = {
+    {"cycles",                PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions",          PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branches",              PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses",         PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1-dcache-loads",       PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_ACCESS)},
+    {"L1-dcache-load-misses", PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"LLC-loads",             PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_ACCESS)},
+    {"LLC-load-misses",       PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+};
+// clang-format on
+
+static u64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+PerfStats::PerfStats() : _enabled{false}, _start_ns{0}, _start_tsc{0} {}
+
+/*
+ * Every event gets its own fd rather than one group: a group only counts if
+ * all of it fits on the PMU at once, on their own the kernel multiplexes
+ * them and the time_enabled / time_running ratio scales the counts back up.
+ */
+void PerfStats::start() {
+    for (const perf_event &e : events) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = e.type;
+        attr.config = e.config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd < 0)
+            log_info("perf-stats: no %s, %s", e.name, strerror(errno));
+        _counters.push_back({e.name, fd, false, 0});
+    }
+
+    atexit(report);
+
+    _start_ns = now_ns();
+    _start_tsc = __rdtsc();
+    for (counter &c : _counters)
+        if (c.fd >= 0)
+            ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+void PerfStats::report() {
+    PerfStats &s = perf_stats;
+    for (counter &c : s._counters)
+        if (c.fd >= 0)
+            ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0);
+    u64 tsc = __rdtsc() - s._start_tsc;
+    u64 ns = now_ns() - s._start_ns;
+
+    bool any = false;
+    for (counter &c : s._counters) {
+        if (c.fd < 0)
+            continue;
+
+        u64 values[3]; /* value, time enabled, time running */
+        c.counted = read(c.fd, values, sizeof(values)) == sizeof(values) &&
+                    values[2] != 0;
+        if (c.counted)
+            c.value = (u64)((double)values[0] * values[1] / values[2]);
+        any |= c.counted;
+        close(c.fd);
+    }
+
+    // part / whole, or a negative number if either wasn't counted
+    auto ratio = [&](const char *part, const char *whole) {
+        const counter *p = nullptr, *w = nullptr;
+        for (const counter &c : s._counters) {
+            if (c.counted && !strcmp(c.name, part))
+                p = &c;
+            if (c.counted && !strcmp(c.name, whole))
+                w = &c;
+        }
+        return p && w && w->value ? (double)p->value / w->value : -1;
+    };
+
+    fprintf(stderr, "\nperf-stats: %.3f s, %lu tsc ticks\n", ns / 1e9,
+            (unsigned long)tsc);
+    if (!any) {
+        fprintf(stderr, "  perf_event_open isn't permitted, only timing\n");
+        return;
+    }
+
+    for (const counter &c : s._counters) {
+        if (!c.counted) {
+            fprintf(stderr, "  %16s  %s\n", "<not counted>", c.name);
+            continue;
+        }
+
+        fprintf(stderr, "  %16lu  %-22s", (unsigned long)c.value, c.name);
+        double r;
+        if (!strcmp(c.name, "instructions") &&
+            (r = ratio("instructions", "cycles")) >= 0)
+            fprintf(stderr, "  %.2f insn per cycle", r);
+        else if (!strcmp(c.name, "branch-misses") &&
+                 (r = ratio("branch-misses", "branches")) >= 0)
+            fprintf(stderr, "  %.2f%% of branches", 100 * r);
+        else if (!strcmp(c.name, "L1-dcache-load-misses") &&
+                 (r = ratio("L1-dcache-load-misses", "L1-dcache-loads")) >= 0)
+            fprintf(stderr, "  %.2f%% of L1d loads", 100 * r);
+        else if (!strcmp(c.name, "LLC-load-misses") &&
+                 (r = ratio("LLC-load-misses", "LLC-loads")) >= 0)
+            fprintf(stderr, "  %.2f%% of LLC loads", 100 * r);
+        fprintf(stderr, "\n");
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef BACKENDS_X64_PERF_STATS_HPP
+#define BACKENDS_X64_PERF_STATS_HPP
+#include <vector>
+#include <util/types.h>
+
+/*
+ * Hardware counters around the jitted code, ij run --perf-stats. Counting
+ * starts right before X64Assembler::run calls into the code, the summary
+ * is printed to stderr when the program exits, be it at HALT, ERR or by
+ * returning. Without perf_event_open (e.g. perf_event_paranoid or a
+ * container) only the wall time and the rdtsc ticks are reported.
+ */
+class PerfStats {
+  public:
+    PerfStats();
+
+    void open() { _enabled = true; }
+    bool enabled() const { return _enabled; }
+
+    void start();
+
+  private:
+    static void report(); /* from atexit */
+
+    struct counter {
+        const char *name;
+        int fd; /* -1 if the kernel or cpu won't count it */
+        bool counted;
+        u64 value; /* scaled up if it had to share the PMU */
+    };
+
+    bool _enabled;
+    std::vector<counter> _counters;
+    u64 _start_ns, _start_tsc;
+};
+
+extern PerfStats perf_stats;
+
+#endif
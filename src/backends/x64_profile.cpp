@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <map>
+#include <signal.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/time.h>
+#include "x64_profile.hpp"
+#include <util/logger.hpp>
+
+Profiler profiler;
+
+const int profile_hz = 1000;
+const size_t profile_max_regions = 1 << 16;
+const size_t profile_max_stacks = 1 << 14;
+const size_t profile_top = 20; /* lines in the flat report */
+
+/* ids that aren't regions */
+const u32 id_native = 0;    /* C code, the runtime or the compiler */
+const u32 id_truncated = 1; /* deeper than a stack entry holds */
+const u32 id_first_region = 2;
+
+static void on_sigprof(int, siginfo_t *, void *ucontext) {
+    profiler.sample(ucontext);
+}
+
+Profiler::Profiler()
+    : _names{"[native]", "[truncated]"}, _regions{nullptr}, _count{0},
+      _stacks{nullptr}, _stack_end{0}, _samples{0}, _dropped{0} {}
+
+Profiler::~Profiler() {
+    if (enabled())
+        report();
+
+    delete[] _regions;
+    delete[] _stacks;
+}
+
+void Profiler::open(const std::string &path) {
+    _regions = new region[profile_max_regions];
+    _stacks = new stack[profile_max_stacks]();
+
+    // frames are only followed while they stay on the stack
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0 ||
+        pthread_attr_getstack(&attr, &addr, &size) != 0)
+        log.panic("profile: can't find the stack");
+    pthread_attr_destroy(&attr);
+    _stack_end = (u64)addr + size;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, nullptr) < 0)
+        log.panic("profile: sigaction failed, %s", strerror(errno));
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / profile_hz;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) < 0)
+        log.panic("profile: setitimer failed, %s", strerror(errno));
+
+    _path = path;
+    log_info("profile: sampling at %d Hz", profile_hz);
+}
+
+void Profiler::code(const u8 *start, size_t size, const std::string &name,
+                    const x64_frame &frame) {
+    size_t n = _count.load(std::memory_order_relaxed);
+    if (!enabled() || size == 0)
+        return;
+    if (n == profile_max_regions) {
+        log.warn("profile: too many regions, %s isn't named", name.c_str());
+        return;
+    }
+
+    _regions[n] = {(u64)start, (u64)start + size, frame};
+    _names.push_back(name);
+    _count.store(n + 1, std::memory_order_release);
+}
+
+/*
+ * Runs in the signal handler: no allocations, no locks, and any memory read
+ * through rbp is checked to be on the stack first.
+ */
+void Profiler::sample(void *ucontext) {
+    const greg_t *regs = ((ucontext_t *)ucontext)->uc_mcontext.gregs;
+    u64 pc = regs[REG_RIP], rsp = regs[REG_RSP], rbp = regs[REG_RBP];
+
+    size_t count = _count.load(std::memory_order_acquire);
+    auto find = [&](u64 pc) -> const region * {
+        const region *r = std::upper_bound(
+            _regions, _regions + count, pc,
+            [](u64 pc, const region &r) { return pc < r.start; });
+        return r != _regions && pc < r[-1].end ? &r[-1] : nullptr;
+    };
+    auto on_stack = [&](u64 at) {
+        return at >= rsp && at + 8 <= _stack_end && at % 8 == 0;
+    };
+
+    u32 ids[64];
+    size_t depth = 0;
+    const region *r = find(pc);
+    if (!r)
+        ids[depth++] = id_native;
+
+    for (; r; r = find(pc - 1)) {
+        if (depth == 63) {
+            ids[depth++] = id_truncated;
+            break;
+        }
+        ids[depth++] = id_first_region + (r - _regions);
+
+        // before push rbp and at ret, rbp still is the caller's
+        const x64_frame &f = r->frame;
+        bool own_rbp = true;
+        u64 ret_at = rbp + f.ret_at, rbp_at = rbp + f.rbp_at;
+        if (f.fast && (pc == (u64)f.entry || *(const u8 *)pc == 0xC3))
+            ret_at = rsp, own_rbp = false;
+        else if (f.fast && pc == (u64)f.entry + 1)
+            ret_at = rsp + 8, own_rbp = false;
+
+        if (!on_stack(ret_at) || (own_rbp && !on_stack(rbp_at)))
+            break;
+
+        pc = *(const u64 *)ret_at;
+        if (own_rbp) {
+            u64 caller = *(const u64 *)rbp_at;
+            if (caller <= rbp)
+                break;
+            rbp = caller;
+        }
+    }
+
+    u64 hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < depth; i++)
+        hash = (hash ^ ids[i]) * 0x100000001b3ULL;
+
+    _samples++;
+    for (size_t i = 0; i < profile_max_stacks; i++) {
+        stack &s = _stacks[(hash + i) % profile_max_stacks];
+        if (s.count == 0) {
+            s.hash = hash;
+            s.depth = depth;
+            memcpy(s.ids, ids, depth * sizeof(ids[0]));
+        } else if (s.hash != hash || s.depth != depth ||
+                   memcmp(s.ids, ids, depth * sizeof(ids[0])) != 0)
+            continue;
+
+        s.count++;
+        return;
+    }
+
+    _dropped++;
+}
+
+void Profiler::report() {
+    struct itimerval off;
+    memset(&off, 0, sizeof(off));
+    setitimer(ITIMER_PROF, &off, nullptr);
+    signal(SIGPROF, SIG_IGN);
+
+    FILE *out = fopen(_path.c_str(), "w");
+    if (!out) {
+        log.warn("profile: couldn't open %s, %s", _path.c_str(),
+                 strerror(errno));
+        return;
+    }
+
+    // flamegraph.pl wants the root first
+    std::map<std::string, u64> self;
+    for (size_t i = 0; i < profile_max_stacks; i++) {
+        const stack &s = _stacks[i];
+        if (s.count == 0)
+            continue;
+
+        for (size_t j = s.depth; j-- > 0;)
+            fprintf(out, "%s%s", _names[s.ids[j]].c_str(), j ? ";" : "");
+        fprintf(out, " %u\n", s.count);
+
+        self[_names[s.ids[0]]] += s.count;
+    }
+    fclose(out);
+
+    std::vector<std::pair<u64, std::string>> top;
+    for (auto &entry : self)
+        top.push_back({entry.second, entry.first});
+    std::sort(top.rbegin(), top.rend());
+    if (top.size() > profile_top)
+        top.resize(profile_top);
+
+    fprintf(stderr, "profile: %lu samples, %lu dropped, stacks in %s\n",
+            (unsigned long)_samples, (unsigned long)_dropped, _path.c_str());
+    fprintf(stderr, "  %%self  samples  where\n");
+    for (auto &entry : top)
+        fprintf(stderr, "%6.1f%% %8lu  %s\n", 100.0 * entry.first / _samples,
+                (unsigned long)entry.first, entry.second.c_str());
+}
@@ -0,0 +1,65 @@
+#ifndef BACKENDS_X64_PROFILE_HPP
+#define BACKENDS_X64_PROFILE_HPP
+#include <atomic>
+#include <string>
+#include <vector>
+#include <util/types.h>
+
+/* how to get from jitted code to its caller, offsets are relative to rbp */
+struct x64_frame {
+    const u8 *entry; /* the function's first instruction, push rbp */
+    int ret_at;      /* the caller's rip */
+    int rbp_at;      /* the caller's rbp */
+    bool fast;       /* a plain push rbp, mov rbp, rsp frame */
+};
+
+/*
+ * Samples the running program from SIGPROF. The handler walks the rbp chain
+ * of the jitted frames and counts the stacks in a table allocated up front,
+ * nothing is resolved or written until the program exits:
+ *
+ *  - the folded stacks go to the file passed to open, for flamegraph.pl
+ *  - a flat top-N of where the samples landed goes to stderr
+ */
+class Profiler {
+  public:
+    Profiler();
+    ~Profiler(); /* writes the reports */
+
+    void open(const std::string &path);
+    bool enabled() const { return !_path.empty(); }
+
+    /* names [start, start + size), once the code is in place */
+    void code(const u8 *start, size_t size, const std::string &name,
+              const x64_frame &frame);
+
+    void sample(void *ucontext); /* from the signal handler */
+
+  private:
+    void report();
+
+    struct region {
+        u64 start, end;
+        x64_frame frame;
+    };
+
+    struct stack {
+        u64 hash;
+        u32 count;
+        u32 depth;
+        u32 ids[64]; /* region ids, leaf first */
+    };
+
+    std::string _path;
+    std::vector<std::string> _names; /* per region id, not for the handler */
+    region *_regions;                /* sorted, code only ever grows */
+    std::atomic<size_t> _count;      /* regions the handler may look at */
+    stack *_stacks;                  /* open addressing on the hash */
+    u64 _stack_end;                  /* top of the main thread's stack */
+    u64 _samples;
+    u64 _dropped; /* the stack table was full */
+};
+
+extern Profiler profiler;
+
+#endif
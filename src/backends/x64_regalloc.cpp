@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <map>
+#include <set>
+#include "x64_regalloc.hpp"
+#include <util/logger.hpp>
+#include <util/util.hpp>
+
+static bool is_jump(opcode op) {
+    return in(op, {opcode::GOTO, opcode::ICMPEQ, opcode::IFLT, opcode::IFEQ});
+}
+
+static bool is_local_access(opcode op) {
+    return in(op, {opcode::ILOAD, opcode::ISTORE, opcode::IINC});
+}
+
+void add_line(x64_function &f, const string &file, size_t line) {
+    // nothing was recorded for the previous one
+    if (!f.lines.empty() && f.lines.back().at == f.body.size())
+        f.lines.pop_back();
+
+    if (!f.lines.empty() && f.lines.back().file == file &&
+        f.lines.back().line == line)
+        return;
+
+    f.lines.push_back({f.body.size(), file, line});
+}
+
+vector<live_interval> live_intervals(const x64_function &f) {
+    const vector<x64_instruction> &body = f.body;
+
+    std::unordered_map<string, size_t> labels;
+    for (size_t i = 0; i < body.size(); i++)
+        if (body[i].op == opcode::INVALID)
+            labels[body[i].arg] = i;
+
+    /* every backwards jump closes a loop [label, jump] */
+    vector<std::pair<size_t, size_t>> loops;
+    for (size_t i = 0; i < body.size(); i++)
+        if (is_jump(body[i].op) && labels.count(body[i].arg) &&
+            labels[body[i].arg] <= i)
+            loops.emplace_back(labels[body[i].arg], i);
+
+    /* loop depth of every instruction */
+    vector<int> depth(body.size() + 1, 0);
+    for (auto &loop : loops) {
+        depth[loop.first]++;
+        depth[loop.second + 1]--;
+    }
+    for (size_t i = 1; i < depth.size(); i++)
+        depth[i] += depth[i - 1];
+
+    std::map<string, live_interval> intervals;
+    for (const string &arg : f.args)
+        intervals[arg] = {arg, 0, 0, 0};
+
+    std::set<string> locals{f.args.begin(), f.args.end()};
+    locals.insert(f.vars.begin(), f.vars.end());
+
+    for (size_t i = 0; i < body.size(); i++) {
+        const x64_instruction &ins = body[i];
+        if (!is_local_access(ins.op) || !contains(locals, ins.arg))
+            continue;
+
+        if (!intervals.count(ins.arg))
+            intervals[ins.arg] = {ins.arg, i, i, 0};
+
+        live_interval &li = intervals[ins.arg];
+        li.start = std::min(li.start, i);
+        li.end = std::max(li.end, i);
+        li.weight += u64{1} << (3 * std::min(depth[i], 8));
+    }
+
+    /*
+     * Without loops the instructions between first and last use are all
+     * there is. A value live anywhere in a loop however has to survive the
+     * jump back, so it is live for the entire loop. Extending can make an
+     * interval overlap an enclosing loop, hence the fixpoint.
+     */
+    for (bool changed = true; changed;) {
+        changed = false;
+
+        for (auto &entry : intervals) {
+            live_interval &li = entry.second;
+
+            for (auto &loop : loops) {
+                if (li.start > loop.second || li.end < loop.first)
+                    continue;
+
+                if (li.start > loop.first || li.end < loop.second) {
+                    li.start = std::min(li.start, loop.first);
+                    li.end = std::max(li.end, loop.second);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    vector<live_interval> result;
+    for (auto &entry : intervals)
+        result.push_back(entry.second);
+
+    std::stable_sort(result.begin(), result.end(),
+                     [](const live_interval &a, const live_interval &b) {
+                         return a.start < b.start;
+                     });
+    return result;
+}
+
+std::unordered_map<string, int> allocate_locals(const x64_function &f,
+                                                const vector<int> &registers) {
+    vector<live_interval> intervals = live_intervals(f);
+
+    std::unordered_map<string, int> assigned;
+    vector<live_interval> active; /* intervals that currently hold a register */
+    vector<int> available{registers.rbegin(), registers.rend()};
+
+    for (const live_interval &li : intervals) {
+        if (li.weight == 0)
+            continue;
+
+        /* expire intervals that ended before this one starts */
+        for (auto it = active.begin(); it != active.end();) {
+            if (it->end < li.start) {
+                available.push_back(assigned[it->var]);
+                it = active.erase(it);
+            } else
+                it++;
+        }
+
+        if (!available.empty()) {
+            assigned[li.var] = available.back();
+            available.pop_back();
+            active.push_back(li);
+            continue;
+        }
+
+        /* no register left, the coldest of the overlapping locals spills */
+        auto coldest = std::min_element(
+            active.begin(), active.end(),
+            [](const live_interval &a, const live_interval &b) {
+                return a.weight < b.weight;
+            });
+
+        if (coldest == active.end() || coldest->weight >= li.weight) {
+            log_info("    spill %s (weight %lu)", li.var.c_str(), li.weight);
+            continue;
+        }
+
+        log_info("    spill %s (weight %lu)", coldest->var.c_str(),
+                 coldest->weight);
+        assigned[li.var] = assigned[coldest->var];
+        assigned.erase(coldest->var);
+        active.erase(coldest);
+        active.push_back(li);
+    }
+
+    return assigned;
+}
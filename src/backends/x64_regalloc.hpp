@@ -0,0 +1,58 @@
+#ifndef BACKENDS_X64_REGALLOC_HPP
+#define BACKENDS_X64_REGALLOC_HPP
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <util/types.h>
+#include <util/opcodes.hpp>
+
+using std::string;
+using std::vector;
+
+/*
+ * The x64 backend records every function before generating code for it, so
+ * whole function analyses (like register allocation) can look ahead.
+ */
+struct x64_instruction {
+    opcode op;  /* opcode::INVALID marks a label */
+    string arg; /* label, variable, constant or function name */
+    i64 value;  /* immediate of BIPUSH and IINC */
+};
+
+/* source position of the code from instruction (or code offset) at onwards */
+struct x64_line {
+    size_t at;
+    string file;
+    size_t line;
+};
+
+struct x64_function {
+    string name;
+    vector<string> args;
+    vector<string> vars;
+    vector<x64_instruction> body;
+    vector<x64_line> lines; /* at is an index into body */
+};
+
+/* the instructions recorded next in f come from line */
+void add_line(x64_function &f, const string &file, size_t line);
+
+/* live range of a local over the instruction indices of a function */
+struct live_interval {
+    string var;
+    size_t start;
+    size_t end;
+    u64 weight; /* number of uses, weighted by loop depth */
+};
+
+/* computes the live intervals of all args and vars, sorted by start */
+vector<live_interval> live_intervals(const x64_function &f);
+
+/*
+ * Linear scan allocation of args and vars onto the given registers,
+ * returns var -> register index. Locals that are missing got spilled.
+ */
+std::unordered_map<string, int> allocate_locals(const x64_function &f,
+                                                const vector<int> &registers);
+
+#endif
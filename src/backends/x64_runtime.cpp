@@ -0,0 +1,174 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csetjmp>
+#include <unistd.h>
+#include "x64_runtime.hpp"
+#include <util/logger.hpp>
+#include <util/opcodes.hpp>
+
+void x64_flush(x64_runtime *rt) {
+    u8 *cur = rt->out_buf;
+
+    while (cur < rt->out_cur) {
+        ssize_t n = write(STDOUT_FILENO, cur, rt->out_cur - cur);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            log.panic("out: write failed, %s", strerror(errno));
+        cur += n;
+    }
+
+    rt->out_cur = rt->out_buf;
+}
+
+/*
+ * Called by IN once the input buffer is empty. Pending output goes first, so
+ * interactive programs show their prompt before blocking. EOF reads as 0.
+ */
+u64 x64_fill(x64_runtime *rt) {
+    x64_flush(rt);
+
+    ssize_t n;
+    do {
+        n = read(STDIN_FILENO, rt->in_buf, x64_io_buffer);
+    } while (n < 0 && errno == EINTR);
+
+    log_info(" -> read %ld bytes", (long)n);
+    if (n <= 0)
+        return 0;
+
+    rt->in_cur = rt->in_buf + 1;
+    rt->in_end = rt->in_buf + n;
+    return rt->in_buf[0];
+}
+
+/* called by OUT once the output buffer is full */
+static void __out__(int64_t val, x64_runtime *rt) {
+    x64_flush(rt);
+    *rt->out_cur++ = val;
+}
+
+/* HALT and ERR leave the jitted code, see X64Assembler::run_once */
+static void __halt__(x64_runtime *rt) {
+    // fprintf(stderr, "Closing the IJVM gracefully\n");
+    x64_flush(rt);
+    if (rt->host)
+        longjmp(*(jmp_buf *)rt->host, 1);
+    exit(0);
+}
+
+static void __err__(x64_runtime *rt) {
+    x64_flush(rt);
+    fprintf(stderr, "ERROR Encountered\n");
+    if (rt->host)
+        longjmp(*(jmp_buf *)rt->host, 2);
+    exit(1);
+}
+
+/* a zeroed block of size elements, chained into heap_blocks */
+static i64 *heap_block(x64_runtime *rt, i64 size) {
+    i64 *block = (i64 *)calloc(size + 1, sizeof(i64));
+    if (!block)
+        return nullptr;
+
+    block[0] = (i64)rt->heap_blocks;
+    rt->heap_blocks = block;
+    return block + 1;
+}
+
+void x64_reset(x64_runtime *rt) {
+    while (rt->heap_blocks) {
+        i64 *next = (i64 *)rt->heap_blocks[0];
+        free(rt->heap_blocks);
+        rt->heap_blocks = next;
+    }
+
+    rt->heap_cur = rt->heap_end = nullptr;
+    rt->in_cur = rt->in_end = rt->in_buf;
+    rt->out_cur = rt->out_buf;
+}
+
+/*
+ * Called when the inline bump allocation fails: the array is too large for
+ * it or the current chunk is exhausted, in which case a fresh one is taken.
+ */
+static int64_t *__newarray__(int64_t size, x64_runtime *rt) {
+    if (size < 0 || size > x64_heap_bump_max) {
+        int64_t *arr = size < 0 ? nullptr : heap_block(rt, size);
+        log_info(" -> newarray(%ld) -> %p", size, (void *)arr);
+        return arr;
+    }
+
+    rt->heap_cur = heap_block(rt, x64_heap_chunk);
+    if (!rt->heap_cur)
+        log.panic("newarray: out of memory");
+    rt->heap_end = rt->heap_cur + x64_heap_chunk;
+    log_info(" -> newarray(%ld) new chunk %p", size, (void *)rt->heap_cur);
+
+    int64_t *arr = rt->heap_cur;
+    rt->heap_cur += size;
+    return arr;
+}
+
+u64 ij_in(x64_runtime *rt) { return x64_fill(rt); }
+void ij_out(i64 val, x64_runtime *rt) { __out__(val, rt); }
+void ij_halt(x64_runtime *rt) { __halt__(rt); }
+void ij_err(x64_runtime *rt) { __err__(rt); }
+i64 *ij_newarray(i64 size, x64_runtime *rt) { return __newarray__(size, rt); }
+void ij_flush(x64_runtime *rt) { x64_flush(rt); }
+
+#ifdef DEBUG
+static void debug(i64 op, i64 tos) {
+    switch (op) {
+        case op_bipush:        log_info("bipush [tos:%llx]", tos);           break;
+        case op_dup:           log_info("dup [tos:%llx]", tos);              break;
+        case op_err:           log_info("err [tos:%llx]", tos);              break;
+        case op_goto:          log_info("goto [tos:%llx]", tos);             break;
+        case op_halt:          log_info("halt [tos:%llx]", tos);             break;
+        case op_iadd:          log_info("iadd [tos:%llx]", tos);             break;
+        case op_iand:          log_info("iand [tos:%llx]", tos);             break;
+        case op_ifeq:          log_info("ifeq [tos:%llx]", tos);             break;
+        case op_iflt:          log_info("iflt [tos:%llx]", tos);             break;
+        case op_icmpeq:        log_info("icmpeq [tos:%llx]", tos);           break;
+        case op_iinc:          log_info("iinc [tos:%llx]", tos);             break;
+        case op_iload:         log_info("iload [tos:%llx]", tos);            break;
+        case op_in:            log_info("in [tos:%llx]", tos);               break;
+        case op_invokevirtual: log_info("invokevirtual [tos:%llx]", tos);    break;
+        case op_ior:           log_info("ior [tos:%llx]", tos);              break;
+        case op_ireturn:       log_info("ireturn [tos:%llx]", tos);          break;
+        case op_istore:        log_info("istore [tos:%llx]", tos);           break;
+        case op_isub:          log_info("isub [tos:%llx]", tos);             break;
+        case op_ldc_w:         log_info("ldc_w [tos:%llx]", tos);            break;
+        case op_nop:           log_info("nop [tos:%llx]", tos);              break;
+        case op_out:           log_info("out [tos:%llx]", tos);              break;
+        case op_pop:           log_info("pop [tos:%llx]", tos);              break;
+        case op_swap:          log_info("swap [tos:%llx]", tos);             break;
+        case op_wide:          log_info("wide [tos:%llx]", tos);             break;
+        case op_newarray:      log_info("newarray [tos:%llx]", tos);         break;
+        case op_iaload:        log_info("iaload [tos:%llx]", tos);           break;
+        case op_iastore:       log_info("iastore [tos:%llx]", tos);          break;
+        case op_gc:            log_info("gc [tos:%llx]", tos);               break;
+        case op_netbind:       log_info("netbind [tos:%llx]", tos);          break;
+        case op_netconnect:    log_info("netconnect [tos:%llx]", tos);       break;
+        case op_netin:         log_info("netin [tos:%llx]", tos);            break;
+        case op_netout:        log_info("netout [tos:%llx]", tos);           break;
+        case op_netclose:      log_info("netclose [tos:%llx]", tos);         break;
+        default:
+            log.panic("incorrect op");
+    }
+}
+#endif
+
+x64_runtime::x64_runtime()
+    : in{(void *)x64_fill}, out{(void *)__out__}, halt{(void *)__halt__},
+      err{(void *)__err__}, newarray{(void *)__newarray__}, debug{nullptr},
+      compile{nullptr}, jit{nullptr},
+      heap_cur{nullptr}, heap_end{nullptr}, in_cur{in_buf}, in_end{in_buf},
+      out_cur{out_buf}, out_end{out_buf + x64_io_buffer},
+      heap_blocks{nullptr}, host{nullptr} {
+#ifdef DEBUG
+    debug = (void *)::debug;
+#endif
+}
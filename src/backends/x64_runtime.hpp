@@ -0,0 +1,69 @@
+#ifndef BACKENDS_X64_RUNTIME_HPP
+#define BACKENDS_X64_RUNTIME_HPP
+#include <util/types.h>
+
+/*
+ * Runtime state of jitted code, r14 points to it while the program runs.
+ * The generated code addresses fields by offsetof, so this has to stay a
+ * standard layout struct.
+ */
+/* bytes buffered by IN and OUT before going to read(2) and write(2) */
+const i64 x64_io_buffer = 1 << 16;
+
+struct x64_runtime {
+    x64_runtime(); /* fills in the C helpers, the heap starts empty */
+
+    /* C helpers, reached through external_c_call */
+    void *in;  /* slow path of IN, refills the input buffer */
+    void *out; /* slow path of OUT, flushes the output buffer */
+    void *halt;
+    void *err;
+    void *newarray; /* slow path of NEWARRAY */
+    void *debug;    /* only set in DEBUG builds */
+    void *compile;  /* compiles a function on its first call, see run() */
+    void *jit;      /* the X64Assembler that compile works on */
+
+    /* arrays are bump allocated from zeroed chunks */
+    i64 *heap_cur;
+    i64 *heap_end;
+
+    /* IN consumes [in_cur, in_end), OUT fills [out_cur, out_end) */
+    u8 *in_cur;
+    u8 *in_end;
+    u8 *out_cur;
+    u8 *out_end;
+    u8 in_buf[x64_io_buffer];
+    u8 out_buf[x64_io_buffer];
+
+    /* every chunk and large array, linked through their element 0 */
+    i64 *heap_blocks;
+    void *host; /* jmp_buf HALT and ERR return to, they exit() if null */
+};
+
+/* writes out whatever OUT buffered, called before the program exits */
+void x64_flush(x64_runtime *rt);
+
+/* refills the input buffer and returns its first char, 0 on EOF */
+u64 x64_fill(x64_runtime *rt);
+
+/* frees the heap and empties the buffers, for running the program again */
+void x64_reset(x64_runtime *rt);
+
+/*
+ * The helpers under C names. Relocatable objects (ij compile -f obj) import
+ * them, whatever links such an object in provides them, e.g. this file.
+ */
+extern "C" {
+u64 ij_in(x64_runtime *rt);
+void ij_out(i64 val, x64_runtime *rt);
+void ij_halt(x64_runtime *rt);
+void ij_err(x64_runtime *rt);
+i64 *ij_newarray(i64 size, x64_runtime *rt);
+void ij_flush(x64_runtime *rt);
+}
+
+/* arrays up to this many elements are carved out of the current chunk */
+const i64 x64_heap_bump_max = 4096;
+const i64 x64_heap_chunk = 1 << 17; /* elements per chunk, 1MiB */
+
+#endif
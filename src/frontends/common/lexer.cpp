@@ -125,7 +125,7 @@ std::string lexer_error::make_what(Source &c, std::string msg) {
 /*******************************************************************************
  * Lexer
  ******************************************************************************/
-Lexer::Lexer() {
+Lexer::Lexer() : lexed{0} {
     skip_list.clear();
     keywords.clear();
 }
@@ -146,6 +146,7 @@ void Lexer::read_token() {
             "lexer tried reading token but nothing left to parse"};
 
     Source &src = srcs.back();
+    lexed++;
 
     string sn = src.name;
     size_t ln = src.line;
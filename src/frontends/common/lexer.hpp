@@ -122,6 +122,8 @@ class Lexer {
     void expect(TokenType type, std::string value, bool rm = false);
     void expect(std::initializer_list<TokenType> types, bool rm = false);
 
+    size_t tokens_lexed() const { return lexed; } /* skipped ones included */
+
   private:
     bool has_symbol();
     void read_token(); /* reads token and appends to back of cache */
@@ -130,6 +132,7 @@ class Lexer {
     std::vector<Token> cache;
     std::set<TokenType> skip_list;
     std::set<std::string> keywords;
+    size_t lexed;
 };
 
 #endif
@@ -0,0 +1,566 @@
+#include "build_ir.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <util/util.hpp>
+
+/*
+ * The builder runs the function the way the AST compiler would emit it,
+ * except that the stack holds instructions instead of values and every
+ * block remembers the instructions last assigned to the locals in it.
+ * Reading a local a block didn't assign asks its predecessors, with a phi
+ * if there are several (Braun et al., Simple and Efficient Construction of
+ * SSA Form). Loop headers aren't sealed until the back edge exists, their
+ * phis get their operands then. Locals nobody reads never get a phi, and
+ * reads through a finished loop that never assigned the local go around
+ * it instead of through every loop nested in it.
+ */
+
+/* a jump whose target doesn't exist yet */
+struct pending_edge {
+    ir_instr *branch;
+    size_t target; /* index into branch->targets */
+};
+
+struct loop_edges {
+    vector<pending_edge> breaks, continues;
+};
+
+class IRBuilder {
+  public:
+    IRBuilder(const Function &fn,
+              const std::unordered_map<string, i32> &constants,
+              Assembler &a, ir_function &f);
+    void build();
+
+  private:
+    [[noreturn]] void unsupported(const string &why) const;
+
+    ir_instr *emit(ir_op op, vector<ir_instr *> operands = {}, i32 imm = 0);
+    void push(ir_instr *i) { _stack.push_back(i); }
+    vector<ir_instr *> pop(size_t n);
+    ir_instr *pop() { return pop(1)[0]; }
+
+    ir_instr *value(size_t local) { return read(local, _cur); }
+    void assign(size_t local, ir_instr *v);
+    i32 local(const string &name) const; /* -1 if it isn't one */
+
+    ir_instr *read(size_t local, ir_block *b);
+    ir_instr *read_preds(size_t local, ir_block *b);
+    bool assigned_in(size_t local, const ir_block *header) const;
+    ir_instr *phi(size_t local, ir_block *b);
+    void fill(ir_instr *phi);
+    void seal(ir_block *b);
+
+    ir_instr *terminate(ir_op op, vector<ir_instr *> operands = {},
+                        size_t targets = 0);
+    pending_edge take(ir_instr *branch, size_t target) {
+        return {branch, target};
+    }
+    pending_edge jump() { return take(terminate(ir_op::Jump, {}, 1), 0); }
+    ir_block *block(const string &name);
+    ir_block *join(const string &name, const vector<pending_edge> &edges,
+                   bool sealed = true);
+
+    void stmt(const Stmt *s);
+    void expr(const Expr *e);
+    void op(const OpExpr &e);
+    void jas(const JasStmt &s);
+    void if_stmt(const IfStmt &s);
+    void for_stmt(const ForStmt &s);
+    ir_instr *test(const Expr *condition, size_t &yes);
+
+    const Function &_fn;
+    const std::unordered_map<string, i32> &_constants;
+    Assembler &_a;
+    ir_function &_f;
+
+    std::unordered_map<string, size_t> _locals;
+    std::unordered_map<string, u32> _files;
+    vector<std::unordered_map<size_t, ir_instr *>> _defs; /* by block id */
+    vector<bool> _sealed;                                 /* by block id */
+    vector<vector<ir_instr *>> _incomplete; /* phis of unsealed blocks */
+    vector<ir_instr *> _initial;            /* by local, params and zero */
+    vector<vector<size_t>> _assigned; /* by local, when, in assign() calls */
+    vector<std::pair<size_t, size_t>> _span; /* by block id, ditto */
+    vector<ir_instr *> _stack;
+    vector<loop_edges> _loops; /* innermost last */
+    ir_block *_cur;            /* nullptr after a terminator */
+    u32 _file, _line;
+    size_t _forid, _ifid, _deadid, _assigns;
+};
+
+IRBuilder::IRBuilder(const Function &fn,
+                     const std::unordered_map<string, i32> &constants,
+                     Assembler &a, ir_function &f)
+    : _fn{fn}, _constants{constants}, _a{a}, _f{f}, _cur{nullptr}, _file{0},
+      _line{0}, _forid{0}, _ifid{0}, _deadid{0},
+      _assigns{0} {}
+
+void IRBuilder::unsupported(const string &why) const {
+    throw std::runtime_error{sprint("%s: %s", _fn.name, why)};
+}
+
+ir_instr *IRBuilder::emit(ir_op op, vector<ir_instr *> operands, i32 imm) {
+    ir_instr *i = _f.add(_cur, op, std::move(operands), imm);
+    i->file = _file;
+    i->line = _line;
+    return i;
+}
+
+vector<ir_instr *> IRBuilder::pop(size_t n) {
+    if (_stack.size() < n)
+        unsupported("pops more than it pushed");
+
+    vector<ir_instr *> values{_stack.end() - n, _stack.end()};
+    _stack.resize(_stack.size() - n);
+    return values;
+}
+
+void IRBuilder::assign(size_t local, ir_instr *v) {
+    _defs[_cur->id][local] = v;
+    _assigned[local].push_back(_assigns++);
+    if (v->var < 0 && v->op != ir_op::Const && v->op != ir_op::Ldc)
+        v->var = local;
+}
+
+i32 IRBuilder::local(const string &name) const {
+    auto it = _locals.find(name);
+    return it == _locals.end() ? -1 : it->second;
+}
+
+ir_instr *IRBuilder::terminate(ir_op op, vector<ir_instr *> operands,
+                               size_t targets) {
+    if (targets && !_stack.empty())
+        unsupported("leaves values on the stack across a jump");
+
+    ir_instr *t = emit(op, std::move(operands));
+    t->targets.resize(targets);
+    _stack.clear();
+    _cur = nullptr;
+    return t;
+}
+
+ir_instr *IRBuilder::read(size_t local, ir_block *b) {
+    auto it = _defs[b->id].find(local);
+    if (it == _defs[b->id].end())
+        return read_preds(local, b);
+
+    // phis dropped as trivial forward to what replaced them
+    while (it->second->forward)
+        it->second = it->second->forward;
+    return it->second;
+}
+
+ir_instr *IRBuilder::read_preds(size_t local, ir_block *b) {
+    ir_instr *v;
+    if (b == _f.entry()) {
+        v = _initial[local];
+    } else if (!_sealed[b->id]) {
+        v = phi(local, b);
+        _incomplete[b->id].push_back(v);
+    } else if (b->preds.empty()) {
+        v = _initial[local]; /* dead code */
+    } else if (b->preds.size() == 1) {
+        v = read(local, b->preds[0]);
+    } else if (b->loop_header && !assigned_in(local, b)) {
+        v = read(local, b->preds[0]); /* the way into the loop */
+    } else {
+        // the phi goes first, a loop through b reads it back
+        v = phi(local, b);
+        _defs[b->id][local] = v;
+        fill(v);
+        v = read(local, b);
+    }
+    _defs[b->id][local] = v;
+    return v;
+}
+
+/* whether the loop of a sealed header assigns local anywhere */
+bool IRBuilder::assigned_in(size_t local, const ir_block *header) const {
+    const vector<size_t> &when = _assigned[local];
+    auto it = std::lower_bound(when.begin(), when.end(),
+                               _span[header->id].first);
+    return it != when.end() && *it < _span[header->id].second;
+}
+
+/* an empty phi for local at the start of b */
+ir_instr *IRBuilder::phi(size_t local, ir_block *b) {
+    // from the back, a header can have many phis but little else yet
+    size_t at = b->instrs.size();
+    while (at && b->instrs[at - 1]->op != ir_op::Phi)
+        at--;
+
+    ir_instr *phi = _f.insert(b, at, ir_op::Phi);
+    phi->var = local;
+    phi->file = _file;
+    phi->line = _line;
+    return phi;
+}
+
+/* gives phi the local's value out of every predecessor */
+void IRBuilder::fill(ir_instr *phi) {
+    for (ir_block *p : phi->block->preds)
+        ir_add_operand(phi, read(phi->var, p));
+    ir_remove_trivial_phis({phi});
+}
+
+/* b has all its predecessors, its phis can look into them */
+void IRBuilder::seal(ir_block *b) {
+    _sealed[b->id] = true;
+    _span[b->id].second = _assigns;
+    for (ir_instr *phi : _incomplete[b->id])
+        fill(phi);
+    _incomplete[b->id].clear();
+}
+
+ir_block *IRBuilder::block(const string &name) {
+    _defs.emplace_back();
+    _sealed.push_back(false);
+    _incomplete.emplace_back();
+    _span.emplace_back(_assigns, _assigns);
+    return _f.add_block(name);
+}
+
+ir_block *IRBuilder::join(const string &name,
+                          const vector<pending_edge> &edges, bool sealed) {
+    if (edges.empty())
+        return _cur = nullptr;
+
+    ir_block *b = _cur = block(name);
+
+    for (const pending_edge &e : edges) {
+        e.branch->targets[e.target] = b;
+        ir_add_edge(e.branch->block, b);
+    }
+    if (sealed)
+        seal(b);
+    return b;
+}
+
+void IRBuilder::build() {
+    _f.name = _fn.name;
+    _f.args = _fn.args;
+    _files[""] = 0;
+
+    vector<string> vars = _fn.get_vars();
+    for (const string &name : _fn.args)
+        if (_locals.emplace(name, _f.locals.size()).second)
+            _f.locals.push_back(name);
+    for (const string &name : vars)
+        if (_locals.emplace(name, _f.locals.size()).second)
+            _f.locals.push_back(name);
+
+    _cur = block("entry");
+    _sealed[0] = true;
+    _initial.resize(_f.locals.size());
+    _assigned.resize(_f.locals.size());
+    for (size_t i = 0; i < _fn.args.size(); i++) {
+        ir_instr *param = emit(ir_op::Param, {}, i);
+        param->var = _locals[_fn.args[i]];
+        if (!_initial[param->var]) /* the first of a name */
+            _initial[param->var] = param;
+    }
+    ir_instr *zero = emit(ir_op::Const, {}, 0);
+    for (ir_instr *&v : _initial)
+        if (!v)
+            v = zero;
+
+    stmt(_fn.stmts);
+    if (_cur)
+        terminate(ir_op::End);
+
+    // trivial phis are only marked removed
+    ir_sweep(_f);
+
+#ifdef DEBUG
+    ir_verify(_f, "building");
+#endif
+}
+
+void IRBuilder::stmt(const Stmt *s) {
+    // code after a return, break or continue still has to compile
+    if (!_cur) {
+        _cur = block(sprint("dead%d", _deadid++));
+        _sealed[_cur->id] = true;
+    }
+
+    if (auto comp = dynamic_cast<const CompStmt *>(s)) {
+        for (const Stmt *sub : comp->stmts) {
+            if (sub->line) {
+                _file = _files.emplace(sub->file, _f.files.size()).first->second;
+                if (_file == _f.files.size())
+                    _f.files.push_back(sub->file);
+                _line = sub->line;
+            }
+            stmt(sub);
+        }
+    } else if (auto e = dynamic_cast<const ExprStmt *>(s)) {
+        expr(e->expr);
+
+        if (auto o = dynamic_cast<const OpExpr *>(e->expr))
+            if (!o->leaves_on_stack())
+                return;
+        if (e->pop)
+            pop();
+    } else if (auto var = dynamic_cast<const VarStmt *>(s)) {
+        expr(var->expr);
+        assign(local(var->identifier), pop());
+    } else if (auto ret = dynamic_cast<const RetStmt *>(s)) {
+        expr(ret->expr);
+        terminate(ir_op::Return, {pop()});
+    } else if (auto i = dynamic_cast<const IfStmt *>(s)) {
+        if_stmt(*i);
+    } else if (auto f = dynamic_cast<const ForStmt *>(s)) {
+        for_stmt(*f);
+    } else if (dynamic_cast<const BreakStmt *>(s)) {
+        if (_loops.empty())
+            unsupported("break outside for");
+        _loops.back().breaks.push_back(jump());
+    } else if (dynamic_cast<const ContinueStmt *>(s)) {
+        if (_loops.empty())
+            unsupported("continue outside for");
+        _loops.back().continues.push_back(jump());
+    } else if (auto j = dynamic_cast<const JasStmt *>(s)) {
+        jas(*j);
+    } else {
+        unsupported(sprint("no IR for %s", str(*s)));
+    }
+}
+
+void IRBuilder::jas(const JasStmt &s) {
+    switch (s.instr_type) {
+    case JasType::BIPUSH:
+        push(emit(ir_op::Const, {}, (i8)s.iarg0));
+        break;
+    case JasType::DUP: {
+        ir_instr *v = pop();
+        push(v);
+        push(v);
+        break;
+    }
+    case JasType::POP:
+        pop();
+        break;
+    case JasType::IN:
+        push(emit(ir_op::In));
+        break;
+    case JasType::OUT:
+        emit(ir_op::Out, {pop()});
+        break;
+    case JasType::NEWARRAY:
+        push(emit(ir_op::NewArray, {pop()}));
+        break;
+    case JasType::HALT:
+        terminate(ir_op::Halt);
+        break;
+    case JasType::ERR:
+        terminate(ir_op::Err);
+        break;
+    default:
+        unsupported("no IR for " + s.op);
+    }
+}
+
+static ir_op arithmetic(char op) {
+    // clang-format off
+    switch (op) {
+    case '+': return ir_op::Add;
+    case '-': return ir_op::Sub;
+    case '&': return ir_op::And;
+    default:  return ir_op::Or;
+    }
+    // clang-format on
+}
+
+void IRBuilder::expr(const Expr *e) {
+    if (auto v = dynamic_cast<const ValueExpr *>(e)) {
+        push(emit(ir_op::Const, {}, v->value));
+    } else if (auto id = dynamic_cast<const IdentExpr *>(e)) {
+        i32 l = local(id->identifier);
+        if (l >= 0) {
+            push(value(l));
+            return;
+        }
+
+        auto c = _constants.find(id->identifier);
+        if (!_a.is_constant(id->identifier) || c == _constants.end())
+            unsupported("Couldn't find reference to " + id->identifier);
+
+        ir_instr *ldc = emit(ir_op::Ldc, {}, c->second);
+        ldc->name = id->identifier;
+        push(ldc);
+    } else if (auto o = dynamic_cast<const OpExpr *>(e)) {
+        op(*o);
+    } else if (auto call = dynamic_cast<const FunExpr *>(e)) {
+        auto c = _constants.find("__OBJREF__");
+        ir_instr *objref = emit(ir_op::Ldc, {},
+                                c != _constants.end() ? c->second : 0x00d00d00);
+        objref->name = "__OBJREF__";
+        push(objref);
+
+        for (const Expr *arg : call->args)
+            expr(arg);
+
+        ir_instr *i = emit(ir_op::Call, pop(call->args.size() + 1));
+        i->name = call->fname;
+        push(i);
+    } else if (auto s = dynamic_cast<const StmtExpr *>(e)) {
+        stmt(s->stmt);
+    } else if (auto arr = dynamic_cast<const ArrAccessExpr *>(e)) {
+        expr(arr->index);
+        expr(arr->array);
+        push(emit(ir_op::Load, pop(2)));
+    } else {
+        unsupported(sprint("no IR for %s", str(*e)));
+    }
+}
+
+void IRBuilder::op(const OpExpr &e) {
+    auto id = dynamic_cast<const IdentExpr *>(e.left);
+    auto arr = dynamic_cast<const ArrAccessExpr *>(e.left);
+    i32 l = id ? local(id->identifier) : -1;
+
+    if (e.is_comparison())
+        unsupported("no support for " + e.op + " outside of conditionals");
+
+    if (e.op == "=" || in(e.op, {"+=", "-=", "&=", "|="})) {
+        bool update = e.op != "=";
+        if (id && l >= 0) {
+            if (update)
+                push(value(l));
+            expr(e.right);
+            assign(l, update ? emit(arithmetic(e.op[0]), pop(2)) : pop());
+        } else if (arr) {
+            if (update) {
+                expr(arr->index);
+                expr(arr->array);
+                push(emit(ir_op::Load, pop(2)));
+            }
+            expr(e.right);
+            if (update)
+                push(emit(arithmetic(e.op[0]), pop(2)));
+            expr(arr->index);
+            expr(arr->array);
+            emit(ir_op::Store, pop(3));
+        } else {
+            unsupported("only local variables and arrays can be assigned");
+        }
+    } else if (in(e.op, {"+", "-", "&", "|"})) {
+        expr(e.left);
+        expr(e.right);
+        push(emit(arithmetic(e.op[0]), pop(2)));
+    } else if (e.op == "*") {
+        auto left = dynamic_cast<const ValueExpr *>(e.left);
+        auto right = dynamic_cast<const ValueExpr *>(e.right);
+        if (!left && !right)
+            unsupported("multiplication only supported with constant");
+
+        expr(left ? e.right : e.left);
+        push(emit(ir_op::Mul, {pop()}, left ? left->value : right->value));
+    } else {
+        unsupported("unsupported operator found: " + e.op);
+    }
+}
+
+/* branches on condition, yes is the target it takes when it holds */
+ir_instr *IRBuilder::test(const Expr *condition, size_t &yes) {
+    auto con = dynamic_cast<const OpExpr *>(condition);
+    if (!con || !con->is_comparison()) {
+        expr(condition);
+        yes = 1;
+        return terminate(ir_op::IfEq, {pop()}, 2);
+    }
+
+    // the same order of evaluation as compile_comparison
+    bool swap = con->op == ">" || con->op == "<=";
+    expr(swap ? con->right : con->left);
+    expr(swap ? con->left : con->right);
+
+    if (con->op == "==" || con->op == "!=") {
+        yes = con->op == "!=";
+        return terminate(ir_op::IfCmpEq, pop(2), 2);
+    }
+
+    yes = con->op == ">=" || con->op == "<=";
+    push(emit(ir_op::Sub, pop(2)));
+    return terminate(ir_op::IfLt, {pop()}, 2);
+}
+
+void IRBuilder::if_stmt(const IfStmt &s) {
+    size_t id = _ifid++;
+
+    size_t yes;
+    ir_instr *branch = test(s.condition, yes);
+    pending_edge to_else = take(branch, 1 - yes);
+
+    vector<pending_edge> ends;
+    join(sprint("if%d_then", id), {take(branch, yes)});
+    stmt(s.thens);
+    if (_cur)
+        ends.push_back(jump());
+
+    if (s.elses->empty()) {
+        ends.push_back(to_else);
+    } else {
+        join(sprint("if%d_else", id), {to_else});
+        stmt(s.elses);
+        if (_cur)
+            ends.push_back(jump());
+    }
+
+    join(sprint("if%d_end", id), ends);
+}
+
+void IRBuilder::for_stmt(const ForStmt &s) {
+    size_t id = _forid++;
+    u32 file = _file, line = _line;
+
+    if (s.initial)
+        stmt(s.initial);
+    _file = file;
+    _line = line;
+
+    // sealed once the back edge is there
+    ir_block *header = join(sprint("for%d_condition", id), {jump()}, false);
+    header->loop_header = true;
+
+    // the condition and update run after the body, on the for's line
+    _loops.emplace_back();
+    if (s.condition) {
+        size_t yes;
+        ir_instr *branch = test(s.condition, yes);
+        _loops.back().breaks.push_back(take(branch, 1 - yes));
+        join(sprint("for%d_body", id), {take(branch, yes)});
+    } else {
+        join(sprint("for%d_body", id), {jump()});
+    }
+
+    stmt(s.body);
+    if (_cur)
+        _loops.back().continues.push_back(jump());
+
+    _file = file;
+    _line = line;
+    if (join(sprint("for%d_update", id), _loops.back().continues)) {
+        if (s.update)
+            expr(s.update);
+
+        ir_instr *back = terminate(ir_op::Jump, {}, 1);
+        back->targets[0] = header;
+        ir_add_edge(back->block, header);
+    }
+    seal(header);
+
+    vector<pending_edge> breaks = std::move(_loops.back().breaks);
+    _loops.pop_back();
+    join(sprint("for%d_end", id), breaks);
+}
+
+void build_ir(const Function &fn,
+              const std::unordered_map<std::string, i32> &constants,
+              Assembler &a, ir_function &f) {
+    if (fn.jas)
+        throw std::runtime_error{fn.name + " is jas"};
+
+    IRBuilder{fn, constants, a, f}.build();
+}
@@ -0,0 +1,19 @@
+#ifndef IJ_BUILD_IR_HPP
+#define IJ_BUILD_IR_HPP
+#include <string>
+#include <unordered_map>
+#include <backends/assembler.hpp>
+#include <ir/ir.hpp>
+#include "data.hpp"
+
+/*
+ * Builds the SSA form of an ij function, given the program's constants by
+ * name. Throws on whatever it can't express, which is anything Function::
+ * compile would reject, jas functions, and stack tricks ($push and $pop)
+ * that leave values on the stack across a jump. Those compile from the AST.
+ */
+void build_ir(const Function &fn,
+              const std::unordered_map<std::string, i32> &constants,
+              Assembler &a, ir_function &f);
+
+#endif
@@ -1,8 +1,14 @@
 #include "compile.hpp"
+#include "build_ir.hpp"
 #include "data.hpp"
+#include <algorithm>
 #include <memory>
+#include <unordered_map>
 #include <vector>
+#include <ir/lower.hpp>
+#include <ir/passes.hpp>
 #include <util/util.hpp>
+#include <util/stats.hpp>
 
 /*
  * Add default main, calling __main__, this is to avoid
@@ -18,11 +24,18 @@ static void add_main(Program &p) {
     p.funcs.insert(p.funcs.begin(), f);
 }
 
-static void prune(Program &p) {
+void prune(Program &p, bool library) {
     std::set<std::string> reachable_funcs;
     std::set<std::string> reachable_consts;
 
-    std::vector<const Function *> todo{p.funcs[0]};
+    // by name, the first of them like get_function
+    std::unordered_map<std::string, const Function *> functions;
+    for (const Function *f : p.funcs)
+        functions.emplace(f->name, f);
+
+    std::vector<const Function *> todo{p.funcs.begin(), p.funcs.end()};
+    if (!library)
+        todo.resize(1); /* main */
     std::vector<const Expr *> exprs{};
     std::vector<const Stmt *> stmts{};
 
@@ -36,21 +49,25 @@ static void prune(Program &p) {
         reachable_funcs.insert(f->name);
         todo.pop_back();
 
+        // has_var walks the whole function, once per identifier is too often
+        std::vector<std::string> var_list = f->get_vars();
+        std::set<std::string> vars{var_list.begin(), var_list.end()};
+
         f->stmts->statements(stmts);
 
         for (const Stmt *s : stmts) {
-            // log.info(" - Statement: %s", cstr(*s));
+            // log_info(" - Statement: %s", cstr(*s));
 
             if (const JasStmt *jas_stmt = dynamic_cast<const JasStmt *>(s)) {
                 if (jas_stmt->has_fun_arg()){
                     std::string fname = jas_stmt->arg0;
-                    option<const Function *> f = p.get_function(fname);
+                    auto f = functions.find(fname);
 
-                    if (!f.isset()) {
+                    if (f == functions.end()) {
                         log.panic("Couldnt find function of name '%s' even though it was mentioned", fname.c_str());
                     }
 
-                    todo.push_back(f);
+                    todo.push_back(f->second);
                 }
 
                 if (jas_stmt->has_const_arg()) {
@@ -64,17 +81,16 @@ static void prune(Program &p) {
 
         for (const Expr * e : exprs) {
             if (const FunExpr *fun_expr = dynamic_cast<const FunExpr *>(e)) {
-                option<const Function *> f = p.get_function(fun_expr->fname);
-                if (!f.isset()) {
+                auto f = functions.find(fun_expr->fname);
+                if (f == functions.end()) {
                     log.panic("Couldnt find function of name '%s' even though it was mentioned in func call", fun_expr->fname.c_str());
                 }
 
-                const Function *function = f;
-                todo.push_back(function);
+                todo.push_back(f->second);
             }
 
             if (const IdentExpr *ident_expr = dynamic_cast<const IdentExpr *>(e)) {
-                if (!f->has_var(ident_expr->identifier)) {
+                if (!contains(vars, ident_expr->identifier)) {
                     reachable_consts.insert(ident_expr->identifier);
                 }
             }
@@ -84,65 +100,119 @@ static void prune(Program &p) {
     }
 
     for (std::string s : reachable_funcs) {
-        log.info(" > Function %s is reachable", s.c_str());
+        log_info(" > Function %s is reachable", s.c_str());
     }
 
     for (std::string s : reachable_consts) {
-        log.info(" > Constant %s is reachable", s.c_str());
+        log_info(" > Constant %s is reachable", s.c_str());
     }
 
-    auto func_it = p.funcs.begin();
-    while (func_it != p.funcs.end()) {
-        Function *f = *func_it;
+    // erasing one at a time moves the rest of the vector every time
+    auto func_end = std::remove_if(p.funcs.begin(), p.funcs.end(), [&](Function *f) {
+        if (contains(reachable_funcs, f->name))
+            return false;
+
+        log_info(" > Function %s is not reachable ", f->name.c_str());
+        delete f;
+        return true;
+    });
+    p.funcs.erase(func_end, p.funcs.end());
+
+    auto const_end = std::remove_if(p.consts.begin(), p.consts.end(), [&](Constant *c) {
+        if (contains(reachable_consts, c->name))
+            return false;
+
+        log_info(" > Constant %s is not reachable ", c->name.c_str());
+        delete c;
+        return true;
+    });
+    p.consts.erase(const_end, p.consts.end());
+}
 
-        if (!contains(reachable_funcs, f->name)) {
-            log.info(" > Function %s is not reachable ", f->name.c_str());
-            delete f;
-            p.funcs.erase(func_it);
-        }
-        else {
-            func_it++;
-        }
-    }
 
-    auto const_it = p.consts.begin();
-    while (const_it != p.consts.end()) {
-        Constant *c = *const_it;
 
-        if (!contains(reachable_consts, c->name)) {
-            log.info(" > Constant %s is not reachable ", c->name.c_str());
-            delete c;
-            p.consts.erase(const_it);
-        }
-        else {
-            const_it++;
-        }
+/* statements and expressions, for --stats */
+static size_t ast_nodes(const Program &p) {
+    std::vector<const Stmt *> stmts;
+    std::vector<const Expr *> exprs;
+    for (const Function *f : p.funcs) {
+        f->stmts->statements(stmts);
+        f->stmts->expressions(exprs);
     }
+    return stmts.size() + exprs.size() + p.consts.size();
 }
 
+/* through the IR, false if f has to compile from the AST instead */
+static bool compile_ir(const Function &f,
+                       const std::unordered_map<std::string, i32> &constants,
+                       const PassManager &passes, bool iinc, Assembler &a) {
+    ir_function ir;
+    try {
+        Phase phase{"build ir", f.name};
+        build_ir(f, constants, a, ir);
+    } catch (std::exception &e) {
+        log_info("no IR for %s, %s", f.name.c_str(), e.what());
+        return false;
+    }
 
+    passes.run(ir);
+    log_info("IR of %s", cstr(ir));
+
+    Phase phase{"lower", f.name};
+    ir_lower(ir, a, iinc);
+    return true;
+}
 
-void ij_compile(Lexer &l, Assembler &a) {
-    std::unique_ptr<Program> p{parse_program(l)};
-    add_main(*p);
-    prune(*p);
+void ij_compile(Lexer &l, Assembler &a, const Optimizations &opt) {
+    std::unique_ptr<Program> p;
+    {
+        Phase phase{"parse"};
+        p.reset(parse_program(l));
+    }
+    p->opt = opt;
+    log_info("optimizations %s", opt.str().c_str());
+    if (stats.enabled())
+        stats.count("ast nodes", ast_nodes(*p));
+
+    // a library doesn't need an entry point
+    if (!a.is_library() || p->get_function("__main__").isset())
+        add_main(*p);
+
+    size_t functions = p->funcs.size();
+    if (opt["prune"]) {
+        Phase phase{"prune"};
+        prune(*p, a.is_library());
+    }
+    stats.count("functions", p->funcs.size());
+    stats.count("functions pruned", functions - p->funcs.size());
 
-    log.info("constants %lu", p->consts.size());
+    log_info("constants %lu", p->consts.size());
+    std::unordered_map<std::string, i32> constants;
     for (auto c : p->consts) {
-        log.info("    - %s", cstr(*c));
+        log_info("    - %s", cstr(*c));
         a.constant(c->name, c->value);
+        constants[c->name] = c->value;
     }
 
-    log.info("functions %lu", p->funcs.size());
+    log_info("functions %lu", p->funcs.size());
     for (auto f : p->funcs)
-        log.info("function: %s", cstr(*f));
+        log_info("function: %s", cstr(*f));
 
+    Phase phase{"compile"};
+    PassManager passes = opt.passes();
+    size_t from_ast = 0;
     for (auto fiter : p->funcs) {
-        log.info("Compiling function %s", fiter->name.c_str());
-        fiter->compile(*p, a);
+        log_info("Compiling function %s", fiter->name.c_str());
+        Phase function{"compile", fiter->name};
+        if (!opt["ir"] ||
+            !compile_ir(*fiter, constants, passes, opt["iinc"], a)) {
+            fiter->compile(*p, a);
+            from_ast++;
+        }
     }
+    stats.count("functions compiled from the AST", from_ast);
 
-    log.success("Successfully compiled program");
+    log_success("Successfully compiled program");
 }
 
 static void compile_arit_op(char op, Assembler &a) {
@@ -191,7 +261,8 @@ void OpExpr::compile(Program &p, Assembler &a, id_gen &g) const {
                     "only local variables can be reassigned"};
 
             // if value is constant and representable as i8, use iinc
-            if (ValueExpr *val = dynamic_cast<ValueExpr *>(right)) {
+            ValueExpr *val = dynamic_cast<ValueExpr *>(right);
+            if (val && p.opt["iinc"]) {
                 i32 value = op[0] == '-' ? -val->value : val->value;
 
                 if ((op[0] == '+' || op[0] == '-') && value > -128 &&
@@ -223,7 +294,7 @@ void OpExpr::compile(Program &p, Assembler &a, id_gen &g) const {
         right->compile(p, a, g);
         compile_arit_op(op[0], a);
     } else if (op == "*") {
-        log.info("Special IMUL case triggered");
+        log_info("Special IMUL case triggered");
         if (ValueExpr *val = dynamic_cast<ValueExpr *>(left)) {
             right->compile(p, a, g);
             a.IMUL(val->value);
@@ -231,7 +302,7 @@ void OpExpr::compile(Program &p, Assembler &a, id_gen &g) const {
             left->compile(p, a, g);
             a.IMUL(val->value);
         } else {
-            log.info("neither is constant");
+            log_info("neither is constant");
             throw std::runtime_error{sprint("multiplication only supported with constant, expression: %s", str(*this))};
         }
     } else {
@@ -274,8 +345,11 @@ void ArrAccessExpr::compile(Program &p, Assembler &a, id_gen &g) const {
 }
 
 void CompStmt::compile(Program &p, Assembler &a, id_gen &gen) const {
-    for (auto s : stmts)
+    for (auto s : stmts) {
+        if (s->line)
+            a.line(s->file, s->line);
         s->compile(p, a, gen);
+    }
 }
 
 void ExprStmt::compile(Program &p, Assembler &a, id_gen &g) const {
@@ -336,7 +410,7 @@ static void compile_comparison(Program &p, Assembler &a, id_gen &g, OpExpr *con,
         a.ICMPEQ(if_false);
         a.GOTO(if_true);
     } else {
-        log.info("operator '%s'", con->op.c_str());
+        log_info("operator '%s'", con->op.c_str());
         throw std::runtime_error{"if didn't implement all comparisons yet"};
     }
 }
@@ -354,7 +428,10 @@ void ForStmt::compile(Program &p, Assembler &a, id_gen &gen) const {
     if (initial != nullptr)
         initial->compile(p, a, gen);
 
+    // the condition and update run after the body, on the for's line
     a.label(for_condition);
+    if (line)
+        a.line(file, line);
     if (OpExpr *con = dynamic_cast<OpExpr *>(condition)) {
         if (con->is_comparison())
             compile_comparison(p, a, gen, con, for_body, for_end);
@@ -371,14 +448,17 @@ void ForStmt::compile(Program &p, Assembler &a, id_gen &gen) const {
     body->compile(p, a, gen);
 
     a.label(for_update);
+    if (line)
+        a.line(file, line);
     if (update != nullptr)
         update->compile(p, a, gen);
     a.GOTO(for_condition);
     a.label(for_end);
+    gen.end_for();
 }
 
 void IfStmt::compile(Program &p, Assembler &a, id_gen &gen) const {
-    option<i32> cond_val = condition->val();
+    option<i32> cond_val = p.opt["fold"] ? condition->val() : option<i32>();
 
     if (cond_val.isset()) {
         if (condition->has_side_effects(p)) {
@@ -8,6 +8,10 @@
 #include "parse.hpp"
 
 /* compiles ij */
-void ij_compile(Lexer &l, Assembler &a);
+void ij_compile(Lexer &l, Assembler &a,
+                const Optimizations &opt = Optimizations{});
+
+/* drops what main can't reach, a library keeps every function */
+void prune(Program &p, bool library);
 
 #endif
\ No newline at end of file
@@ -205,19 +205,22 @@ option<i32> OpExpr::val() const {
     i32 left = l;
     i32 right = r;
 
-    if (leaves_on_stack())
+    if (!leaves_on_stack() && !is_comparison())
         log.panic("Trying to get value from non-returning update");
 
+    // wrapping around like the machines do
+    u32 l32 = left, r32 = right;
+
     // clang-format off
     if (op == "==")         return left == right;
     else if (op == "<=")    return left <= right;
     else if (op == "<")     return left <  right;
     else if (op == ">")     return left >  right;
     else if (op == ">=")    return left >= right;
-    else if (op == "+")     return left +  right;
-    else if (op == "-")     return left -  right;
+    else if (op == "+")     return (i32)(l32 + r32);
+    else if (op == "-")     return (i32)(l32 - r32);
     else if (op == "|")     return left |  right;
-    else if (op == "*")     return left *  right;
+    else if (op == "*")     return (i32)(l32 * r32);
     else if (op == "&")     return left &  right;
 
     throw std::runtime_error{"unsupported operator in OpExpr"};
@@ -35,6 +35,7 @@
 #include <iostream>
 
 #include <backends/assembler.hpp>
+#include <ir/passes.hpp>
 #include <util/logger.hpp>
 #include <util/util.hpp>
 
@@ -56,10 +57,16 @@ std::ostream &operator<<(std::ostream &o, const Constant &c);
 
 struct id_gen {
     inline id_gen() : forid{0}, ifid{0} {}
-    inline ssize_t last_for() { return forid - 1; }
-    inline ssize_t gfor() { return forid++; }
+    /* the innermost for being compiled, -1 outside of any */
+    inline ssize_t last_for() { return fors.empty() ? -1 : fors.back(); }
+    inline ssize_t gfor() {
+        fors.push_back(forid);
+        return forid++;
+    }
+    inline void end_for() { fors.pop_back(); }
     inline ssize_t gif() { return ifid++; }
     ssize_t forid, ifid;
+    std::vector<ssize_t> fors;
 };
 
 struct Expr {
@@ -72,6 +79,10 @@ struct Expr {
     virtual void expressions(std::vector<const Expr *> &expressions) const;
 
     virtual option<i32> val() const; /* returns the value, if const */
+
+    /* where it was parsed, line 0 if the compiler made it up */
+    std::string file;
+    size_t line = 0;
 };
 inline void Expr::statements(std::vector<const Stmt *> &) const {
 
@@ -175,6 +186,10 @@ struct Stmt {
     virtual void statements(std::vector<const Stmt *> &stmts) const;
 
     virtual ~Stmt() = 0;
+
+    /* where it was parsed, line 0 if the compiler made it up */
+    std::string file;
+    size_t line = 0;
 };
 inline Stmt::~Stmt() {}
 void inline Stmt::statements(std::vector<const Stmt *> &stmts) const {
@@ -369,7 +384,7 @@ struct Function {
     }
 
     inline ~Function() {
-        log.info("Function %s is being deleted", name.c_str());
+        log_info("Function %s is being deleted", name.c_str());
         delete stmts;
     }
 
@@ -395,6 +410,7 @@ struct Program {
 
     std::vector<Function *> funcs;
     std::vector<Constant *> consts;
+    Optimizations opt; /* what compiling may do */
 
     void compile(Assembler &a) const;
     option<const Function *> get_function(std::string name) const;
@@ -6,18 +6,29 @@
 #include <util/logger.hpp>
 #include <util/util.hpp>
 
-/* High level functions */
-Program *parse_program(Lexer &l) {
-    Program *res = new Program();
-    std::set<std::string> constants{{"main"}};
-    std::set<std::string> imports;
+/* tags a node with the position of its first token */
+template <typename Node> static Node *located(Node *node, const Token &start) {
+    node->file = start.name;
+    node->line = start.line;
+    return node;
+}
 
+/* High level functions */
+void setup_lexer(Lexer &l) {
     l.set_skip({TokenType::Whitespace, TokenType::Nl, TokenType::Comment});
     l.set_keywords({"constant", "function", "import","var",   "for",
                     "while",    "if",       "else",  "label", "jas",
                     "break",    "continue", "return",   "$getc", "$putc",
                     "$print",   "$puts",    "$halt",    "$err",  "$malloc",
                     "$push",    "$pop"});
+}
+
+Program *parse_program(Lexer &l) {
+    Program *res = new Program();
+    std::set<std::string> constants{{"main"}};
+    std::set<std::string> imports;
+
+    setup_lexer(l);
 
     while (l.has_token()) {
         l.expect(TokenType::Keyword, {"function", "constant", "import"});
@@ -89,14 +100,16 @@ static CompStmt *parse_jas_block(Lexer &l) {
     std::vector<Stmt *> stmts;
 
     while (!l.is_next(TokenType::CurlyClose)) {
+        Token start = l.peek();
+
         if (l.is_next(TokenType::SemiColon))
             l.discard();
         else if (l.is_next(TokenType::Keyword, "var"))
-            stmts.push_back(parse_var_stmt(l));
+            stmts.push_back(located(parse_var_stmt(l), start));
         else if (l.is_next(TokenType::Keyword, "label"))
-            stmts.push_back(parse_label_stmt(l));
+            stmts.push_back(located(parse_label_stmt(l), start));
         else
-            stmts.push_back(parse_jas_stmt(l));
+            stmts.push_back(located(parse_jas_stmt(l), start));
     }
 
     l.expect(TokenType::CurlyClose, true);
@@ -181,8 +194,7 @@ static Stmt *parse_stop(Lexer &l) {
 }
 
 /* Functions have statements */
-Stmt *parse_statement(Lexer &l) /* delegates to types of statements */
-{
+static Stmt *parse_any_statement(Lexer &l) {
     if (l.is_next(TokenType::Keyword, "for"))
         return parse_for_stmt(l);
 
@@ -225,6 +237,12 @@ Stmt *parse_statement(Lexer &l) /* delegates to types of statements */
     return s;
 }
 
+Stmt *parse_statement(Lexer &l) /* delegates to types of statements */
+{
+    Token start = l.peek();
+    return located(parse_any_statement(l), start);
+}
+
 Stmt *parse_expr_stmt(Lexer &l, bool pop) /* e.g. f(1, 2, 3);   */
 {
     return new ExprStmt(parse_expr(l), pop);
@@ -327,12 +345,12 @@ Stmt *parse_continue_stmt(Lexer &l) /* e.g. continue */
 
 Stmt *parse_label_stmt(Lexer &l) /* e.g. label <name>: */
 {
-    log.info("Found label");
+    log_info("Found label");
 
     l.discard(); /* discard 'label' */
     std::string label_name = l.get().value;
 
-    log.info("Label name %s", label_name.c_str());
+    log_info("Label name %s", label_name.c_str());
     l.expect(TokenType::Colon, true);
     return new LabelStmt{label_name};
 }
@@ -361,13 +379,14 @@ Stmt *parse_jas_stmt(Lexer &l) /* e.g. INVOKEVIRTUAL func */
 /* Statements usually have expressions */
 Expr *parse_expr(Lexer &l) /* delegates to types of statements */
 {
-    Expr *left = parse_compare_expr(l);
+    Token start = l.peek();
+    Expr *left = located(parse_compare_expr(l), start);
 
     while (l.is_next(TokenType::Operator, {"=", "+=", "-=", "&=", "|="})) {
         std::string op = l.peek().value;
         l.discard();
 
-        left = new OpExpr(op, left, parse_compare_expr(l));
+        left = located(new OpExpr(op, left, parse_compare_expr(l)), start);
     }
 
     return left;
@@ -510,7 +529,7 @@ Expr *parse_basic_expr(Lexer &l) /* e.g. a, 2, (1 + 3), f(1) */
     }
 
     if (minus) {
-        log.info("Unary minus detected, negating value");
+        log_info("Unary minus detected, negating value");
 
         if (ValueExpr *v = dynamic_cast<ValueExpr *>(res))
             v->value *= -1;
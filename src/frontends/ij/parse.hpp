@@ -6,6 +6,7 @@
 #include <frontends/common/parse_error.hpp>
 
 /* High level functions */
+void setup_lexer(Lexer &l); /* ij's keywords, skips whitespace and comments */
 Program *parse_program(Lexer &l);
 Constant *parse_constant(Lexer &l);
 Function *parse_function(Lexer &l);
@@ -36,7 +36,7 @@ static i32 ijvm_main_local_count(Buffer::Reader r) {
         while (r.has_next<u8>()) {
             size_t offset = r.position();
             if (contains(visited, offset)) {
-                log.info("Already visited offset %d", offset);
+                log_info("Already visited offset %d", offset);
                 break;
             }
             visited.insert(offset);
@@ -47,7 +47,7 @@ static i32 ijvm_main_local_count(Buffer::Reader r) {
 
             // handle wide case
             while (o == opcode::WIDE) {
-                log.info("Opcode wide");
+                log_info("Opcode wide");
                 wide = true;
 
                 raw = r.read<u8>();
@@ -56,37 +56,37 @@ static i32 ijvm_main_local_count(Buffer::Reader r) {
 
             if (has_var_arg(o)) {
                 u16 var_index = read_wide(r, wide);
-                log.info("Opcode Var (var=%d) {wide=%s}", var_index, wide ? "true" : "false");
+                log_info("Opcode Var (var=%d) {wide=%s}", var_index, wide ? "true" : "false");
                 var_count = max(var_count, var_index + 1);
 
                 if (o == opcode::IINC)
                     r.read<u8>();
             }
             else if (is_final(o)){
-                log.info("Opcode Final");
+                log_info("Opcode Final");
 
                 break;
             }
             else if (in(o, {opcode::LDC_W, opcode::INVOKEVIRTUAL})) {
-                log.info("Opcode LDC/INVOKE");
+                log_info("Opcode LDC/INVOKE");
                 r.read<u16>();
             }
             else if (o == opcode::BIPUSH) {
                 u8 arg = r.read<u8>();
-                log.info("Opcode Bipush %d", arg);
+                log_info("Opcode Bipush %d", arg);
             }
             else if (has_jmp_arg(o)) {
-                log.info("Opcode Jmp");
+                log_info("Opcode Jmp");
                 todo.push_back(offset + r.read<i16>(Endian::Big));
 
                 if (o == opcode::GOTO)
                     break;
             }
             else if (o == opcode::INVALID) {
-                log.info("Main contains unknown opcode %x", o);
+                log_info("Main contains unknown opcode %x", o);
             }
             else {
-                log.info("Opcode Stack");
+                log_info("Opcode Stack");
             }
         }
     }
@@ -117,7 +117,7 @@ void ijvm_compile_method(Buffer::Reader &r, std::string name, u16 nargs, u16 nva
     std::set<size_t> visited;
     bool is_main = name == "main";
 
-    log.info("creating func with %d args and %d vars", nargs, nvars);
+    log_info("creating func with %d args and %d vars", nargs, nvars);
     std::vector<std::string> args;
     for (u32 i = 0; i < nargs; i++) {
         args.emplace_back(sprint("arg_%d", i));
@@ -127,18 +127,22 @@ void ijvm_compile_method(Buffer::Reader &r, std::string name, u16 nargs, u16 nva
         variables.emplace_back(sprint("lvar_%d", i));
     }
     a.function(name, args, variables);
-    log.info("function signature for %s created", name.c_str());
+    log_info("function signature for %s created", name.c_str());
 
     while (!todo.empty()) {
         r.seek(pop(todo));
-        log.info("starting point %d", r.position());
+        size_t start = r.position();
+        log_info("starting point %d", start);
 
         while (r.has_next<u8>()) {
-            log.info("reading from %d", r.position());
+            log_info("reading from %d", r.position());
 
             size_t offset = r.position();
             if (contains(visited, offset)) {
-                log.info("Already visited offset %d", offset);
+                log_info("Already visited offset %d", offset);
+                // that code was emitted elsewhere, fall through into it
+                if (offset != start)
+                    a.GOTO(sprint("loc_%04x", offset));
                 goto stop_reading;
             }
             visited.insert(offset);
@@ -146,13 +150,12 @@ void ijvm_compile_method(Buffer::Reader &r, std::string name, u16 nargs, u16 nva
             a.label(sprint("loc_%04x", offset));
             u8 raw = r.read<u8>();
             opcode code = opcode_parse(raw);
-            log.info("read op %#x", raw);
+            log_info("read op %#x", raw);
 
             bool wide = false;
             while (code == opcode::WIDE) {
-                a.WIDE();
                 wide = true;
-                // log.info("extra wide");
+                code = opcode_parse(r.read<u8>());
             }
 
             switch (code) {
@@ -221,7 +224,7 @@ void ijvm_compile_method(Buffer::Reader &r, std::string name, u16 nargs, u16 nva
                 }
                 case opcode::ICMPEQ:{
                     size_t jump_target = offset + r.read<i16>(Endian::Big);
-                    a.ICMPEQ(sprint("loc_%x", jump_target));
+                    a.ICMPEQ(sprint("loc_%04x", jump_target));
                     todo.push_back(jump_target);
                     break;
                 }
@@ -234,7 +237,7 @@ void ijvm_compile_method(Buffer::Reader &r, std::string name, u16 nargs, u16 nva
 
         log.panic("Didn't have a next? Trailing program!");
 
-        stop_reading: log.info("end of linear trail, now checking GOTO targets");
+        stop_reading: log_info("end of linear trail, now checking GOTO targets");
     }
 }
 
@@ -249,7 +252,7 @@ void ijvm_compile(Buffer &b, Assembler &a)
 
     reader.read<i32>(); // const pool address
     u32 const_size = reader.read<i32>(Endian::Big);
-    log.info("There are %d constants", const_size / 4);
+    log_info("There are %d constants", const_size / 4);
 
     std::vector<i32> constants;
     for (u32 i = 0; i < const_size / 4; i++) {
@@ -263,7 +266,7 @@ void ijvm_compile(Buffer &b, Assembler &a)
     Buffer text{b, reader.position(), reader.position() + text_size};
 
     i32 i = ijvm_main_local_count(text.readinator());
-    log.info("IJVM analysis yielded %d local vars", i);
+    log_info("IJVM analysis yielded %d local vars", i);
 
     std::vector<size_t> funcs;
     Buffer::Reader program_reader = text.readinator();
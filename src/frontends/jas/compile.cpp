@@ -129,9 +129,9 @@ static void parse_method(Lexer &l, Assembler &a)
     // parse .var block
     parse_optional_vars(l, vars);
 
-    log.info("name: %s", name.c_str());
-    log.info("args: %s", cstr(join(", ", args)));
-    log.info("vars: %s", cstr(join(", ", vars)));
+    log_info("name: %s", name.c_str());
+    log_info("args: %s", cstr(join(", ", args)));
+    log_info("vars: %s", cstr(join(", ", vars)));
     a.function(name, args, vars);
 
     while (l.is_next(TokenType::Identifier) || l.is_next(TokenType::Keyword)){
@@ -155,7 +155,7 @@ static void parse_method(Lexer &l, Assembler &a)
     else
         l.expect(TokenType::Keyword, "method", true);
 
-    log.success("Successfully parsed method %s", name.c_str());
+    log_success("Successfully parsed method %s", name.c_str());
 }
 
 void jas_compile(Lexer &l, Assembler &a)
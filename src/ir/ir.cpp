@@ -0,0 +1,356 @@
+#include "ir.hpp"
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <util/logger.hpp>
+#include <util/util.hpp>
+
+ir_block *ir_function::add_block(const string &name) {
+    blocks.emplace_back(new ir_block{(u32)blocks.size(), name, {}, {}, false});
+    return blocks.back().get();
+}
+
+ir_instr *ir_function::add(ir_block *b, ir_op op, vector<ir_instr *> operands,
+                           i32 imm) {
+    return insert(b, b->instrs.size(), op, std::move(operands), imm);
+}
+
+ir_instr *ir_function::insert(ir_block *b, size_t at, ir_op op,
+                              vector<ir_instr *> operands, i32 imm) {
+    ir_instr *i = new ir_instr{op,    (u32)instrs.size(), imm, "", b, {}, {},
+                               {},    -1, 0, 0, false, nullptr};
+    instrs.emplace_back(i);
+
+    i->operands = std::move(operands);
+    for (ir_instr *o : i->operands)
+        o->users.push_back(i);
+
+    b->instrs.insert(b->instrs.begin() + at, i);
+    return i;
+}
+
+bool ir_has_value(ir_op op) { return op < ir_op::Store; }
+
+bool ir_has_effects(ir_op op) {
+    switch (op) {
+    case ir_op::Call:
+    case ir_op::In:
+    case ir_op::NewArray:
+    case ir_op::Load: /* ERR when out of bounds */
+        return true;
+    default:
+        return op >= ir_op::Store;
+    }
+}
+
+bool ir_is_terminator(ir_op op) { return op >= ir_op::Jump; }
+
+const char *ir_name(ir_op op) {
+    // clang-format off
+    switch (op) {
+    case ir_op::Param:    return "param";
+    case ir_op::Const:    return "const";
+    case ir_op::Ldc:      return "ldc";
+    case ir_op::Phi:      return "phi";
+    case ir_op::Add:      return "add";
+    case ir_op::Sub:      return "sub";
+    case ir_op::And:      return "and";
+    case ir_op::Or:       return "or";
+    case ir_op::Mul:      return "mul";
+    case ir_op::Call:     return "call";
+    case ir_op::In:       return "in";
+    case ir_op::NewArray: return "newarray";
+    case ir_op::Load:     return "load";
+    case ir_op::Store:    return "store";
+    case ir_op::Out:      return "out";
+    case ir_op::Jump:     return "jump";
+    case ir_op::IfLt:     return "iflt";
+    case ir_op::IfEq:     return "ifeq";
+    case ir_op::IfCmpEq:  return "ificmpeq";
+    case ir_op::Return:   return "return";
+    case ir_op::Halt:     return "halt";
+    case ir_op::Err:      return "err";
+    case ir_op::End:      return "end";
+    }
+    // clang-format on
+    return "?";
+}
+
+bool ir_constant(const ir_instr *i, i32 &value) {
+    if (i->op != ir_op::Const && i->op != ir_op::Ldc)
+        return false;
+
+    value = i->imm;
+    return true;
+}
+
+/* takes one use of o by i away */
+static void drop_use(ir_instr *o, ir_instr *i) {
+    auto it = std::find(o->users.begin(), o->users.end(), i);
+    if (it == o->users.end())
+        log.panic("ir: %%%d doesn't know it is used by %%%d", o->id, i->id);
+    *it = o->users.back();
+    o->users.pop_back();
+}
+
+void ir_replace(ir_instr *old, ir_instr *with) {
+    for (ir_instr *u : old->users) {
+        for (ir_instr *&o : u->operands)
+            if (o == old)
+                o = with;
+        with->users.push_back(u);
+    }
+    old->users.clear();
+    old->forward = with;
+    ir_remove(old);
+}
+
+void ir_remove(ir_instr *i) {
+    ir_drop_operands(i);
+    i->dead = true;
+}
+
+void ir_drop_operands(ir_instr *i) {
+    for (ir_instr *o : i->operands)
+        drop_use(o, i);
+    i->operands.clear();
+}
+
+void ir_set_operand(ir_instr *i, size_t n, ir_instr *with) {
+    drop_use(i->operands[n], i);
+    i->operands[n] = with;
+    with->users.push_back(i);
+}
+
+void ir_add_operand(ir_instr *i, ir_instr *o) {
+    i->operands.push_back(o);
+    o->users.push_back(i);
+}
+
+void ir_add_edge(ir_block *from, ir_block *to) { to->preds.push_back(from); }
+
+void ir_remove_pred(ir_block *to, size_t index) {
+    to->preds.erase(to->preds.begin() + index);
+
+    for (ir_instr *phi : to->instrs) {
+        if (phi->op != ir_op::Phi)
+            break;
+        if (phi->dead)
+            continue;
+        drop_use(phi->operands[index], phi);
+        phi->operands.erase(phi->operands.begin() + index);
+    }
+}
+
+/* the only value phi takes other than itself, nullptr if there are more */
+static ir_instr *trivial_value(const ir_instr *phi) {
+    ir_instr *value = nullptr;
+    for (ir_instr *o : phi->operands) {
+        if (o == phi || o == value)
+            continue;
+        if (value)
+            return nullptr;
+        value = o;
+    }
+    return value;
+}
+
+bool ir_remove_trivial_phis(vector<ir_instr *> phis) {
+    bool removed = false;
+    while (!phis.empty()) {
+        ir_instr *phi = phis.back();
+        phis.pop_back();
+        if (phi->dead)
+            continue;
+
+        ir_instr *value = trivial_value(phi);
+        if (!value)
+            continue;
+
+        for (ir_instr *u : phi->users)
+            if (u->op == ir_op::Phi && u != phi)
+                phis.push_back(u);
+        if (value->var < 0)
+            value->var = phi->var;
+        ir_replace(phi, value);
+        removed = true;
+    }
+    return removed;
+}
+
+void ir_sweep(ir_function &f) {
+    for (auto &b : f.blocks)
+        b->instrs.erase(std::remove_if(b->instrs.begin(), b->instrs.end(),
+                                       [](ir_instr *i) { return i->dead; }),
+                        b->instrs.end());
+}
+
+bool ir_remove_unreachable(ir_function &f) {
+    std::unordered_set<const ir_block *> reached{f.entry()};
+    vector<ir_block *> todo{f.entry()};
+    while (!todo.empty()) {
+        ir_block *b = todo.back();
+        todo.pop_back();
+        for (ir_block *s : b->succs())
+            if (reached.insert(s).second)
+                todo.push_back(s);
+    }
+
+    if (reached.size() == f.blocks.size())
+        return false;
+
+    // first the edges into what stays, then whatever the dropped blocks use
+    for (auto &b : f.blocks) {
+        if (reached.count(b.get()))
+            continue;
+        for (ir_block *s : b->succs()) {
+            if (!reached.count(s))
+                continue;
+            for (size_t i = s->preds.size(); i-- > 0;)
+                if (s->preds[i] == b.get())
+                    ir_remove_pred(s, i);
+        }
+    }
+    for (auto &b : f.blocks) {
+        if (reached.count(b.get()))
+            continue;
+        for (ir_instr *i : b->instrs) {
+            for (ir_instr *o : i->operands)
+                if (reached.count(o->block))
+                    drop_use(o, i);
+            i->operands.clear();
+            i->users.clear();
+            i->dead = true;
+            i->block = nullptr;
+        }
+    }
+
+    f.blocks.erase(std::remove_if(f.blocks.begin(), f.blocks.end(),
+                                  [&](const std::unique_ptr<ir_block> &b) {
+                                      return !reached.count(b.get());
+                                  }),
+                   f.blocks.end());
+    return true;
+}
+
+size_t ir_count(const ir_function &f) {
+    size_t n = 0;
+    for (auto &b : f.blocks)
+        for (ir_instr *i : b->instrs)
+            n += !i->dead;
+    return n;
+}
+
+void ir_verify(const ir_function &f, const char *after) {
+    auto fail = [&](const char *what, u32 id) {
+        log.panic("ir: after %s, %%%d in %s %s", after, id, f.name.c_str(),
+                  what);
+    };
+
+    std::unordered_map<const ir_block *, bool> in_function;
+    for (auto &b : f.blocks)
+        in_function[b.get()] = true;
+
+    if (!f.entry()->preds.empty())
+        fail("the entry has predecessors", f.entry()->instrs[0]->id);
+
+    // operands minus users per pair, counting per value is quadratic
+    std::map<std::pair<const ir_instr *, const ir_instr *>, long> uses;
+
+    for (auto &b : f.blocks) {
+        if (b->instrs.empty())
+            log.panic("ir: after %s, block %s of %s is empty", after,
+                      b->name.c_str(), f.name.c_str());
+
+        std::unordered_map<const ir_instr *, size_t> position;
+        for (size_t n = 0; n < b->instrs.size(); n++) {
+            ir_instr *i = b->instrs[n];
+            position[i] = n;
+
+            if (i->dead)
+                fail("removed but still in its block", i->id);
+            if (i->block != b.get())
+                fail("is in another block than it thinks", i->id);
+            if (ir_is_terminator(i->op) != (n + 1 == b->instrs.size()))
+                fail("terminators go last, and only there", i->id);
+            if (i->op == ir_op::Phi) {
+                if (n && b->instrs[n - 1]->op != ir_op::Phi)
+                    fail("phis go first", i->id);
+                if (i->operands.size() != b->preds.size())
+                    fail("a phi needs an operand per predecessor", i->id);
+            }
+
+            for (ir_instr *o : i->operands) {
+                if (o->dead || !in_function.count(o->block))
+                    fail("uses a removed instruction", i->id);
+                if (o->block == b.get() && i->op != ir_op::Phi &&
+                    (!position.count(o) || o == i))
+                    fail("uses a value before it is defined", i->id);
+                uses[{o, i}]++;
+            }
+            for (ir_instr *u : i->users) {
+                if (u->dead)
+                    fail("is used by a removed instruction", i->id);
+                uses[{i, u}]--;
+            }
+        }
+
+        for (ir_block *s : b->succs()) {
+            if (!in_function.count(s))
+                fail("jumps to a removed block", b->terminator()->id);
+            if (std::count(s->preds.begin(), s->preds.end(), b.get()) !=
+                std::count(b->succs().begin(), b->succs().end(), s))
+                fail("successors don't know their predecessor",
+                     b->terminator()->id);
+        }
+        for (ir_block *p : b->preds)
+            if (!in_function.count(p) ||
+                std::find(p->succs().begin(), p->succs().end(), b.get()) ==
+                    p->succs().end())
+                fail("predecessors don't jump here", b->instrs[0]->id);
+    }
+
+    for (auto &use : uses)
+        if (use.second)
+            fail("its operands don't know their users", use.first.second->id);
+}
+
+std::ostream &operator<<(std::ostream &o, const ir_function &f) {
+    o << "function " << f.name << "(" << join(", ", f.args) << ")\n";
+
+    for (auto &b : f.blocks) {
+        o << b->name << ":";
+        if (!b->preds.empty()) {
+            o << "  ; preds";
+            for (ir_block *p : b->preds)
+                o << " " << p->name;
+        }
+        o << "\n";
+
+        for (ir_instr *i : b->instrs) {
+            if (i->dead)
+                continue;
+
+            o << "    ";
+            if (ir_has_value(i->op))
+                o << "%" << i->id << " = ";
+            o << ir_name(i->op);
+
+            if (i->op == ir_op::Const || i->op == ir_op::Param ||
+                i->op == ir_op::Mul)
+                o << " " << i->imm;
+            if (!i->name.empty())
+                o << " " << i->name;
+
+            for (size_t n = 0; n < i->operands.size(); n++)
+                o << (n ? ", %" : " %") << i->operands[n]->id;
+            for (size_t n = 0; n < i->targets.size(); n++)
+                o << (n ? ", " : " -> ") << i->targets[n]->name;
+            if (i->var >= 0)
+                o << "  ; " << f.locals[i->var];
+            o << "\n";
+        }
+    }
+    return o;
+}
@@ -0,0 +1,147 @@
+#ifndef IR_IR_HPP
+#define IR_IR_HPP
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <util/types.h>
+
+using std::string;
+using std::vector;
+
+/*
+ * SSA form of a function, between the ij frontend and the Assembler. Every
+ * instruction is a value, defined once, its operands are the instructions
+ * whose values it takes. Operands are in the order the stack machine
+ * pushes them, so IALOAD takes (index, array) and ISUB a - b as (a, b).
+ * Where control flow joins, phis pick a value by the predecessor it came
+ * from.
+ */
+// clang-format off
+enum class ir_op : u8 {
+    /* values */
+    Param,    /* imm: index of the argument */
+    Const,    /* imm */
+    Ldc,      /* name: the constant, imm: its value */
+    Phi,      /* one operand per predecessor, in the order of preds */
+    Add, Sub, And, Or,
+    Mul,      /* by imm, the language has no other multiplication */
+    Call,     /* name: the function, operands: objref then arguments */
+    In,
+    NewArray, /* size */
+    Load,     /* index, array */
+
+    /* effects only */
+    Store,    /* value, index, array */
+    Out,
+
+    /* terminators, the last instruction of every block */
+    Jump,     /* targets: where to */
+    IfLt,     /* targets: taken if the operand < 0, not taken */
+    IfEq,     /* targets: taken if the operand == 0, not taken */
+    IfCmpEq,  /* targets: taken if both operands are equal, not taken */
+    Return,
+    Halt,
+    Err,
+    End,      /* falls off the end of the function, like the AST did */
+};
+// clang-format on
+
+struct ir_block;
+
+struct ir_instr {
+    ir_op op;
+    u32 id; /* unique within the function */
+    i32 imm;
+    string name;
+    ir_block *block;
+    vector<ir_instr *> operands;
+    vector<ir_instr *> users;     /* one entry per use */
+    vector<ir_block *> targets;   /* of terminators */
+    i32 var;                      /* local it was assigned to, -1 if none */
+    u32 file, line;               /* index into files, 0 if unknown */
+    bool dead;                    /* removed, swept from its block later */
+    ir_instr *forward;            /* what replaced it, see ir_replace */
+};
+
+struct ir_block {
+    u32 id;
+    string name; /* label in the lowered code */
+    vector<ir_instr *> instrs; /* phis first, the terminator last */
+    vector<ir_block *> preds;  /* the phis' operands are in this order */
+    bool loop_header;          /* keeps its label for on-stack replacement */
+
+    ir_instr *terminator() const { return instrs.back(); }
+    const vector<ir_block *> &succs() const { return terminator()->targets; }
+};
+
+struct ir_function {
+    string name;
+    vector<string> args;
+    vector<string> locals; /* args then vars, what ir_instr::var indexes */
+    vector<string> files;  /* files[0] is no file */
+    vector<std::unique_ptr<ir_block>> blocks; /* entry first, in layout order */
+    vector<std::unique_ptr<ir_instr>> instrs; /* every instruction made */
+
+    ir_function() : files{""} {}
+
+    ir_block *entry() const { return blocks[0].get(); }
+    ir_block *add_block(const string &name);
+
+    /* a new instruction at the end of b, or before b's instrs[at] */
+    ir_instr *add(ir_block *b, ir_op op, vector<ir_instr *> operands = {},
+                  i32 imm = 0);
+    ir_instr *insert(ir_block *b, size_t at, ir_op op,
+                     vector<ir_instr *> operands = {}, i32 imm = 0);
+};
+
+/* what kind of instruction */
+bool ir_has_value(ir_op op);
+bool ir_has_effects(ir_op op); /* can't be removed even if unused */
+bool ir_is_terminator(ir_op op);
+const char *ir_name(ir_op op);
+
+/* the value of Const and Ldc, returns whether it is one */
+bool ir_constant(const ir_instr *i, i32 &value);
+
+/* points every use of old at with, old is removed */
+void ir_replace(ir_instr *old, ir_instr *with);
+
+/* drops i and its uses of its operands, its own value must be unused */
+void ir_remove(ir_instr *i);
+void ir_drop_operands(ir_instr *i);
+
+/* replaces operand n of i, or adds one at the end */
+void ir_set_operand(ir_instr *i, size_t n, ir_instr *with);
+void ir_add_operand(ir_instr *i, ir_instr *o);
+
+/*
+ * Edges are the targets of terminators and the preds of blocks, ir_add_edge
+ * only does the latter, the phis of to need an operand for it too. Removing
+ * to->preds[index] also drops the phi operands for it.
+ */
+void ir_add_edge(ir_block *from, ir_block *to);
+void ir_remove_pred(ir_block *to, size_t index);
+
+/*
+ * Replaces the phis that only ever see one value (or themselves) by that
+ * value, and the phis that become trivial by doing so. Returns whether
+ * there were any.
+ */
+bool ir_remove_trivial_phis(vector<ir_instr *> phis);
+
+/* takes the removed instructions out of the blocks */
+void ir_sweep(ir_function &f);
+
+/* drops the blocks the entry can't reach, returns whether there were any */
+bool ir_remove_unreachable(ir_function &f);
+
+/* the instructions of all blocks */
+size_t ir_count(const ir_function &f);
+
+/* panics on broken invariants, what made it break goes in the message */
+void ir_verify(const ir_function &f, const char *after);
+
+std::ostream &operator<<(std::ostream &o, const ir_function &f);
+
+#endif
@@ -0,0 +1,566 @@
+#include "lower.hpp"
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <util/logger.hpp>
+#include <util/util.hpp>
+
+typedef vector<std::pair<ir_instr *, ir_instr *>> copies; /* phi <- value */
+
+/* blocks first to last in layout order, the header first */
+struct loop_range {
+    size_t first, last;
+    i32 parent; /* the loop around it, -1 if none */
+};
+
+class Lowering {
+  public:
+    Lowering(ir_function &f, Assembler &a, bool iinc)
+        : _f{f}, _a{a}, _iinc{iinc}, _temps{0} {}
+    void run();
+
+  private:
+    void prepare();
+    void mark_stack();
+    void assign_homes();
+    void find_loops();
+    void liveness();
+    void resolve_clashes();
+    void split_edges();
+    void emit();
+
+    bool stack_candidate(const ir_instr *i) const;
+    bool stored(const ir_instr *i) const { return !_home[i->id].empty(); }
+    bool contains(i32 loop, const ir_block *b) const {
+        return _loops[loop].first <= b->id && b->id <= _loops[loop].last;
+    }
+    string temp() { return sprint("__t%d__", _temps++); }
+    bool increment(const ir_instr *i);
+    void load(const ir_instr *i);
+    void emit(const ir_instr *i, const ir_block *next);
+
+    ir_function &_f;
+    Assembler &_a;
+    bool _iinc;
+    vector<bool> _on_stack; /* by id, pushed where defined for its one use */
+    vector<string> _home;   /* by id, the local it is stored in */
+    vector<loop_range> _loops;    /* outer ones before the ones in them */
+    vector<i32> _loop;            /* by block id, the innermost one or -1 */
+    vector<vector<ir_instr *>> _live_out; /* by block id, what has a home */
+    vector<vector<ir_instr *>> _through;  /* by loop, live in all of it */
+    std::unordered_map<const ir_block *, copies> _copies; /* at the end */
+    vector<ir_block *> _order; /* blocks as emitted, splits included */
+    size_t _temps;
+};
+
+/* drops unreachable code, puts falling off the end last, numbers blocks */
+void Lowering::prepare() {
+    ir_remove_unreachable(_f);
+    ir_sweep(_f);
+
+    auto end = std::find_if(_f.blocks.begin(), _f.blocks.end(),
+                            [](const std::unique_ptr<ir_block> &b) {
+                                return b->terminator()->op == ir_op::End;
+                            });
+    if (end != _f.blocks.end())
+        std::rotate(end, end + 1, _f.blocks.end());
+
+    for (size_t n = 0; n < _f.blocks.size(); n++)
+        _f.blocks[n]->id = n;
+}
+
+/* whether i can go straight from its definition to its only use */
+bool Lowering::stack_candidate(const ir_instr *i) const {
+    if (!ir_has_value(i->op) || i->op == ir_op::Param || i->op == ir_op::Phi)
+        return false;
+    if (i->users.size() != 1)
+        return false;
+
+    const ir_instr *u = i->users[0];
+    if (u->block != i->block || u->op == ir_op::Phi)
+        return false;
+
+    // a constant pushed last might as well be pushed where it is used, which
+    // keeps x + 1 in reach of IINC
+    bool constant = i->op == ir_op::Const || i->op == ir_op::Ldc;
+    return !constant || u->operands.back() != i;
+}
+
+/*
+ * Simulates the stack of every block. A use takes its operands off the top,
+ * in order, those that aren't there in that order are stored (or pushed
+ * again if constant) instead, and so is whatever is in between.
+ */
+void Lowering::mark_stack() {
+    _on_stack.assign(_f.instrs.size(), false);
+
+    for (auto &b : _f.blocks) {
+        vector<ir_instr *> stack;
+        auto demote = [&](ir_instr *i) {
+            _on_stack[i->id] = false;
+            stack.erase(std::find(stack.rbegin(), stack.rend(), i).base() - 1);
+        };
+
+        for (ir_instr *i : b->instrs) {
+            const vector<ir_instr *> &ops = i->operands;
+            size_t p = 0;
+            while (p < ops.size() && _on_stack[ops[p]->id])
+                p++;
+
+            size_t matched = 0;
+            if (p) {
+                size_t at = std::find(stack.rbegin(), stack.rend(), ops[0]).base() -
+                            stack.begin() - 1;
+                matched = 1;
+                for (size_t q = at + 1; q < stack.size(); q++) {
+                    if (matched < p && stack[q] == ops[matched])
+                        matched++;
+                    else
+                        _on_stack[stack[q]->id] = false;
+                }
+                stack.resize(at);
+            }
+            for (size_t k = matched; k < ops.size(); k++)
+                if (_on_stack[ops[k]->id])
+                    demote(ops[k]);
+
+            if (stack_candidate(i)) {
+                _on_stack[i->id] = true;
+                stack.push_back(i);
+            }
+        }
+    }
+}
+
+void Lowering::assign_homes() {
+    _home.assign(_f.instrs.size(), "");
+
+    for (auto &b : _f.blocks) {
+        for (ir_instr *i : b->instrs) {
+            if (!ir_has_value(i->op) || _on_stack[i->id] || i->users.empty())
+                continue;
+            if (i->op == ir_op::Const || i->op == ir_op::Ldc)
+                continue;
+
+            if (i->op == ir_op::Param)
+                _home[i->id] = _f.args[i->imm];
+            else
+                _home[i->id] = i->var >= 0 ? _f.locals[i->var] : temp();
+        }
+    }
+}
+
+/*
+ * Loops as the ij frontend lays them out: a header, the blocks after it up
+ * to the last one jumping back to it, and no way in but the header. Should
+ * anything not look like that, liveness does without. Blocks on the way
+ * out of a loop (a break after an assignment) count as in it, which at
+ * worst costs a temporary.
+ */
+void Lowering::find_loops() {
+    _loop.assign(_f.blocks.size(), -1);
+    bool ok = true;
+
+    vector<i32> open;
+    for (auto &b : _f.blocks) {
+        while (!open.empty() && _loops[open.back()].last < b->id)
+            open.pop_back();
+        i32 parent = open.empty() ? -1 : open.back();
+
+        bool header = false;
+        size_t last = b->id;
+        for (ir_block *p : b->preds) {
+            if (p->id >= b->id) {
+                header = true;
+                last = std::max(last, (size_t)p->id);
+            }
+        }
+        if (header) {
+            ok = ok && (parent < 0 || last <= _loops[parent].last);
+            _loops.push_back({b->id, last, parent});
+            open.push_back(parent = _loops.size() - 1);
+        }
+        _loop[b->id] = parent;
+    }
+
+    // no way into a loop but its header
+    for (auto &b : _f.blocks) {
+        i32 l = _loop[b->id];
+        if (l >= 0 && _loops[l].first == b->id)
+            l = _loops[l].parent;
+        for (ir_block *p : b->preds)
+            ok = ok && (l < 0 || contains(l, p));
+    }
+
+    if (!ok) {
+        _loops.clear();
+        _loop.assign(_f.blocks.size(), -1);
+    }
+    _through.assign(_loops.size(), {});
+}
+
+/*
+ * The blocks out of which every stored value lives, walking up from uses.
+ * A value from outside a loop that lives anywhere in it lives in all of it,
+ * so the walk records it for the loop and goes on from the header, instead
+ * of through each block of the loop and the loops in it.
+ */
+void Lowering::liveness() {
+    size_t n = _f.blocks.size();
+    _live_out.assign(n, {});
+    vector<size_t> in_mark(n), out_mark(n), loop_mark(_loops.size());
+    vector<ir_block *> todo;
+
+    for (auto &b : _f.blocks) {
+        for (ir_instr *v : b->instrs) {
+            if (!stored(v))
+                continue;
+
+            size_t stamp = v->id + 1;
+            // the outermost loop around b without v or to in it
+            auto around = [&](ir_block *b, ir_block *to) {
+                i32 outermost = -1;
+                for (i32 l = _loop[b->id];
+                     l >= 0 && !contains(l, v->block) && !(to && contains(l, to));
+                     l = _loops[l].parent)
+                    outermost = l;
+                return outermost;
+            };
+            std::function<void(ir_block *, ir_block *)> live_out;
+            auto through = [&](i32 l) {
+                if (loop_mark[l] == stamp)
+                    return;
+                loop_mark[l] = stamp;
+                _through[l].push_back(v);
+
+                ir_block *header = _f.blocks[_loops[l].first].get();
+                for (ir_block *p : header->preds)
+                    if (!contains(l, p))
+                        live_out(p, header);
+            };
+            auto live_in = [&](ir_block *b) {
+                i32 l = around(b, nullptr);
+                if (l >= 0)
+                    through(l);
+                else
+                    todo.push_back(b);
+            };
+            live_out = [&](ir_block *p, ir_block *to) {
+                i32 l = around(p, to);
+                if (l >= 0) {
+                    through(l);
+                    return;
+                }
+                if (out_mark[p->id] == stamp)
+                    return;
+                out_mark[p->id] = stamp;
+                _live_out[p->id].push_back(v);
+                if (p != v->block)
+                    live_in(p);
+            };
+
+            for (ir_instr *u : v->users) {
+                if (u->op == ir_op::Phi) {
+                    for (size_t k = 0; k < u->operands.size(); k++)
+                        if (u->operands[k] == v)
+                            live_out(u->block->preds[k], u->block);
+                } else if (u->block != v->block) {
+                    live_in(u->block);
+                }
+            }
+
+            while (!todo.empty()) {
+                ir_block *b = todo.back();
+                todo.pop_back();
+                if (in_mark[b->id] == stamp)
+                    continue;
+                in_mark[b->id] = stamp;
+                for (ir_block *p : b->preds)
+                    live_out(p, b);
+            }
+        }
+    }
+}
+
+/*
+ * Two values can't share a local while both are alive. Walking each block
+ * backwards, a value defined while another one with its local is still
+ * needed moves to a temporary. Phis are defined at the start of their block.
+ * What lives through a loop counts while in any of its blocks.
+ */
+void Lowering::resolve_clashes() {
+    vector<bool> live(_f.instrs.size());
+    vector<u32> through(_f.instrs.size()); /* how many loops around it */
+    vector<ir_instr *> live_list;
+    std::unordered_map<string, size_t> homes; /* live values per local */
+
+    auto add = [&](ir_instr *v) {
+        if (live[v->id] || through[v->id])
+            return;
+        live[v->id] = true;
+        live_list.push_back(v);
+        homes[_home[v->id]]++;
+    };
+    auto remove = [&](ir_instr *v) {
+        if (!live[v->id])
+            return;
+        live[v->id] = false;
+        if (!--homes[_home[v->id]])
+            homes.erase(_home[v->id]);
+    };
+
+    // between blocks, nothing is live from within one
+    auto loop = [&](size_t l, bool entering) {
+        for (ir_instr *v : _through[l]) {
+            const string &home = _home[v->id];
+            if (entering && !through[v->id]++)
+                homes[home]++;
+            else if (!entering && !--through[v->id] && !--homes[home])
+                homes.erase(home);
+        }
+    };
+
+    vector<size_t> open;
+    size_t next = 0;
+    for (auto &b : _f.blocks) {
+        while (!open.empty() && _loops[open.back()].last < b->id) {
+            loop(open.back(), false);
+            open.pop_back();
+        }
+        for (; next < _loops.size() && _loops[next].first == b->id; next++) {
+            loop(next, true);
+            open.push_back(next);
+        }
+
+        for (ir_instr *v : _live_out[b->id])
+            add(v);
+
+        size_t phis = 0;
+        while (phis < b->instrs.size() && b->instrs[phis]->op == ir_op::Phi)
+            phis++;
+
+        for (size_t n = b->instrs.size(); n-- > phis;) {
+            ir_instr *i = b->instrs[n];
+            if (stored(i)) {
+                remove(i);
+                if (i->op != ir_op::Param && homes.count(_home[i->id]))
+                    _home[i->id] = temp();
+            }
+            for (ir_instr *o : i->operands)
+                if (stored(o))
+                    add(o);
+        }
+
+        for (size_t n = 0; n < phis; n++)
+            remove(b->instrs[n]);
+        for (size_t n = 0; n < phis; n++) {
+            ir_instr *phi = b->instrs[n];
+            if (!stored(phi))
+                continue;
+            if (homes.count(_home[phi->id]))
+                _home[phi->id] = temp();
+            add(phi);
+        }
+
+        for (ir_instr *v : live_list)
+            remove(v);
+        live_list.clear();
+    }
+}
+
+/*
+ * Finds the copies into phis every edge needs. An edge out of a branch gets
+ * a block of its own for them, right after the branch if it falls through
+ * and right before the phis' block otherwise.
+ */
+void Lowering::split_edges() {
+    std::unordered_map<const ir_block *, vector<ir_block *>> before, after;
+    size_t blocks = _f.blocks.size(), splits = 0;
+
+    for (size_t n = 0; n < blocks; n++) {
+        ir_block *b = _f.blocks[n].get();
+        for (size_t k = 0; k < b->preds.size(); k++) {
+            copies edge;
+            for (ir_instr *phi : b->instrs) {
+                if (phi->op != ir_op::Phi)
+                    break;
+                ir_instr *o = phi->operands[k];
+                if (stored(phi) && _home[o->id] != _home[phi->id])
+                    edge.emplace_back(phi, o);
+            }
+            if (edge.empty())
+                continue;
+
+            ir_block *p = b->preds[k];
+            ir_instr *branch = p->terminator();
+            if (branch->targets.size() == 1) {
+                copies &at = _copies[p];
+                at.insert(at.end(), edge.begin(), edge.end());
+                continue;
+            }
+
+            // the how manieth edge from p to b this is
+            size_t nth = std::count(b->preds.begin(), b->preds.begin() + k, p);
+            size_t slot = 0;
+            for (; slot < branch->targets.size(); slot++)
+                if (branch->targets[slot] == b && !nth--)
+                    break;
+
+            ir_block *split = _f.add_block(sprint("split%d", splits++));
+            ir_instr *jump = _f.add(split, ir_op::Jump);
+            jump->targets = {b};
+            jump->file = branch->file;
+            jump->line = branch->line;
+
+            branch->targets[slot] = split;
+            split->preds = {p};
+            b->preds[k] = split;
+            _copies[split] = std::move(edge);
+            (slot == 1 ? after[p] : before[b]).push_back(split);
+        }
+    }
+
+    for (size_t n = 0; n < blocks; n++) {
+        ir_block *b = _f.blocks[n].get();
+        _order.insert(_order.end(), before[b].begin(), before[b].end());
+        _order.push_back(b);
+        _order.insert(_order.end(), after[b].begin(), after[b].end());
+    }
+}
+
+/* x = x + c as IINC, if that is what i is */
+bool Lowering::increment(const ir_instr *i) {
+    if (!_iinc || (i->op != ir_op::Add && i->op != ir_op::Sub) || !stored(i))
+        return false;
+
+    const ir_instr *var = i->operands[0], *c = i->operands[1];
+    i32 value;
+    if (_on_stack[var->id] || _home[var->id] != _home[i->id] ||
+        _on_stack[c->id] || !ir_constant(c, value))
+        return false;
+
+    i64 by = i->op == ir_op::Add ? (i64)value : -(i64)value;
+    if (by < -128 || by > 127)
+        return false;
+
+    _a.IINC(_home[i->id], by);
+    return true;
+}
+
+void Lowering::load(const ir_instr *i) {
+    if (i->op == ir_op::Const) {
+        _a.PUSH_VAL(i->imm);
+    } else if (i->op == ir_op::Ldc) {
+        if (!_a.is_constant(i->name))
+            _a.constant(i->name, i->imm);
+        _a.LDC_W(i->name);
+    } else if (stored(i)) {
+        _a.ILOAD(_home[i->id]);
+    } else {
+        log.panic("ir: %%%d of %s is nowhere", i->id, _f.name.c_str());
+    }
+}
+
+void Lowering::emit(const ir_instr *i, const ir_block *next) {
+    if (i->op == ir_op::Const || i->op == ir_op::Ldc) {
+        if (_on_stack[i->id])
+            load(i);
+        return;
+    }
+    if (increment(i))
+        return;
+
+    for (const ir_instr *o : i->operands)
+        if (!_on_stack[o->id])
+            load(o);
+
+    if (ir_is_terminator(i->op)) {
+        copies &edge = _copies[i->block];
+        for (auto &copy : edge)
+            load(copy.second);
+        for (size_t n = edge.size(); n-- > 0;)
+            _a.ISTORE(_home[edge[n].first->id]);
+    }
+
+    // clang-format off
+    switch (i->op) {
+    case ir_op::Add:      _a.IADD();                        break;
+    case ir_op::Sub:      _a.ISUB();                        break;
+    case ir_op::And:      _a.IAND();                        break;
+    case ir_op::Or:       _a.IOR();                         break;
+    case ir_op::Mul:      _a.IMUL(i->imm);                  break;
+    case ir_op::Call:     _a.INVOKEVIRTUAL(i->name);        break;
+    case ir_op::In:       _a.IN();                          break;
+    case ir_op::NewArray: _a.NEWARRAY();                    break;
+    case ir_op::Load:     _a.IALOAD();                      break;
+    case ir_op::Store:    _a.IASTORE();                     break;
+    case ir_op::Out:      _a.OUT();                         break;
+    case ir_op::IfLt:     _a.IFLT(i->targets[0]->name);     break;
+    case ir_op::IfEq:     _a.IFEQ(i->targets[0]->name);     break;
+    case ir_op::IfCmpEq:  _a.ICMPEQ(i->targets[0]->name);   break;
+    case ir_op::Return:   _a.IRETURN();                     break;
+    case ir_op::Halt:     _a.HALT();                        break;
+    case ir_op::Err:      _a.ERR();                         break;
+    default:                                                break;
+    }
+    // clang-format on
+
+    if (ir_is_terminator(i->op)) {
+        if (!i->targets.empty() && i->targets.back() != next)
+            _a.GOTO(i->targets.back()->name);
+    } else if (ir_has_value(i->op) && !_on_stack[i->id]) {
+        if (stored(i))
+            _a.ISTORE(_home[i->id]);
+        else
+            _a.POP();
+    }
+}
+
+void Lowering::emit() {
+    // every local used other than the arguments, in order of appearance
+    vector<string> vars;
+    std::unordered_set<string> declared{_f.args.begin(), _f.args.end()};
+    for (ir_block *b : _order)
+        for (ir_instr *i : b->instrs)
+            if (stored(i) && declared.insert(_home[i->id]).second)
+                vars.push_back(_home[i->id]);
+    _a.function(_f.name, _f.args, vars);
+
+    u32 file = 0, line = 0;
+    for (size_t n = 0; n < _order.size(); n++) {
+        ir_block *b = _order[n];
+        if (n)
+            _a.label(b->name);
+
+        for (ir_instr *i : b->instrs) {
+            if (i->op == ir_op::Phi || i->op == ir_op::Param)
+                continue;
+            if (i->line && (i->line != line || i->file != file)) {
+                file = i->file;
+                line = i->line;
+                _a.line(_f.files[file], line);
+            }
+            emit(i, n + 1 < _order.size() ? _order[n + 1] : nullptr);
+        }
+    }
+}
+
+void Lowering::run() {
+    prepare();
+    mark_stack();
+    assign_homes();
+    find_loops();
+    liveness();
+    resolve_clashes();
+    split_edges();
+
+    // the split blocks' jumps are instructions too
+    _on_stack.resize(_f.instrs.size());
+    _home.resize(_f.instrs.size());
+    emit();
+}
+
+void ir_lower(ir_function &f, Assembler &a, bool iinc) {
+    Lowering{f, a, iinc}.run();
+}
@@ -0,0 +1,16 @@
+#ifndef IR_LOWER_HPP
+#define IR_LOWER_HPP
+#include <backends/assembler.hpp>
+#include "ir.hpp"
+
+/*
+ * Emits f through the Assembler. Values used once, right where they were
+ * computed, stay on the stack. Every other value gets a local: the variable
+ * it was assigned to if that doesn't clash with another value living at the
+ * same time, a temporary otherwise. Phis become stores on the edges into
+ * their block, edges from branches are split when they need any. x = x + c
+ * becomes IINC if iinc.
+ */
+void ir_lower(ir_function &f, Assembler &a, bool iinc = true);
+
+#endif
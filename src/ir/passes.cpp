@@ -0,0 +1,532 @@
+#include "passes.hpp"
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <util/logger.hpp>
+#include <util/stats.hpp>
+
+/* which way a branch on constants goes, 0 taken, 1 not, -1 unknown */
+static int constant_branch(const ir_instr *t) {
+    i32 x, y;
+    if (t->targets.size() == 2 && t->targets[0] == t->targets[1])
+        return 0;
+
+    switch (t->op) {
+    case ir_op::IfLt:
+        return ir_constant(t->operands[0], x) ? x >= 0 : -1;
+    case ir_op::IfEq:
+        return ir_constant(t->operands[0], x) ? x != 0 : -1;
+    case ir_op::IfCmpEq:
+        if (t->operands[0] == t->operands[1])
+            return 0;
+        if (ir_constant(t->operands[0], x) && ir_constant(t->operands[1], y))
+            return x != y;
+        return -1;
+    default:
+        return -1;
+    }
+}
+
+/* replaces the terminator of b by a jump to target */
+static void jump(ir_function &f, ir_block *b, ir_block *target) {
+    ir_instr *t = b->terminator();
+    ir_remove(t);
+    b->instrs.pop_back();
+
+    ir_instr *j = f.add(b, ir_op::Jump);
+    j->targets = {target};
+    j->file = t->file;
+    j->line = t->line;
+}
+
+static bool fold_branches(ir_function &f) {
+    bool changed = false;
+    for (auto &b : f.blocks) {
+        ir_instr *t = b->terminator();
+        int taken = constant_branch(t);
+        if (taken < 0)
+            continue;
+
+        ir_block *keep = t->targets[taken], *drop = t->targets[1 - taken];
+        auto it = std::find(drop->preds.begin(), drop->preds.end(), b.get());
+        ir_remove_pred(drop, it - drop->preds.begin());
+        jump(f, b.get(), keep);
+        changed = true;
+    }
+    return changed;
+}
+
+/* a block whose only predecessor jumps to it might as well be part of it */
+static bool merge_blocks(ir_function &f) {
+    std::unordered_map<const ir_block *, bool> merged;
+
+    for (auto &ptr : f.blocks) {
+        ir_block *b = ptr.get();
+        if (b->preds.size() != 1 || b->loop_header || b == f.entry())
+            continue;
+
+        ir_block *a = b->preds[0];
+        if (a == b || a->terminator()->op != ir_op::Jump)
+            continue;
+
+        // with one predecessor the phis have one value
+        while (b->instrs[0]->op == ir_op::Phi) {
+            ir_replace(b->instrs[0], b->instrs[0]->operands[0]);
+            b->instrs.erase(b->instrs.begin());
+        }
+
+        ir_remove(a->terminator());
+        a->instrs.pop_back();
+        for (ir_instr *i : b->instrs) {
+            i->block = a;
+            a->instrs.push_back(i);
+        }
+        b->instrs.clear();
+
+        for (ir_block *s : a->succs())
+            std::replace(s->preds.begin(), s->preds.end(), b, a);
+        merged[b] = true;
+    }
+
+    if (merged.empty())
+        return false;
+
+    f.blocks.erase(std::remove_if(f.blocks.begin(), f.blocks.end(),
+                                  [&](const std::unique_ptr<ir_block> &b) {
+                                      return merged.count(b.get());
+                                  }),
+                   f.blocks.end());
+    return true;
+}
+
+bool simplify_cfg(ir_function &f) {
+    bool changed = false;
+    for (bool again = true; again; changed |= again) {
+        again = fold_branches(f);
+        again |= ir_remove_unreachable(f);
+
+        vector<ir_instr *> phis;
+        for (auto &b : f.blocks)
+            for (ir_instr *i : b->instrs)
+                if (i->op == ir_op::Phi && !i->dead)
+                    phis.push_back(i);
+        again |= ir_remove_trivial_phis(phis);
+        ir_sweep(f);
+
+        again |= merge_blocks(f);
+    }
+    return changed;
+}
+
+/* turns i into the constant value, in place */
+static void make_constant(ir_instr *i, i32 value) {
+    ir_drop_operands(i);
+    i->op = ir_op::Const;
+    i->imm = value;
+    i->name.clear();
+}
+
+/* what i always is, nullptr if it can't tell */
+static ir_instr *identity(ir_instr *i) {
+    ir_instr *l = i->operands.empty() ? nullptr : i->operands[0];
+    ir_instr *r = i->operands.size() < 2 ? nullptr : i->operands[1];
+    i32 x;
+
+    switch (i->op) {
+    case ir_op::Add:
+    case ir_op::Or:
+        if (ir_constant(r, x) && x == 0)
+            return l;
+        if (ir_constant(l, x) && x == 0)
+            return r;
+        return i->op == ir_op::Or && l == r ? l : nullptr;
+    case ir_op::Sub:
+        return ir_constant(r, x) && x == 0 ? l : nullptr;
+    case ir_op::And:
+        if (ir_constant(r, x) && x == -1)
+            return l;
+        if (ir_constant(l, x) && x == -1)
+            return r;
+        return l == r ? l : nullptr;
+    case ir_op::Mul:
+        return i->imm == 1 ? l : nullptr;
+    default:
+        return nullptr;
+    }
+}
+
+/* the value of i if it is arithmetic on constants, like the x64 does it */
+static bool evaluate(const ir_instr *i, i32 &value) {
+    const vector<ir_instr *> &ops = i->operands;
+    i32 x, y;
+
+    switch (i->op) {
+    case ir_op::Ldc:
+        // BIPUSH is shorter than LDC_W, anything longer stays a constant
+        value = i->imm;
+        return i->imm >= -128 && i->imm <= 127;
+    case ir_op::Mul:
+        if (i->imm == 0) {
+            value = 0;
+            return true;
+        }
+        if (!ir_constant(ops[0], x))
+            return false;
+        value = (i32)((u32)x * (u32)i->imm);
+        return true;
+    case ir_op::Sub:
+        if (ops[0] == ops[1]) {
+            value = 0;
+            return true;
+        }
+        break;
+    case ir_op::And:
+        if ((ir_constant(ops[0], x) && !x) || (ir_constant(ops[1], y) && !y)) {
+            value = 0;
+            return true;
+        }
+        break;
+    case ir_op::Add:
+    case ir_op::Or:
+        break;
+    default:
+        return false;
+    }
+
+    if (!ir_constant(ops[0], x) || !ir_constant(ops[1], y))
+        return false;
+
+    // clang-format off
+    switch (i->op) {
+    case ir_op::Add: value = (i32)((u32)x + (u32)y); break;
+    case ir_op::Sub: value = (i32)((u32)x - (u32)y); break;
+    case ir_op::And: value = x & y;                  break;
+    default:         value = x | y;                  break;
+    }
+    // clang-format on
+    return true;
+}
+
+bool fold_constants(ir_function &f) {
+    bool changed = false;
+    for (auto &b : f.blocks) {
+        for (ir_instr *i : b->instrs) {
+            if (i->dead)
+                continue;
+
+            i32 value;
+            if (evaluate(i, value)) {
+                make_constant(i, value);
+                changed = true;
+            } else if (ir_instr *same = identity(i)) {
+                if (same->var < 0)
+                    same->var = i->var;
+                ir_replace(i, same);
+                changed = true;
+            }
+        }
+    }
+    ir_sweep(f);
+    return changed;
+}
+
+bool eliminate_dead_code(ir_function &f) {
+    vector<bool> live(f.instrs.size());
+    vector<ir_instr *> todo;
+    for (auto &b : f.blocks)
+        for (ir_instr *i : b->instrs)
+            if (ir_has_effects(i->op)) {
+                live[i->id] = true;
+                todo.push_back(i);
+            }
+
+    while (!todo.empty()) {
+        ir_instr *i = todo.back();
+        todo.pop_back();
+        for (ir_instr *o : i->operands)
+            if (!live[o->id]) {
+                live[o->id] = true;
+                todo.push_back(o);
+            }
+    }
+
+    bool changed = false;
+    for (auto &b : f.blocks)
+        for (ir_instr *i : b->instrs)
+            if (!live[i->id]) {
+                ir_remove(i);
+                changed = true;
+            }
+    ir_sweep(f);
+    return changed;
+}
+
+/*
+ * The immediate dominator of every block the entry reaches, by id, and
+ * those blocks in reverse postorder (Cooper, Harvey and Kennedy, A Simple,
+ * Fast Dominance Algorithm). Numbers the blocks for that.
+ */
+static vector<ir_block *> dominators(ir_function &f,
+                                     vector<ir_block *> &order) {
+    size_t n = f.blocks.size();
+    for (size_t k = 0; k < n; k++)
+        f.blocks[k]->id = k;
+
+    vector<size_t> rpo(n, n); /* n if unreached */
+    vector<std::pair<ir_block *, size_t>> stack{{f.entry(), 0}};
+    rpo[0] = 0;
+    while (!stack.empty()) {
+        ir_block *b = stack.back().first;
+        size_t next = stack.back().second++;
+        if (next == b->succs().size()) {
+            order.push_back(b);
+            stack.pop_back();
+        } else if (rpo[b->succs()[next]->id] == n) {
+            rpo[b->succs()[next]->id] = 0;
+            stack.push_back({b->succs()[next], 0});
+        }
+    }
+    std::reverse(order.begin(), order.end());
+    for (size_t k = 0; k < order.size(); k++)
+        rpo[order[k]->id] = k;
+
+    vector<ir_block *> idom(n);
+    idom[0] = f.entry();
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t k = 1; k < order.size(); k++) {
+            ir_block *b = order[k], *dom = nullptr;
+            for (ir_block *p : b->preds) {
+                if (!idom[p->id])
+                    continue;
+                ir_block *other = dom ? dom : p;
+                while (p != other) {
+                    while (rpo[p->id] > rpo[other->id])
+                        p = idom[p->id];
+                    while (rpo[other->id] > rpo[p->id])
+                        other = idom[other->id];
+                }
+                dom = p;
+            }
+            if (idom[b->id] != dom) {
+                idom[b->id] = dom;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+/*
+ * What makes two instructions compute the same, nothing for others.
+ * Constants are pushed where they are used anyway.
+ */
+typedef std::tuple<ir_op, i32, const ir_instr *, const ir_instr *> expression;
+
+static bool expression_of(const ir_instr *i, expression &e) {
+    const vector<ir_instr *> &ops = i->operands;
+    switch (i->op) {
+    case ir_op::Mul:
+        e = expression{i->op, i->imm, ops[0], nullptr};
+        return true;
+    case ir_op::Add:
+    case ir_op::And:
+    case ir_op::Or:
+        // the same either way around
+        e = expression{i->op, 0, std::min(ops[0], ops[1]),
+                       std::max(ops[0], ops[1])};
+        return true;
+    case ir_op::Sub:
+        e = expression{i->op, 0, ops[0], ops[1]};
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * About how many instructions computing i again takes, by costs of the
+ * instructions before it. A value used more than once is stored anyway.
+ */
+static size_t cost(const ir_instr *i, const vector<size_t> &costs) {
+    size_t c = 1;
+    for (const ir_instr *o : i->operands)
+        c += o->users.size() == 1 && costs[o->id] ? costs[o->id] : 1;
+    // like Assembler::IMUL, a DUP and an IADD per bit and more per bit set
+    if (i->op == ir_op::Mul)
+        for (u32 v = i->imm < 0 ? -(u32)i->imm : i->imm; v > 1; v >>= 1)
+            c += v & 1 ? 4 : 2;
+    return c;
+}
+
+/* reusing a value takes a store and a load, on top of a temporary */
+static const size_t worth_reusing = 4;
+
+bool eliminate_common_subexpressions(ir_function &f) {
+    vector<ir_block *> order;
+    vector<ir_block *> idom = dominators(f, order);
+    vector<vector<ir_block *>> children(f.blocks.size());
+    for (size_t k = 1; k < order.size(); k++)
+        children[idom[order[k]->id]->id].push_back(order[k]);
+
+    // down the dominator tree, what a block computes is there for the
+    // blocks it dominates and gone once they are done
+    const size_t enter = -1;
+    std::map<expression, ir_instr *> available;
+    vector<expression> made; /* in that order */
+    vector<std::pair<ir_block *, size_t>> todo{{f.entry(), enter}};
+    vector<size_t> costs(f.instrs.size());
+    bool changed = false;
+
+    while (!todo.empty()) {
+        ir_block *b = todo.back().first;
+        size_t leave = todo.back().second;
+        todo.pop_back();
+
+        if (leave != enter) {
+            for (; made.size() > leave; made.pop_back())
+                available.erase(made.back());
+            continue;
+        }
+        todo.push_back({b, made.size()});
+
+        for (ir_instr *i : b->instrs) {
+            expression e;
+            if (i->dead || !expression_of(i, e))
+                continue;
+
+            costs[i->id] = cost(i, costs);
+            auto it = available.find(e);
+            if (it == available.end()) {
+                available.emplace(e, i);
+                made.push_back(e);
+            } else if (costs[i->id] >= worth_reusing) {
+                if (it->second->var < 0)
+                    it->second->var = i->var;
+                ir_replace(i, it->second);
+                changed = true;
+            }
+        }
+        for (ir_block *c : children[b->id])
+            todo.push_back({c, enter});
+    }
+    ir_sweep(f);
+    return changed;
+}
+
+static const std::pair<const char *, ir_pass> passes[] = {
+    {"simplify-cfg", simplify_cfg},
+    {"fold", fold_constants},
+    {"dce", eliminate_dead_code},
+    {"cse", eliminate_common_subexpressions},
+};
+
+ir_pass find_pass(const std::string &name) {
+    for (auto &p : passes)
+        if (name == p.first)
+            return p.second;
+
+    log.panic("no optimization pass called %s", name.c_str());
+    return nullptr;
+}
+
+void PassManager::add(const std::string &name) {
+    _passes.emplace_back(name, find_pass(name));
+}
+
+void PassManager::run(ir_function &f) const {
+    for (size_t round = 0; round < _rounds; round++) {
+        bool changed = false;
+        for (auto &pass : _passes) {
+            size_t before = stats.enabled() ? ir_count(f) : 0;
+            {
+                Phase phase{pass.first, f.name};
+                if (pass.second(f)) {
+                    log_info("%s changed %s", pass.first.c_str(),
+                             f.name.c_str());
+                    changed = true;
+                }
+            }
+#ifdef DEBUG
+            ir_verify(f, pass.first.c_str());
+#endif
+
+            size_t after = stats.enabled() ? ir_count(f) : 0;
+            if (after < before)
+                stats.count(pass.first + " instructions removed",
+                            before - after);
+            else if (after > before)
+                stats.count(pass.first + " instructions added",
+                            after - before);
+        }
+        if (!changed)
+            break;
+    }
+}
+
+/*
+ * everything -f knows, and from which -O on it is there. prune is always on,
+ * functions nothing calls needn't compile at all, let alone be compiled.
+ */
+static const std::pair<const char *, int> optimizations[] = {
+    {"prune", 0}, {"ir", 1},  {"iinc", 1}, {"simplify-cfg", 1},
+    {"fold", 1},  {"dce", 1}, {"cse", 2},
+};
+
+/* -O3 stops repeating the passes here even if they still find something */
+static const size_t max_rounds = 8;
+
+bool Optimizations::set_level(int level) {
+    if (level < 0 || level > 3)
+        return false;
+    _level = level;
+    return true;
+}
+
+bool Optimizations::set(const std::string &name, bool on) {
+    for (auto &o : optimizations) {
+        if (name == o.first) {
+            _flags.emplace_back(name, on);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Optimizations::operator[](const std::string &name) const {
+    for (auto it = _flags.rbegin(); it != _flags.rend(); it++)
+        if (it->first == name)
+            return it->second;
+
+    for (auto &o : optimizations)
+        if (name == o.first)
+            return _level >= o.second;
+
+    log.panic("no optimization called %s", name.c_str());
+    return false;
+}
+
+PassManager Optimizations::passes() const {
+    PassManager pm;
+    // cse leaves work for fold (x - x), fold for simplify-cfg (constant
+    // branches), all of them for dce
+    for (const char *name : {"simplify-cfg", "cse", "fold", "simplify-cfg",
+                             "dce"})
+        if ((*this)[name])
+            pm.add(name);
+
+    if (_level >= 3)
+        pm.repeat(max_rounds);
+    return pm;
+}
+
+std::string Optimizations::str() const {
+    std::string s = "-O" + std::to_string(_level);
+    for (auto &o : optimizations) {
+        bool on = (*this)[o.first];
+        if (on != (_level >= o.second))
+            s += std::string(on ? " -f" : " -fno-") + o.first;
+    }
+    return s;
+}
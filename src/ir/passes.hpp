@@ -0,0 +1,74 @@
+#ifndef IR_PASSES_HPP
+#define IR_PASSES_HPP
+#include <string>
+#include <vector>
+#include "ir.hpp"
+
+/* a transformation of a function, returns whether it changed anything */
+typedef bool (*ir_pass)(ir_function &f);
+
+/* drops unreachable blocks and trivial phis, folds constant branches and
+ * merges blocks into their only predecessor */
+bool simplify_cfg(ir_function &f);
+
+/* evaluates arithmetic on constants and drops what does nothing (x + 0) */
+bool fold_constants(ir_function &f);
+
+/* drops instructions whose values nobody uses and that have no effects */
+bool eliminate_dead_code(ir_function &f);
+
+/* reuses the value of arithmetic done before, where that dominates it */
+bool eliminate_common_subexpressions(ir_function &f);
+
+/* the pass called name, panics if there is none */
+ir_pass find_pass(const std::string &name);
+
+/*
+ * Runs passes over functions in the order they were added, each timed as a
+ * phase of the function and its instructions removed or added counted for
+ * --stats.
+ */
+class PassManager {
+  public:
+    PassManager() : _rounds{1} {}
+
+    void add(const std::string &name);
+    /* runs all of them again while any changes something, rounds at most */
+    void repeat(size_t rounds) { _rounds = rounds; }
+    void run(ir_function &f) const;
+
+  private:
+    std::vector<std::pair<std::string, ir_pass>> _passes;
+    size_t _rounds;
+};
+
+/*
+ * What a compile optimizes, -O<level> and -f[no-]<name>. Besides the passes
+ * there are prune (drops the functions main can't reach), ir (compiles
+ * through the IR at all, the AST otherwise) and iinc (x += c as IINC).
+ * fold also folds constant conditions when compiling from the AST.
+ *
+ * prune is on at every level. -O0 compiles straight from the AST, -O1 (the
+ * default) adds the rest but cse, -O2 cse too, -O3 repeats the passes until
+ * they find nothing more.
+ */
+class Optimizations {
+  public:
+    explicit Optimizations(int level = 1) : _level{level} {}
+
+    /* both return false for what doesn't exist */
+    bool set_level(int level);
+    bool set(const std::string &name, bool on);
+
+    bool operator[](const std::string &name) const;
+    PassManager passes() const;
+
+    /* the level and the -f that differ from it, the same for the same */
+    std::string str() const;
+
+  private:
+    int _level;
+    std::vector<std::pair<std::string, bool>> _flags; /* latest last */
+};
+
+#endif
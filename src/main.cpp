@@ -2,6 +2,7 @@
 #include <vector>
 #include <fstream>
 #include <memory>
+#include <sys/stat.h>
 
 #include <frontends/ij/compile.hpp>
 #include <frontends/jas/compile.hpp>
@@ -10,11 +11,24 @@
 #include <backends/ijvm_assembler.hpp>
 #include <backends/jas_assembler.hpp>
 #include <backends/x64_assembler.hpp>
+#include <backends/elf_assembler.hpp>
+#include <backends/obj_assembler.hpp>
+#include <backends/interp_assembler.hpp>
+#include <backends/x64_perf.hpp>
+#include <backends/x64_gdb.hpp>
+#include <backends/x64_profile.hpp>
+#include <backends/x64_counters.hpp>
+#include <backends/x64_perf_stats.hpp>
+#include <backends/x64_bench.hpp>
 
 #include <util/logger.hpp>
+#include <util/cache.hpp>
+#include <util/stats.hpp>
 
 struct options {
     bool run = false;             // whether we run or compile
+    bool bench = false;           // whether run repeats the program
+    bench_options bench_opts;     // only relevant for bench
     std::string src_file;         // file to be compiled
     std::string input_file = "";  // only relevant for run
     std::string output_file = ""; // stdout if empty
@@ -22,6 +36,17 @@ struct options {
                                   // else      file to write program to
     std::string fmt = "jas";      // only relevant for compile
                                   //   what is the output, options: {jas, jit, x64}
+    std::string engine = "jit";   // only relevant for run, options: {jit, interp, tiered}
+    std::string perf = "";        // only relevant for run, options: {map, jitdump}
+    std::string profile = "";     // only relevant for run, where the stacks go
+    std::string counters = "";    // only relevant for run, where the report goes
+    bool count = false;           // whether execution counters are kept
+    bool perf_stats = false;      // only relevant for run, hardware counters
+    bool stats = false;           // whether phase statistics are printed
+    std::string trace = "";       // where the chrome trace goes, if anywhere
+    bool gdb = false;             // only relevant for run, registers code with gdb
+    bool cache = true;            // whether compiled code is reused
+    Optimizations opt;            // only relevant for ij, -O and -f
     bool verbose = false;         // whether verbose output is given
     bool debug = false;           // whether debug output is given
 };
@@ -36,7 +61,7 @@ static std::vector<std::string> args(int argc, char **argv) {
 }
 
 static void print_basic_help(string cmd) {
-    std::cerr << "Usage: ij {compile,run} [options] in.ij\n";
+    std::cerr << "Usage: ij {compile,run,bench} [options] in.ij\n";
 
     if (!cmd.empty())
         std::cerr << "    invalid command: " << cmd << std::endl;
@@ -49,8 +74,15 @@ static void print_compile_help(std::string msg) {
               << "       ij c       [options] in.ij\n"
               << "          compiles the sources to jas/ijvm, options:\n\n"
               << "          -o, --output   - output file (stdout by default)\n"
-              << "          -f, --format {jas, ijvm, x64}\n"
+              << "          -f, --format {jas, ijvm, x64, elf, obj}\n"
               << "                         - which output format, default=jas\n"
+              << "          --no-cache     - always compile from scratch\n"
+              << "          -O{0,1,2,3}    - how much to optimize ij, default=1\n"
+              << "          -fNAME, -fno-NAME\n"
+              << "                         - turns one optimization on or off: prune, ir,\n"
+              << "                           iinc, simplify-cfg, fold, dce or cse\n"
+              << "          --stats        - prints time, peak RSS and counts per phase\n"
+              << "          --trace FILE   - writes the phases as a chrome trace to FILE\n"
               << "          -v, --verbose  - prints verbose info\n"
               << "          -d, --debug    - prints debug info\n\n";
 
@@ -67,6 +99,24 @@ static void print_run_help(std::string msg) {
         << "    jit compiles the sources to x64 and executes them, options:\n\n"
         << "    -i, --input    - IN reads from file instead of stdin\n"
         << "    -o, --output   - OUT writes to file instead of stdout\n"
+        << "    -e, --engine {jit, interp, tiered}\n"
+        << "                   - how to execute, default=jit\n"
+        << "    --no-cache     - always compile from scratch\n"
+        << "    -O{0,1,2,3}    - how much to optimize ij, default=1\n"
+        << "    -fNAME, -fno-NAME\n"
+        << "                   - turns one optimization on or off, see compile\n"
+        << "    --perf {map, jitdump}\n"
+        << "                   - names jitted code for perf, implies --no-cache\n"
+        << "    --perf-stats   - prints cycles, IPC and miss rates of the run\n"
+        << "    --profile FILE - samples the program, writes folded stacks to FILE\n"
+        << "                     and the top functions to stderr, implies --no-cache\n"
+        << "    --counters[=FILE]\n"
+        << "                   - counts calls, block hits and executed opcodes,\n"
+        << "                     reports to FILE or stderr, implies --no-cache\n"
+        << "    -g, --gdb      - registers jitted code and line tables with gdb,\n"
+        << "                     implies --no-cache\n"
+        << "    --stats        - prints time, peak RSS and counts per phase\n"
+        << "    --trace FILE   - writes the phases as a chrome trace to FILE\n"
         << "    -v, --verbose  - prints verbose info\n"
         << "    -d, --debug    - prints debug info\n";
 
@@ -76,10 +126,78 @@ static void print_run_help(std::string msg) {
     exit(-1);
 }
 
+static void print_bench_help(std::string msg) {
+    std::cerr
+        << "Usage: ij bench [options] in.ij\n"
+        << "       ij b     [options] in.ij\n"
+        << "    jit compiles the sources once and times repeated runs, options:\n\n"
+        << "    -n, --runs N   - timed runs, default=10\n"
+        << "    -w, --warmup N - untimed runs before them, default=2\n"
+        << "    -i, --input    - IN reads from file, rewound every run\n"
+        << "    -o, --output   - OUT writes to file, the last run's output\n"
+        << "    --cpu N        - pins to cpu N, default the current one\n"
+        << "    --json FILE    - writes the timings to FILE\n"
+        << "    --compare FILE - compares against the --json of an earlier bench\n"
+        << "    --no-cache     - always compile from scratch\n"
+        << "    -O{0,1,2,3}    - how much to optimize ij, default=1\n"
+        << "    -fNAME, -fno-NAME\n"
+        << "                   - turns one optimization on or off, see compile\n"
+        << "    --stats        - prints time, peak RSS and counts per phase\n"
+        << "    --trace FILE   - writes the phases as a chrome trace to FILE\n"
+        << "    -v, --verbose  - prints verbose info\n"
+        << "    -d, --debug    - prints debug info\n";
+
+    if (!msg.empty())
+        log.panic("Error: %s", msg.c_str());
+
+    exit(-1);
+}
+
+/* whether arg is a number of at least min, which then goes in n */
+static bool parse_number(const std::string &arg, long min, long &n) {
+    char *end;
+    n = strtol(arg.c_str(), &end, 10);
+    return !arg.empty() && *end == '\0' && n >= min;
+}
+
+/* options both commands take, returns whether arg was one of them */
+static bool parse_common_option(std::vector<std::string> &args, unsigned &i,
+                                options &o) {
+    std::string &arg = args[i];
+
+    if (arg == "--stats") {
+        o.stats = true;
+    } else if (arg == "--trace" || startswith(arg, "--trace=")) {
+        if (startswith(arg, "--trace="))
+            o.trace = arg.substr(arg.find('=') + 1);
+        else if (i + 1 < args.size())
+            o.trace = args[++i];
+
+        if (o.trace.empty())
+            log.panic("Error: trace requires a file as arg");
+    } else if (startswith(arg, "-O")) {
+        long level;
+        if (!parse_number(arg.substr(2), 0, level) || !o.opt.set_level(level))
+            log.panic("Error: %s, the levels are -O0 to -O3", arg.c_str());
+    } else if (startswith(arg, "-f") && arg.size() > 2) {
+        // just -f is compile's --format
+        std::string name = arg.substr(2);
+        bool on = !startswith(name, "no-");
+        if (!o.opt.set(on ? name : name.substr(3), on))
+            log.panic("Error: no optimization called %s", name.c_str());
+    } else
+        return false;
+
+    return true;
+}
+
 static void parse_compile_options(std::vector<std::string> args, options &o) {
     for (unsigned i = 1; i < args.size(); i++) {
         std::string &arg = args[i];
 
+        if (parse_common_option(args, i, o))
+            continue;
+
         if (arg == "-h" || arg == "--help") {
             print_compile_help("");
         } else if (arg == "-o" || arg == "--output") {
@@ -89,12 +207,15 @@ static void parse_compile_options(std::vector<std::string> args, options &o) {
                 print_compile_help("output requires an argument");
         } else if (arg == "-f" || arg == "--format") {
             if (i + 1 >= args.size())
-                print_compile_help("format requires jas, ijvm or x64 as arg");
-            else if (in(args[i + 1], {"jas", "ijvm", "x64"}))
+                print_compile_help(
+                    "format requires jas, ijvm, x64, elf or obj as arg");
+            else if (in(args[i + 1], {"jas", "ijvm", "x64", "elf", "obj"}))
                 o.fmt = args[++i];
             else
                 print_compile_help(
                     sprint("argument %s is invalid", args[i + 1]));
+        } else if (arg == "--no-cache") {
+            o.cache = false;
         } else if (arg == "-v" || arg == "--verbose") {
             log.set_log_level(LogLevel::success);
         } else if (arg == "-d" || arg == "--debug") {
@@ -120,6 +241,9 @@ static void parse_run_options(std::vector<std::string> args, options &o) {
     for (unsigned i = 1; i < args.size(); i++) {
         std::string &arg = args[i];
 
+        if (parse_common_option(args, i, o))
+            continue;
+
         if (arg == "-h" || arg == "--help") {
             print_run_help("");
         } else if (arg == "-i" || arg == "--input") {
@@ -132,6 +256,53 @@ static void parse_run_options(std::vector<std::string> args, options &o) {
                 o.output_file = args[++i];
             else
                 print_run_help("output requires an argument");
+        } else if (arg == "-e" || arg == "--engine" ||
+                   startswith(arg, "--engine=")) {
+            std::string engine;
+            if (startswith(arg, "--engine="))
+                engine = arg.substr(arg.find('=') + 1);
+            else if (i + 1 < args.size())
+                engine = args[++i];
+
+            if (in(engine, {"jit", "interp", "tiered"}))
+                o.engine = engine;
+            else
+                print_run_help("engine requires jit, interp or tiered as arg");
+        } else if (arg == "--no-cache") {
+            o.cache = false;
+        } else if (arg == "--perf" || startswith(arg, "--perf=")) {
+            std::string perf;
+            if (startswith(arg, "--perf="))
+                perf = arg.substr(arg.find('=') + 1);
+            else if (i + 1 < args.size())
+                perf = args[++i];
+
+            if (in(perf, {"map", "jitdump"}))
+                o.perf = perf;
+            else
+                print_run_help("perf requires map or jitdump as arg");
+
+            // cached code comes without symbols
+            o.cache = false;
+        } else if (arg == "--perf-stats") {
+            o.perf_stats = true;
+        } else if (arg == "--profile" || startswith(arg, "--profile=")) {
+            if (startswith(arg, "--profile="))
+                o.profile = arg.substr(arg.find('=') + 1);
+            else if (i + 1 < args.size())
+                o.profile = args[++i];
+
+            if (o.profile.empty())
+                print_run_help("profile requires a file as arg");
+            o.cache = false;
+        } else if (arg == "--counters" || startswith(arg, "--counters=")) {
+            if (startswith(arg, "--counters="))
+                o.counters = arg.substr(arg.find('=') + 1);
+            o.count = true;
+            o.cache = false;
+        } else if (arg == "-g" || arg == "--gdb") {
+            o.gdb = true;
+            o.cache = false;
         } else if (arg == "-v" || arg == "--verbose") {
             log.set_log_level(LogLevel::success);
         } else if (arg == "-d" || arg == "--debug") {
@@ -149,18 +320,106 @@ static void parse_run_options(std::vector<std::string> args, options &o) {
 
     if (o.src_file.empty())
         print_run_help(sprint("Missing source file!"));
+
+    // tiering up maps a new code buffer per hot function, the profiler
+    // expects one that only grows
+    if (!o.profile.empty() && o.engine != "jit")
+        print_run_help("profile requires the jit engine");
+    // the interpreter doesn't keep any
+    if (o.count && o.engine != "jit")
+        print_run_help("counters require the jit engine");
+    if (o.perf_stats && o.engine != "jit")
+        print_run_help("perf-stats requires the jit engine");
+}
+
+static void parse_bench_options(std::vector<std::string> args, options &o) {
+    o.fmt = "x64";
+    bench_options &b = o.bench_opts;
+
+    for (unsigned i = 1; i < args.size(); i++) {
+        std::string &arg = args[i];
+        long n;
+
+        if (parse_common_option(args, i, o))
+            continue;
+
+        if (arg == "-h" || arg == "--help") {
+            print_bench_help("");
+        } else if (arg == "-n" || arg == "--runs") {
+            if (i + 1 < args.size() && parse_number(args[++i], 1, n))
+                b.runs = n;
+            else
+                print_bench_help("runs requires a positive number");
+        } else if (arg == "-w" || arg == "--warmup") {
+            if (i + 1 < args.size() && parse_number(args[++i], 0, n))
+                b.warmup = n;
+            else
+                print_bench_help("warmup requires a number");
+        } else if (arg == "-i" || arg == "--input") {
+            if (i + 1 < args.size())
+                b.input = args[++i];
+            else
+                print_bench_help("input requires an argument");
+        } else if (arg == "-o" || arg == "--output") {
+            if (i + 1 < args.size())
+                b.output = args[++i];
+            else
+                print_bench_help("output requires an argument");
+        } else if (arg == "--cpu") {
+            if (i + 1 < args.size() && parse_number(args[++i], 0, n))
+                b.cpu = n;
+            else
+                print_bench_help("cpu requires a number");
+        } else if (arg == "--json") {
+            if (i + 1 < args.size())
+                b.json = args[++i];
+            else
+                print_bench_help("json requires a file as arg");
+        } else if (arg == "--compare") {
+            if (i + 1 < args.size())
+                b.compare = args[++i];
+            else
+                print_bench_help("compare requires a file as arg");
+        } else if (arg == "--no-cache") {
+            o.cache = false;
+        } else if (arg == "-v" || arg == "--verbose") {
+            log.set_log_level(LogLevel::success);
+        } else if (arg == "-d" || arg == "--debug") {
+            log.set_log_level(LogLevel::info);
+        } else if (arg[0] == '-') {
+            print_bench_help(concat("unknown option ", arg, " is invalid"));
+        } else if (o.src_file.empty()) {
+            o.src_file = arg;
+        } else {
+            print_bench_help(
+                concat("only one positional argument supported, found ",
+                       o.src_file, " and ", arg));
+        }
+    }
+
+    if (o.src_file.empty())
+        print_bench_help(sprint("Missing source file!"));
+
+    // the interval needs the variance
+    if (!b.compare.empty() && b.runs < 2)
+        print_bench_help("compare requires at least 2 runs");
 }
 
 static void parse_options(std::vector<std::string> args, options &o) {
     if (args.empty()) {
         print_basic_help("No command given");
     } else if (args[0] == "r" || args[0] == "run") {
-        log.info("Executing the run command");
+        log_info("Executing the run command");
         parse_run_options(args, o);
         o.run = true;
         return;
+    } else if (args[0] == "b" || args[0] == "bench") {
+        log_info("Executing the bench command");
+        parse_bench_options(args, o);
+        o.run = o.bench = true;
+        return;
     } else if (args[0] == "c" || args[0] == "compile") {
-        log.info("Executing the compile command");
+        log_info("Executing the compile command");
         parse_compile_options(args, o);
         return;
     } else {
@@ -168,27 +427,57 @@ static void parse_options(std::vector<std::string> args, options &o) {
     }
 }
 
-static void x64_run(options &o, Assembler &a) {
-    if (X64Assembler *x64 = dynamic_cast<X64Assembler *>(&a)) {
-        if (!o.input_file.empty())
-            assert(freopen(o.input_file.c_str(), "r", stdin));
+static void run(options &o, Assembler &a) {
+    // bench redirects stdin and stdout itself, for every run
+    if (o.bench)
+        exit(x64_bench(dynamic_cast<X64Assembler &>(a), o.src_file,
+                       o.bench_opts));
+
+    if (o.perf == "map")
+        perf_sink.open(PerfFormat::map);
+    else if (o.perf == "jitdump")
+        perf_sink.open(PerfFormat::jitdump);
+
+    if (o.gdb)
+        gdb_jit.open();
+
+    if (!o.profile.empty())
+        profiler.open(o.profile);
 
-        if (!o.output_file.empty())
-            assert(freopen(o.output_file.c_str(), "w+", stdout));
+    if (o.count)
+        counters.open(o.counters);
 
+    if (o.perf_stats)
+        perf_stats.open();
+
+    if (!o.input_file.empty())
+        assert(freopen(o.input_file.c_str(), "r", stdin));
+
+    if (!o.output_file.empty())
+        assert(freopen(o.output_file.c_str(), "w+", stdout));
+
+    if (X64Assembler *x64 = dynamic_cast<X64Assembler *>(&a))
         x64->run();
-    } else {
+    else if (InterpAssembler *interp = dynamic_cast<InterpAssembler *>(&a))
+        interp->run();
+    else
         log.panic("Format might have been wrong");
-    }
 }
 
-static void compile_to_file(options &o, Assembler &a) {
+static std::string compile_to_string(Assembler &a) {
+    Phase phase{"codegen"};
+    std::ostringstream code;
+    a.compile(code);
+    return code.str();
+}
+
+static void write_to_file(options &o, const std::string &code) {
     if (o.output_file.empty()) {
-        log.info("Writing to stdout");
-        a.compile(std::cout);
+        log_info("Writing to stdout");
+        std::cout.write(code.data(), code.size());
     }
     else {
-        log.info("Writing to file %s", o.output_file.c_str());
+        log_info("Writing to file %s", o.output_file.c_str());
 
         std::ofstream out_file;
         out_file.open(o.output_file, std::ios::binary);
@@ -196,14 +485,19 @@ static void compile_to_file(options &o, Assembler &a) {
             log.panic("File %s couldn't be opened for writing",
                         o.output_file.c_str());
 
-        a.compile(out_file);
+        out_file.write(code.data(), code.size());
         out_file.close();
+
+        if (o.fmt == "elf")
+            chmod(o.output_file.c_str(), 0755);
     }
 }
 
 static void handle_input(options o, Assembler &a) {
+    Phase phase{"frontend"};
+
     if (endswith(o.src_file, ".ijvm")) {
-        log.info("Compiling src file %s as ijvm", o.src_file.c_str());
+        log_info("Compiling src file %s as ijvm", o.src_file.c_str());
         Buffer b{1024};
 
         b.map_file(o.src_file);
@@ -215,21 +509,23 @@ static void handle_input(options o, Assembler &a) {
     l.add_source(o.src_file);
 
     if (endswith(o.src_file, ".jas")) {
-        log.info("Compiling src file %s as jas", o.src_file.c_str());
+        log_info("Compiling src file %s as jas", o.src_file.c_str());
         jas_compile(l, a);
     }
     else if (endswith(o.src_file, ".ij")) {
-        log.info("Compiling src file %s as ij", o.src_file.c_str());
-        ij_compile(l, a);
+        log_info("Compiling src file %s as ij", o.src_file.c_str());
+        ij_compile(l, a, o.opt);
     }
     else
         log.panic("Can't parse file %s, extension unknown!", o.src_file.c_str());
 
+    stats.count("tokens lexed", l.tokens_lexed());
 }
 
 int main(int argc, char **argv) {
     options o;
     parse_options(args(argc, argv), o);
+    stats.open(o.stats, o.trace);
 
     std::unique_ptr<Assembler> a;
 
@@ -237,16 +533,51 @@ int main(int argc, char **argv) {
         a = std::make_unique<JASAssembler>();
     else if (o.fmt == "ijvm")
         a = std::make_unique<IJVMAssembler>();
+    else if (o.fmt == "elf")
+        a = std::make_unique<ElfAssembler>();
+    else if (o.fmt == "obj")
+        a = std::make_unique<ObjAssembler>();
+    else if (o.run && o.engine != "jit")
+        a = std::make_unique<InterpAssembler>(o.engine == "tiered");
     else
         a = std::make_unique<X64Assembler>();
 
+    // the interpreters have no code worth keeping, run shares x64 with compile
+    Cache cache{o.cache ? Cache::default_dir() : ""};
+    bool cached = cache.enabled() && (!o.run || o.engine == "jit");
+    std::string key, code;
+
     try {
+        if (cached) {
+            bool hit;
+            {
+                Phase phase{"cache"};
+                key = cache.key(o.src_file, o.fmt + " " + o.opt.str());
+                hit = cache.load(key, code);
+            }
+
+            if (hit) {
+                if (!o.run)
+                    write_to_file(o, code);
+                else {
+                    dynamic_cast<X64Assembler &>(*a).load(code);
+                    run(o, *a);
+                }
+                return 0;
+            }
+        }
+
         handle_input(o, *a);
 
         if (o.run) {
-            x64_run(o, *a);
+            // caching needs all of the code, generating it up front would
+            // undo lazy compilation, so only ij compile -f x64 stores it
+            run(o, *a);
         } else {
-            compile_to_file(o, *a);
+            code = compile_to_string(*a);
+            if (cached)
+                cache.store(key, code);
+            write_to_file(o, code);
         }
 
     } catch (std::runtime_error &r) {
@@ -287,7 +287,7 @@ void Buffer::grow(unsigned new_size) {
     while (new_cap < new_size)
         new_cap *= 2;
 
-    log.info("Growing buffer from %d to %d", _capacity, new_cap);
+    log_info("Growing buffer from %d to %d", _capacity, new_cap);
 
     void *internal_new = realloc(_internal, new_cap);
     if (!internal_new)
@@ -308,12 +308,12 @@ void Buffer::map_file(std::string filename) {
     size_t bytes_read;
 
     while ((bytes_read = fread(contents, 1, 1024, input_file)) != 0) {
-        log.info("Reading chunk of %d", bytes_read);
+        log_info("Reading chunk of %d", bytes_read);
         raw_append(contents, bytes_read);
     }
 
     fclose(input_file);
 
-    log.info("File %s, mapped in.", filename.c_str());
-    log.info("Buffer of size: %d", this->size());
+    log_info("File %s, mapped in.", filename.c_str());
+    log_info("Buffer of size: %d", this->size());
 }
\ No newline at end of file
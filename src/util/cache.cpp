@@ -0,0 +1,172 @@
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cache.hpp"
+#include "types.h"
+#include "util.hpp"
+
+/* bump when the layout of the cached outputs changes */
+static const char *cache_version = "ij-cache-1";
+
+/* two 64 bit hashes side by side, collisions would silently run wrong code */
+struct hasher {
+    u64 a = 0xcbf29ce484222325ULL; /* FNV-1a */
+    u64 b = 0x9e3779b97f4a7c15ULL;
+
+    void add(const std::string &s) {
+        for (unsigned char c : s) {
+            a = (a ^ c) * 0x100000001b3ULL;
+            b = (b ^ c) * 0xff51afd7ed558ccdULL;
+            b ^= b >> 29;
+        }
+
+        // separator, so "ab" + "c" and "a" + "bc" differ
+        a = (a ^ 0xff) * 0x100000001b3ULL;
+        b = (b ^ s.size()) * 0xc4ceb9fe1a85ec53ULL;
+    }
+
+    std::string hex() const { return sprint("%016x%016x", a, b); }
+};
+
+static bool read_file(const std::string &path, std::string &data) {
+    std::ifstream in{path, std::ios::binary};
+    if (!in.is_open())
+        return false;
+
+    std::ostringstream s;
+    s << in.rdbuf();
+    data = s.str();
+    return !in.bad();
+}
+
+/* the files named by import "<file>" statements, a superset is fine */
+static std::vector<std::string> imports(const std::string &src) {
+    std::vector<std::string> files;
+
+    for (size_t at = src.find("import"); at != std::string::npos;
+         at = src.find("import", at + 1)) {
+        if (at > 0 && (isalnum(src[at - 1]) || src[at - 1] == '_'))
+            continue;
+
+        size_t open = src.find_first_not_of(" \t\r\n", at + 6);
+        if (open == std::string::npos || src[open] != '"')
+            continue;
+
+        size_t close = src.find('"', open + 1);
+        if (close != std::string::npos)
+            files.push_back(src.substr(open + 1, close - open - 1));
+    }
+
+    return files;
+}
+
+/* a rebuilt compiler may generate different code */
+static std::string compiler_identity() {
+    char path[4096];
+    ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (n < 0)
+        return "";
+    path[n] = '\0';
+
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return "";
+
+    return sprint("%s %d %d.%d", path, (long)st.st_size,
+                  (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+}
+
+Cache::Cache(std::string dir) : _dir{dir} {}
+
+std::string Cache::default_dir() {
+    if (const char *dir = getenv("IJ_CACHE_DIR"))
+        return dir;
+    if (const char *xdg = getenv("XDG_CACHE_HOME"))
+        return concat(std::string{xdg}, "/ij");
+    if (const char *home = getenv("HOME"))
+        return concat(std::string{home}, "/.cache/ij");
+    return "";
+}
+
+std::string Cache::key(const std::string &src_file,
+                       const std::string &variant) {
+    hasher h;
+    h.add(cache_version);
+    h.add(compiler_identity());
+    h.add(variant);
+
+    // imports resolve like the lexer does, relative to the importing file
+    std::vector<std::string> todo{src_file};
+    std::set<std::string> seen;
+    while (!todo.empty()) {
+        std::string file = todo.back();
+        todo.pop_back();
+        if (seen.count(file))
+            continue;
+        seen.insert(file);
+
+        std::string src;
+        h.add(file);
+        h.add(read_file(file, src) ? src : "<missing>");
+
+        if (!endswith(file, ".ij"))
+            continue;
+
+        std::string dir = file.substr(0, file.find_last_of("/\\") + 1);
+        for (const std::string &import : imports(src))
+            todo.push_back(dir + import);
+    }
+
+    return h.hex();
+}
+
+bool Cache::load(const std::string &key, std::string &data) {
+    if (!enabled())
+        return false;
+
+    bool hit = read_file(concat(_dir, "/", key), data);
+    log_info("cache: %s %s", hit ? "hit" : "miss", key.c_str());
+    return hit;
+}
+
+/* like mkdir -p */
+static bool make_dirs(const std::string &dir) {
+    for (size_t at = dir.find('/', 1);; at = dir.find('/', at + 1)) {
+        std::string part = dir.substr(0, at);
+        if (mkdir(part.c_str(), 0755) < 0 && errno != EEXIST)
+            return false;
+        if (at == std::string::npos)
+            return true;
+    }
+}
+
+void Cache::store(const std::string &key, const std::string &data) {
+    if (!enabled())
+        return;
+
+    if (!make_dirs(_dir)) {
+        log_info("cache: can't create %s, %s", _dir.c_str(), strerror(errno));
+        return;
+    }
+
+    std::string path = concat(_dir, "/", key);
+    std::string tmp = sprint("%s.%d.tmp", path, (int)getpid());
+
+    std::ofstream out{tmp, std::ios::binary};
+    out.write(data.data(), data.size());
+    out.close();
+
+    if (!out || rename(tmp.c_str(), path.c_str()) < 0) {
+        log_info("cache: can't write %s, %s", path.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+        return;
+    }
+
+    log_info("cache: stored %s, %lu bytes", key.c_str(), data.size());
+}
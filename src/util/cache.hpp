@@ -0,0 +1,30 @@
+#ifndef UTIL_CACHE_HPP
+#define UTIL_CACHE_HPP
+#include <string>
+
+/*
+ * Content addressed store for compiled programs. A key hashes everything the
+ * output depends on: the source, the files it imports (transitively), what is
+ * being produced and the compiler binary itself. Entries are written to a
+ * temporary file and renamed, so concurrent compilers never see half of one.
+ */
+class Cache {
+  public:
+    Cache(std::string dir); /* an empty dir disables the cache */
+
+    /* $IJ_CACHE_DIR, $XDG_CACHE_HOME/ij or ~/.cache/ij */
+    static std::string default_dir();
+
+    /* variant tells apart different outputs of the same source */
+    std::string key(const std::string &src_file, const std::string &variant);
+
+    bool load(const std::string &key, std::string &data); /* true on a hit */
+    void store(const std::string &key, const std::string &data);
+
+    bool enabled() const { return !_dir.empty(); }
+
+  private:
+    std::string _dir;
+};
+
+#endif
@@ -1,9 +1,19 @@
 #include <execinfo.h>
 #include <unistd.h>
+#include <signal.h>
 #include "logger.hpp"
+#include "types.h"
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 /* Color definitions */
 #define COL_YELLOW "\033[33;1m"
@@ -13,65 +23,278 @@
 #define COL_RST "\033[0m"
 
 /* Log levels */
-const LogLevelImpl log_info("INFO", COL_BLUE);
-const LogLevelImpl log_succ("SUCC", COL_GREEN);
-const LogLevelImpl log_warn("WARN", COL_YELLOW);
-const LogLevelImpl log_err("ERR", COL_RED);
+const LogLevelImpl level_info("INFO", COL_BLUE);
+const LogLevelImpl level_succ("SUCC", COL_GREEN);
+const LogLevelImpl level_warn("WARN", COL_YELLOW);
+const LogLevelImpl level_err("ERR", COL_RED);
+
+/*
+ * The background half of the logger. Every thread that logs gets a ring of
+ * its own which only that thread writes and only the drain thread reads,
+ * so logging takes no locks: the message is formatted into the ring as a
+ * record header followed by the text, and the drain thread adds the level
+ * prefix and does the I/O. The global sequence number keeps the records of
+ * different threads in the order they were logged. Whatever is still in
+ * the rings when the process crashes is lost, exit() writes it out.
+ */
+class LogSink {
+  public:
+    LogSink(Logger &logger) : _logger{logger}, _seq{0}, _stopping{false} {}
+
+    void write(const LogLevelImpl &lvl, const char *text, size_t len);
+    void stop();
+
+  private:
+    static const size_t ring_size = 1 << 16;
+
+    struct record {
+        u64 seq;
+        const LogLevelImpl *lvl;
+        size_t len; /* of the text following the header */
+    };
+
+    /* head and tail only ever grow, the bytes in use are head - tail */
+    struct ring {
+        ring() : head{0}, tail{0} {}
+
+        void put(size_t at, const void *src, size_t n);
+        void get(size_t at, void *dst, size_t n) const;
+
+        std::atomic<size_t> head, tail;
+        char data[ring_size];
+    };
+
+    ring *local();
+    void start();
+    void run();
+    void drain();
+    void wake() { _wake.notify_one(); }
+
+    Logger &_logger;
+    std::atomic<u64> _seq;
+
+    std::mutex _rings_lock; /* registering a thread */
+    std::vector<std::unique_ptr<ring>> _rings;
+
+    std::mutex _drain_lock; /* one drain at a time, and the output */
+    std::once_flag _started;
+    std::thread _thread;
+    std::mutex _wake_lock;
+    std::condition_variable _wake;
+    bool _stopping;
+};
+
+void LogSink::ring::put(size_t at, const void *src, size_t n) {
+    size_t offset = at % ring_size, first = std::min(n, ring_size - offset);
+    memcpy(data + offset, src, first);
+    memcpy(data, (const char *)src + first, n - first);
+}
+
+void LogSink::ring::get(size_t at, void *dst, size_t n) const {
+    size_t offset = at % ring_size, first = std::min(n, ring_size - offset);
+    memcpy(dst, data + offset, first);
+    memcpy((char *)dst + first, data, n - first);
+}
+
+LogSink::ring *LogSink::local() {
+    static thread_local LogSink *owner = nullptr;
+    static thread_local ring *mine = nullptr;
+    if (owner == this)
+        return mine;
+
+    std::lock_guard<std::mutex> guard(_rings_lock);
+    _rings.emplace_back(new ring());
+    owner = this;
+    mine = _rings.back().get();
+    return mine;
+}
+
+void LogSink::start() {
+    // the drain thread shouldn't take SIGPROF or other signals meant for
+    // the program, it inherits the mask
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    _thread = std::thread(&LogSink::run, this);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+    // before the destructors of the other globals, which print reports
+    if (&_logger == &log)
+        atexit([] { log.stop(); });
+}
+
+void LogSink::write(const LogLevelImpl &lvl, const char *text, size_t len) {
+    std::call_once(_started, &LogSink::start, this);
+
+    size_t need = sizeof(record) + len;
+    if (need > ring_size) {
+        // never fits, write it out in order with the rest
+        std::lock_guard<std::mutex> guard(_drain_lock);
+        drain();
+        _logger.print(lvl, text, len);
+        fflush(_logger._out);
+        return;
+    }
+
+    ring *r = local();
+    size_t head = r->head.load(std::memory_order_relaxed);
+    while (ring_size - (head - r->tail.load(std::memory_order_acquire)) < need) {
+        wake();
+        std::this_thread::yield();
+    }
+
+    record header = {_seq.fetch_add(1, std::memory_order_relaxed), &lvl, len};
+    r->put(head, &header, sizeof(header));
+    r->put(head + sizeof(header), text, len);
+    r->head.store(head + need, std::memory_order_release);
+
+    if (head + need - r->tail.load(std::memory_order_relaxed) > ring_size / 2)
+        wake();
+}
+
+/* writes the records of all threads, lowest sequence number first */
+void LogSink::drain() {
+    std::vector<ring *> rings;
+    {
+        std::lock_guard<std::mutex> guard(_rings_lock);
+        for (auto &r : _rings)
+            rings.push_back(r.get());
+    }
+
+    std::vector<char> text;
+    while (true) {
+        ring *next = nullptr;
+        record header, first = {0, nullptr, 0};
+        for (ring *r : rings) {
+            size_t tail = r->tail.load(std::memory_order_relaxed);
+            if (tail == r->head.load(std::memory_order_acquire))
+                continue;
+
+            r->get(tail, &header, sizeof(header));
+            if (!next || header.seq < first.seq) {
+                next = r;
+                first = header;
+            }
+        }
+        if (!next)
+            break;
+
+        size_t tail = next->tail.load(std::memory_order_relaxed);
+        text.resize(first.len);
+        next->get(tail + sizeof(first), text.data(), first.len);
+        next->tail.store(tail + sizeof(first) + first.len,
+                         std::memory_order_release);
+        _logger.print(*first.lvl, text.data(), first.len);
+    }
+    fflush(_logger._out);
+}
+
+void LogSink::run() {
+    std::unique_lock<std::mutex> lock(_wake_lock);
+    while (!_stopping) {
+        lock.unlock();
+        {
+            std::lock_guard<std::mutex> guard(_drain_lock);
+            drain();
+        }
+        lock.lock();
+
+        // loggers only wake us up when they fill up, poll otherwise
+        if (!_stopping)
+            _wake.wait_for(lock, std::chrono::milliseconds(10));
+    }
+}
+
+void LogSink::stop() {
+    {
+        std::lock_guard<std::mutex> guard(_wake_lock);
+        _stopping = true;
+    }
+    wake();
+    if (_thread.joinable())
+        _thread.join();
+
+    std::lock_guard<std::mutex> guard(_drain_lock);
+    drain();
+}
 
 /* define the global logger instance */
 Logger log;
 
-Logger::Logger(FILE *out, bool force_col) {
+Logger::Logger(FILE *out, bool force_col) : _writers{0} {
     _out = out == nullptr ? stderr : out;
     _col_enabled = (_out == stdout || _out == stderr || force_col);
     _log_level = LogLevel::warn;
+    _sink = new LogSink(*this);
 }
 
 Logger::~Logger() {
+    stop();
+
     if (_out != stdout && _out != stderr)
         fclose(_out);
 }
 
+/*
+ * Threads logging right now may have loaded the sink before it was taken
+ * away, it is only stopped and freed once they are done with it. Anyone
+ * logging afterwards writes synchronously.
+ */
+void Logger::stop() {
+    LogSink *sink = _sink.exchange(nullptr);
+    if (!sink)
+        return;
+
+    while (_writers.load() > 0)
+        std::this_thread::yield();
+
+    sink->stop();
+    delete sink;
+}
+
 void Logger::set_log_level(LogLevel level) { _log_level = level; }
 
 void Logger::info(const char *fmt, ...) {
-    if (_log_level < LogLevel::info)
+    if (!logs(LogLevel::info))
         return;
 
     va_list args;
 
     va_start(args, fmt);
-    log(log_info, fmt, args);
+    log(level_info, fmt, args);
     va_end(args);
 }
 
 void Logger::success(const char *fmt, ...) {
-    if (_log_level < LogLevel::success)
+    if (!logs(LogLevel::success))
         return;
 
     va_list args;
 
     va_start(args, fmt);
-    log(log_succ, fmt, args);
+    log(level_succ, fmt, args);
     va_end(args);
 }
 
 void Logger::warn(const char *fmt, ...) {
-    if (_log_level < LogLevel::warn)
+    if (!logs(LogLevel::warn))
         return;
 
     va_list args;
 
     va_start(args, fmt);
-    log(log_warn, fmt, args);
+    log(level_warn, fmt, args);
     va_end(args);
 }
 
 void Logger::panic(const char *fmt, ...) {
+    // everything logged before goes out first
+    stop();
+
     va_list args;
 
     va_start(args, fmt);
-    log(log_err, fmt, args);
+    log(level_err, fmt, args);
     va_end(args);
 
 
@@ -86,8 +309,6 @@ void Logger::panic(const char *fmt, ...) {
     exit(1);
 }
 
-// TODO add minimal log level system in here
-
 // explain to the compiler that this function has a
 // format string and that we're not really into this
 // whole format string checking. See https://stackoverflow.com/a/36120843
@@ -97,11 +318,38 @@ void Logger::panic(const char *fmt, ...) {
 // 2. the logger class' this argument is implicitly added.
 __attribute__((__format__(__printf__, 3, 0))) void
 Logger::log(const LogLevelImpl &lvl, const char *fmt, va_list args) {
-    if (_col_enabled)
-        fprintf(_out, "[%s%s%s] ", lvl.color, lvl.name, COL_RST);
+    static thread_local std::vector<char> text(256);
+
+    va_list again;
+    va_copy(again, args);
+    int len = vsnprintf(text.data(), text.size(), fmt, args);
+    if (len >= 0 && (size_t)len >= text.size()) {
+        text.resize(len + 1);
+        vsnprintf(text.data(), text.size(), fmt, again);
+    }
+    va_end(again);
+    if (len < 0)
+        return;
+
+    // announced before looking at the sink, so stop() either sees this
+    // thread or this thread sees no sink
+    _writers.fetch_add(1);
+    if (LogSink *sink = _sink.load())
+        sink->write(lvl, text.data(), len);
     else
-        fprintf(_out, "[%s] ", lvl.name);
+        print(lvl, text.data(), len);
+    _writers.fetch_sub(1);
+}
 
-    vfprintf(_out, fmt, args);
-    fprintf(_out, "\n");
+/* one write per message, so lines of different threads don't mix */
+void Logger::print(const LogLevelImpl &lvl, const char *text, size_t len) {
+    std::string line = "[";
+    if (_col_enabled)
+        line = line + lvl.color + lvl.name + COL_RST;
+    else
+        line += lvl.name;
+    line += "] ";
+    line.append(text, len);
+    line += '\n';
+    fwrite(line.data(), 1, line.size(), _out);
 }
@@ -2,6 +2,7 @@
  * Logger utility
  *************************************************/
 #pragma once
+#include <atomic>
 #include <iostream>
 #include <sstream>
 #include <vector>
@@ -49,6 +50,14 @@ template <typename T> std::string str(const T &obj) {
 
 #define cstr(obj) str(obj).c_str()
 
+class LogSink;
+
+/*
+ * Messages are formatted by the thread logging them and handed to a
+ * background thread which does the writing, see LogSink in logger.cpp.
+ * Logging is safe from any thread. Panics, and anything logged once the
+ * program is exiting, are written synchronously.
+ */
 class Logger {
   public:
     Logger(FILE *out = nullptr, bool force_col = false);
@@ -61,10 +70,19 @@ class Logger {
 
     void set_log_level(LogLevel level);
     inline const LogLevel &get_log_level() const { return _log_level; }
+    inline bool logs(LogLevel level) const { return level <= _log_level; }
+
+    /* writes out whatever is queued and stops the background thread */
+    void stop();
 
   private:
     void log(const LogLevelImpl &lvl, const char *fmt, va_list args);
+    void print(const LogLevelImpl &lvl, const char *text, size_t len);
+
+    friend class LogSink;
 
+    std::atomic<LogSink *> _sink;
+    std::atomic<int> _writers; /* threads that may still use the sink */
     FILE *_out;
     bool _col_enabled;
     LogLevel _log_level;
@@ -72,3 +90,26 @@ class Logger {
 
 /* Global logger instance */
 extern Logger log;
+
+/*
+ * Levels above LOG_LEVEL_MAX are compiled out, make release keeps only the
+ * warnings and errors. Defaults to everything.
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX 3
+#endif
+
+/*
+ * Use these rather than log.info / log.success, they check the level before
+ * evaluating any of the arguments, so a dropped cstr(*ast) costs nothing.
+ * The arguments are still type checked when the level is compiled out.
+ */
+#define log_at(level, ...)                                                     \
+    do {                                                                       \
+        if ((int)LogLevel::level <= LOG_LEVEL_MAX &&                           \
+            log.logs(LogLevel::level))                                         \
+            log.level(__VA_ARGS__);                                            \
+    } while (0)
+
+#define log_info(...) log_at(info, __VA_ARGS__)
+#define log_success(...) log_at(success, __VA_ARGS__)
@@ -91,6 +91,49 @@ enum class opcode : u8
 };
 // clang-format on
 
+constexpr const char *opcode_name(opcode op) {
+    switch (op) {
+        case opcode::BIPUSH:        return "BIPUSH";
+        case opcode::DUP:           return "DUP";
+        case opcode::ERR:           return "ERR";
+        case opcode::GOTO:          return "GOTO";
+        case opcode::HALT:          return "HALT";
+        case opcode::IADD:          return "IADD";
+        case opcode::IAND:          return "IAND";
+        case opcode::IFEQ:          return "IFEQ";
+        case opcode::IFLT:          return "IFLT";
+        case opcode::ICMPEQ:        return "ICMPEQ";
+        case opcode::IINC:          return "IINC";
+        case opcode::ILOAD:         return "ILOAD";
+        case opcode::IN:            return "IN";
+        case opcode::INVOKEVIRTUAL: return "INVOKEVIRTUAL";
+        case opcode::IOR:           return "IOR";
+        case opcode::IRETURN:       return "IRETURN";
+        case opcode::ISTORE:        return "ISTORE";
+        case opcode::ISUB:          return "ISUB";
+        case opcode::LDC_W:         return "LDC_W";
+        case opcode::NOP:           return "NOP";
+        case opcode::OUT:           return "OUT";
+        case opcode::POP:           return "POP";
+        case opcode::SWAP:          return "SWAP";
+        case opcode::WIDE:          return "WIDE";
+        case opcode::NEWARRAY:      return "NEWARRAY";
+        case opcode::IALOAD:        return "IALOAD";
+        case opcode::IASTORE:       return "IASTORE";
+        case opcode::GC:            return "GC";
+        case opcode::NETBIND:       return "NETBIND";
+        case opcode::NETCONNECT:    return "NETCONNECT";
+        case opcode::NETIN:         return "NETIN";
+        case opcode::NETOUT:        return "NETOUT";
+        case opcode::NETCLOSE:      return "NETCLOSE";
+        case opcode::SHL:           return "SHL";
+        case opcode::SHR:           return "SHR";
+        case opcode::IMUL:          return "IMUL";
+        case opcode::IDIV:          return "IDIV";
+        default:                    return "INVALID";
+    }
+}
+
 constexpr opcode opcode_parse(u8 i) {
     switch(static_cast<opcode>(i)) {
         case opcode::BIPUSH:
@@ -0,0 +1,176 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "stats.hpp"
+#include "logger.hpp"
+
+Stats stats;
+
+static u64 steady_us() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static long peak_rss() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* names are identifiers and paths, but a stray quote shouldn't break json */
+static std::string json(const std::string &s) {
+    std::string escaped;
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        if ((unsigned char)c >= ' ')
+            escaped += c;
+    }
+    return escaped;
+}
+
+Stats::Stats() : _report{false}, _epoch{0}, _depth{0} {}
+
+Stats::~Stats() {
+    if (_report)
+        report();
+    if (!_trace.empty())
+        trace();
+}
+
+void Stats::open(bool report, const std::string &trace) {
+    _report = report;
+    _trace = trace;
+    _epoch = steady_us();
+}
+
+u64 Stats::now() const { return steady_us() - _epoch; }
+
+void Stats::count(const std::string &what, u64 n) {
+    if (!enabled())
+        return;
+
+    for (auto &entry : _counts)
+        if (entry.first == what) {
+            entry.second += n;
+            return;
+        }
+    _counts.push_back({what, n});
+}
+
+Phase::Phase(const std::string &name, const std::string &function)
+    : _index{(size_t)-1} {
+    if (!stats.enabled())
+        return;
+
+    _index = stats._phases.size();
+    stats._phases.push_back({name, function, stats._depth++, stats.now(), 0, 0});
+}
+
+Phase::~Phase() {
+    if (_index == (size_t)-1)
+        return;
+
+    Stats::phase &p = stats._phases[_index];
+    p.duration = stats.now() - p.start;
+    p.rss = peak_rss();
+    stats._depth--;
+}
+
+/*
+ * The per function phases directly below depth and the ones in them, summed
+ * up by name and depth.
+ */
+void Stats::report_functions(size_t from, size_t depth,
+                             const char *note) const {
+    const std::vector<phase> &phases = _phases;
+    std::vector<std::pair<std::pair<std::string, size_t>, std::pair<u64, size_t>>>
+        functions;
+    std::vector<bool> counted{true}; /* by depth - depth, the one above it */
+    for (size_t i = from; i < phases.size() && phases[i].depth >= depth; i++) {
+        const phase &f = phases[i];
+        size_t d = f.depth - depth;
+        counted.resize(d + 2);
+        counted[d + 1] = !f.function.empty() && counted[d];
+        if (!counted[d + 1])
+            continue;
+
+        auto key = std::make_pair(f.name, f.depth);
+        auto it = functions.begin();
+        while (it != functions.end() && it->first != key)
+            it++;
+        if (it == functions.end())
+            it = functions.insert(it, {key, {0, 0}});
+        it->second.first += f.duration;
+        it->second.second++;
+    }
+
+    for (auto &entry : functions) {
+        std::string name = std::string(2 * entry.first.second, ' ') +
+                           entry.first.first + " x" +
+                           std::to_string(entry.second.second) + note;
+        fprintf(stderr, "  %-28s %10.3f\n", name.c_str(),
+                entry.second.first / 1e3);
+    }
+}
+
+void Stats::report() const {
+    fprintf(stderr, "\nstats:\n  %-28s %10s %12s\n", "phase", "ms",
+            "peak rss KiB");
+
+    for (size_t i = 0; i < _phases.size(); i++) {
+        const phase &p = _phases[i];
+        if (!p.function.empty())
+            continue;
+
+        std::string name = std::string(2 * p.depth, ' ') + p.name;
+        fprintf(stderr, "  %-28s %10.3f %12ld\n", name.c_str(),
+                p.duration / 1e3, p.rss);
+        report_functions(i + 1, p.depth + 1, "");
+    }
+
+    // functions generated lazily, while the program runs
+    report_functions(0, 0, " (lazily)");
+
+    for (auto &entry : _counts)
+        fprintf(stderr, "  %-28s %10lu\n", entry.first.c_str(),
+                (unsigned long)entry.second);
+}
+
+void Stats::trace() const {
+    FILE *out = fopen(_trace.c_str(), "w");
+    if (!out) {
+        log.warn("stats: couldn't open %s, %s", _trace.c_str(),
+                 strerror(errno));
+        return;
+    }
+
+    int pid = getpid();
+    fprintf(out, "{\"traceEvents\": [\n");
+    for (const phase &p : _phases) {
+        std::string name = p.function.empty() ? p.name
+                                               : p.name + " " + p.function;
+        fprintf(out,
+                "  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                "\"ts\": %lu, \"dur\": %lu, \"pid\": %d, \"tid\": %d, "
+                "\"args\": {\"peak_rss_kib\": %ld}},\n",
+                json(name).c_str(), p.function.empty() ? "phase" : "function",
+                (unsigned long)p.start, (unsigned long)p.duration, pid, pid,
+                p.rss);
+    }
+
+    // the counts ride along as the arguments of one last instant event
+    fprintf(out, "  {\"name\": \"counts\", \"ph\": \"i\", \"s\": \"p\", "
+                 "\"ts\": %lu, \"pid\": %d, \"tid\": %d, \"args\": {",
+            (unsigned long)now(), pid, pid);
+    for (size_t i = 0; i < _counts.size(); i++)
+        fprintf(out, "%s\"%s\": %lu", i ? ", " : "",
+                json(_counts[i].first).c_str(),
+                (unsigned long)_counts[i].second);
+    fprintf(out, "}}\n]}\n");
+    fclose(out);
+}
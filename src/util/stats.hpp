@@ -0,0 +1,61 @@
+#ifndef UTIL_STATS_HPP
+#define UTIL_STATS_HPP
+#include <string>
+#include <vector>
+#include "types.h"
+
+/*
+ * Compiler statistics for --stats and --trace: wall time and peak RSS of
+ * every phase plus whatever the phases count (tokens, AST nodes, ...).
+ * Phases nest, those timing a single function only go to the trace, which
+ * is in the Chrome trace event format (chrome://tracing, ui.perfetto.dev).
+ * Both are written when the process exits.
+ */
+class Stats {
+  public:
+    Stats();
+    ~Stats();
+
+    void open(bool report, const std::string &trace);
+    bool enabled() const { return _report || !_trace.empty(); }
+
+    /* adds n to the counter called what */
+    void count(const std::string &what, u64 n);
+
+  private:
+    friend class Phase;
+
+    struct phase {
+        std::string name;
+        std::string function; /* empty for the phases of the whole program */
+        size_t depth;
+        u64 start, duration; /* in us since open */
+        long rss;            /* peak so far at the end of the phase, KiB */
+    };
+
+    u64 now() const;
+    void report() const;
+    void report_functions(size_t from, size_t depth, const char *note) const;
+    void trace() const;
+
+    bool _report;
+    std::string _trace;
+    u64 _epoch;
+    size_t _depth;
+    std::vector<phase> _phases; /* in order of starting */
+    std::vector<std::pair<std::string, u64>> _counts;
+};
+
+extern Stats stats;
+
+/* times the scope it lives in */
+class Phase {
+  public:
+    Phase(const std::string &name, const std::string &function = "");
+    ~Phase();
+
+  private:
+    size_t _index; /* into _phases, or -1 when stats are off */
+};
+
+#endif
@@ -27,6 +27,11 @@ static inline bool endswith(const std::string &string, const std::string &ending
     return elen <= slen && (0 == string.compare(slen - elen, elen, ending));
 }
 
+static inline bool startswith(const std::string &string, const std::string &start)
+{
+    return string.compare(0, start.length(), start) == 0;
+}
+
 /* optimised contains, for containers with and without find */
 template <class C, class T>
 inline auto contains_impl(const C &c, const T &x, int)